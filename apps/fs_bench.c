@@ -0,0 +1,742 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <crc32c.h>
+#include <disk.h>
+#include <fs.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define fs_bench_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_bench_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+struct bench_arg {
+	int argc;
+	char **argv;
+};
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret <= 0 || ret == LONG_MAX)
+		die("invalid number '%s'", argv);
+	return (size_t)ret;
+}
+
+/* Time format, mount/umount and block allocation of one FAT width */
+static void bench_fat_width(char *diskname, size_t data_blk_count,
+			    size_t iterations, int fat32)
+{
+	struct fs_format_opts opts = {
+		.data_blk_count = data_blk_count,
+		.file_count = FS_FILE_MAX_COUNT,
+		.fat32 = fat32,
+	};
+	double start, format_ms, mount_ms = 0, alloc_ms = 0;
+	size_t alloc_blocks = data_blk_count / 4;
+	char *buf;
+
+	buf = calloc(alloc_blocks, BLOCK_SIZE);
+	if (!buf)
+		die("Cannot malloc");
+
+	start = now_ms();
+	if (fs_format(diskname, &opts))
+		die("Cannot format diskname");
+	format_ms = now_ms() - start;
+
+	for (size_t i = 0; i < iterations; i++) {
+		start = now_ms();
+		if (fs_mount(diskname) || fs_umount())
+			die("Cannot mount diskname");
+		mount_ms += now_ms() - start;
+	}
+
+	/* Each run fills a quarter of the disk from a fresh image, so the
+	 * allocator always walks the same free FAT entries */
+	for (size_t i = 0; i < iterations; i++) {
+		int fd;
+
+		if (fs_format(diskname, &opts) || fs_mount(diskname))
+			die("Cannot mount diskname");
+		if (fs_create("bench") || (fd = fs_open("bench")) < 0)
+			die("Cannot create file");
+
+		start = now_ms();
+		if (fs_write(fd, buf, alloc_blocks * BLOCK_SIZE) < 0)
+			die("write error");
+		alloc_ms += now_ms() - start;
+
+		fs_close(fd);
+		if (fs_umount())
+			die("Cannot unmount diskname");
+	}
+
+	printf("fat%d: format %.2f ms, mount+umount %.3f ms, "
+	       "write %zu blocks %.2f ms\n", fat32 ? 32 : 16, format_ms,
+	       mount_ms / iterations, alloc_blocks, alloc_ms / iterations);
+	free(buf);
+}
+
+void bench_fat(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	size_t data_blk_count = 60000, iterations = 5;
+
+	if (b_arg->argc < 1)
+		die("Usage: <diskname> [<data block count> [<iterations>]]");
+	if (b_arg->argc > 1)
+		data_blk_count = get_argv(b_arg->argv[1]);
+	if (b_arg->argc > 2)
+		iterations = get_argv(b_arg->argv[2]);
+
+	printf("FAT width: %zu data blocks, %zu iterations\n", data_blk_count,
+	       iterations);
+	bench_fat_width(b_arg->argv[0], data_blk_count, iterations, 0);
+	bench_fat_width(b_arg->argv[0], data_blk_count, iterations, 1);
+}
+
+/* Stream one large file, then create many small ones, on one block size */
+static void bench_block_size(char *diskname, size_t block_size,
+			     size_t capacity, size_t stream_size,
+			     size_t small_count, size_t small_size)
+{
+	struct fs_format_opts opts = {
+		.data_blk_count = capacity / block_size,
+		.file_count = small_count + 1,
+		.block_size = block_size,
+	};
+	double start, write_ms, read_ms, small_ms;
+	size_t small_alloc;
+	char *buf, name[FS_FILENAME_LEN];
+	int fd;
+
+	buf = malloc(stream_size);
+	if (!buf)
+		die("Cannot malloc");
+	memset(buf, 'a', stream_size);
+
+	if (fs_format(diskname, &opts) || fs_mount(diskname))
+		die("Cannot mount diskname");
+	if (fs_create("stream") || (fd = fs_open("stream")) < 0)
+		die("Cannot create file");
+
+	start = now_ms();
+	if (fs_write(fd, buf, stream_size) != (int)stream_size)
+		die("write error");
+	write_ms = now_ms() - start;
+
+	fs_lseek(fd, 0);
+	start = now_ms();
+	if (fs_read(fd, buf, stream_size) != (int)stream_size)
+		die("read error");
+	read_ms = now_ms() - start;
+	fs_close(fd);
+
+	start = now_ms();
+	for (size_t i = 0; i < small_count; i++) {
+		snprintf(name, sizeof(name), "small%zu", i);
+		if (fs_create(name) || (fd = fs_open(name)) < 0)
+			die("Cannot create file");
+		if (fs_write(fd, buf, small_size) != (int)small_size)
+			die("write error");
+		fs_close(fd);
+	}
+	small_ms = now_ms() - start;
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	/* small files always occupy whole blocks */
+	small_alloc = small_count *
+		((small_size + block_size - 1) / block_size) * block_size;
+	printf("%6zu: stream write %7.1f MB/s, read %7.1f MB/s, "
+	       "%zu small files %7.2f ms, %5.1f%% slack\n", block_size,
+	       stream_size / write_ms / 1e3, stream_size / read_ms / 1e3,
+	       small_count, small_ms,
+	       100.0 * (small_alloc - small_count * small_size) / small_alloc);
+	free(buf);
+}
+
+void bench_blocksize(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	size_t capacity = 64 << 20, stream_size = 8 << 20;
+	size_t small_count = 100, small_size = 300;
+
+	if (b_arg->argc < 1)
+		die("Usage: <diskname> [<stream size> [<small file size>]]");
+	if (b_arg->argc > 1)
+		stream_size = get_argv(b_arg->argv[1]);
+	if (b_arg->argc > 2)
+		small_size = get_argv(b_arg->argv[2]);
+	if (stream_size > capacity / 2)
+		capacity = stream_size * 2;
+
+	printf("Block size: %zu MB disk, %zu byte stream, %zu byte small "
+	       "files\n", capacity >> 20, stream_size, small_size);
+	for (size_t bs = BLOCK_SIZE_MIN; bs <= BLOCK_SIZE_MAX; bs <<= 1)
+		bench_block_size(b_arg->argv[0], bs, capacity, stream_size,
+				 small_count, small_size);
+}
+
+/* Append fixed-size records to a file, optionally preallocated up front */
+static double bench_append(char *diskname, size_t record_size,
+			   size_t records, int prealloc)
+{
+	struct fs_format_opts opts = {
+		.data_blk_count = (record_size * records) / BLOCK_SIZE + 16,
+		.file_count = FS_FILE_MAX_COUNT,
+	};
+	double start, ms;
+	char *buf;
+	int fd;
+
+	buf = calloc(1, record_size);
+	if (!buf)
+		die("Cannot malloc");
+	if (fs_format(diskname, &opts) || fs_mount(diskname))
+		die("Cannot mount diskname");
+	if (fs_create("records") || (fd = fs_open("records")) < 0)
+		die("Cannot create file");
+
+	start = now_ms();
+	if (prealloc && fs_fallocate(fd, record_size * records))
+		die("Cannot preallocate file");
+	for (size_t i = 0; i < records; i++) {
+		if (fs_write(fd, buf, record_size) != (int)record_size)
+			die("write error");
+	}
+	ms = now_ms() - start;
+
+	fs_close(fd);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	free(buf);
+	return ms;
+}
+
+void bench_prealloc(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	size_t record_size = 512, records = 20000;
+	double plain_ms, prealloc_ms;
+
+	if (b_arg->argc < 1)
+		die("Usage: <diskname> [<record size> [<record count>]]");
+	if (b_arg->argc > 1)
+		record_size = get_argv(b_arg->argv[1]);
+	if (b_arg->argc > 2)
+		records = get_argv(b_arg->argv[2]);
+
+	plain_ms = bench_append(b_arg->argv[0], record_size, records, 0);
+	prealloc_ms = bench_append(b_arg->argv[0], record_size, records, 1);
+	printf("Append %zu records of %zu bytes: %.2f ms, with fs_fallocate() "
+	       "%.2f ms\n", records, record_size, plain_ms, prealloc_ms);
+}
+
+/* Sequential and random whole-block transfers, buffered or O_DIRECT, with or
+ * without block checksums */
+static void bench_io_mode(char *diskname, size_t size, size_t ios, int flags,
+			  int checksum, const char *label)
+{
+	struct fs_format_opts opts = {
+		.data_blk_count = size / BLOCK_SIZE + 16,
+		.file_count = FS_FILE_MAX_COUNT,
+		.checksum = checksum,
+	};
+	size_t chunk = 1 << 20, blocks = size / BLOCK_SIZE;
+	double start, seq_w, seq_r, rnd_w, rnd_r;
+	char *buf;
+	int fd;
+
+	/* aligned buffers take the zero-copy path of direct disks */
+	buf = block_alloc(chunk);
+	if (!buf)
+		die("Cannot malloc");
+	memset(buf, 'a', chunk);
+
+	if (fs_format(diskname, &opts) || fs_mount_flags(diskname, flags))
+		die("Cannot mount diskname");
+	if (fs_create("direct") || (fd = fs_open("direct")) < 0)
+		die("Cannot create file");
+
+	start = now_ms();
+	for (size_t done = 0; done < size; done += chunk) {
+		if (fs_write(fd, buf, chunk) != (int)chunk)
+			die("write error");
+	}
+	seq_w = now_ms() - start;
+
+	fs_lseek(fd, 0);
+	start = now_ms();
+	for (size_t done = 0; done < size; done += chunk) {
+		if (fs_read(fd, buf, chunk) != (int)chunk)
+			die("read error");
+	}
+	seq_r = now_ms() - start;
+
+	srand(1);
+	start = now_ms();
+	for (size_t i = 0; i < ios; i++) {
+		size_t offset = (rand() % blocks) * BLOCK_SIZE;
+
+		if (fs_pwrite(fd, buf, BLOCK_SIZE, offset) != BLOCK_SIZE)
+			die("write error");
+	}
+	rnd_w = now_ms() - start;
+
+	start = now_ms();
+	for (size_t i = 0; i < ios; i++) {
+		size_t offset = (rand() % blocks) * BLOCK_SIZE;
+
+		if (fs_pread(fd, buf, BLOCK_SIZE, offset) != BLOCK_SIZE)
+			die("read error");
+	}
+	rnd_r = now_ms() - start;
+
+	fs_close(fd);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("%-8s: seq write %7.1f MB/s, seq read %7.1f MB/s, "
+	       "rand write %8.0f IOPS, rand read %8.0f IOPS\n", label,
+	       size / seq_w / 1e3, size / seq_r / 1e3,
+	       ios / rnd_w * 1e3, ios / rnd_r * 1e3);
+	free(buf);
+}
+
+void bench_direct(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	size_t size = 64 << 20, ios = 2000;
+
+	if (b_arg->argc < 1)
+		die("Usage: <diskname> [<file size> [<random I/O count>]]");
+	if (b_arg->argc > 1)
+		size = get_argv(b_arg->argv[1]);
+	if (b_arg->argc > 2)
+		ios = get_argv(b_arg->argv[2]);
+	/* whole 1 MiB chunks */
+	size = (size + (1 << 20) - 1) & ~(size_t)((1 << 20) - 1);
+
+	printf("Direct I/O: %zu MB file, %zu random %d byte transfers\n",
+	       size >> 20, ios, BLOCK_SIZE);
+	bench_io_mode(b_arg->argv[0], size, ios, 0, 0, "buffered");
+	bench_io_mode(b_arg->argv[0], size, ios, FS_MOUNT_DIRECT, 0, "direct");
+}
+
+/* CRC32C throughput over @blocks consecutive @BLOCK_SIZE blocks, in MB/s */
+static double bench_crc(uint32_t (*crc)(uint32_t, const void *, size_t),
+			const char *buf, size_t blocks, size_t rounds)
+{
+	double start = now_ms(), ms;
+	uint32_t sum = 0;
+
+	for (size_t r = 0; r < rounds; r++) {
+		for (size_t i = 0; i < blocks; i++)
+			sum ^= crc(0, buf + i * BLOCK_SIZE, BLOCK_SIZE);
+	}
+	ms = now_ms() - start;
+	/* keep the loop from being optimized out */
+	if (sum == 0x12345678)
+		printf(" ");
+	return blocks * rounds * BLOCK_SIZE / ms / 1e3;
+}
+
+void bench_checksum(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	size_t size = 64 << 20, ios = 2000, blocks = 256;
+	char *buf;
+
+	if (b_arg->argc < 1)
+		die("Usage: <diskname> [<file size> [<random I/O count>]]");
+	if (b_arg->argc > 1)
+		size = get_argv(b_arg->argv[1]);
+	if (b_arg->argc > 2)
+		ios = get_argv(b_arg->argv[2]);
+	size = (size + (1 << 20) - 1) & ~(size_t)((1 << 20) - 1);
+
+	buf = malloc(blocks * BLOCK_SIZE);
+	if (!buf)
+		die("Cannot malloc");
+	srand(1);
+	for (size_t i = 0; i < blocks * BLOCK_SIZE; i++)
+		buf[i] = rand();
+	printf("CRC32C of %d byte blocks: crc32c() %.1f MB/s (%s), "
+	       "slicing-by-8 %.1f MB/s\n", BLOCK_SIZE,
+	       bench_crc(crc32c, buf, blocks, 400),
+	       crc32c_hw_available() ? "SSE4.2" : "slicing-by-8",
+	       bench_crc(crc32c_sw, buf, blocks, 100));
+	free(buf);
+
+	printf("Checksums: %zu MB file, %zu random %d byte transfers\n",
+	       size >> 20, ios, BLOCK_SIZE);
+	bench_io_mode(b_arg->argv[0], size, ios, 0, 0, "plain");
+	bench_io_mode(b_arg->argv[0], size, ios, 0, 1, "checksum");
+}
+
+/* Append @size bytes of log text in @record_size writes, read them back */
+static void bench_compress_mode(char *diskname, const char *log, size_t size,
+				size_t record_size, int compress)
+{
+	struct fs_format_opts opts = {
+		.data_blk_count = size / BLOCK_SIZE + 64,
+		.file_count = FS_FILE_MAX_COUNT,
+		.compress = compress,
+	};
+	struct fs_info_stats st;
+	double start, write_ms, read_ms;
+	char *buf;
+	int fd;
+
+	buf = malloc(1 << 20);
+	if (!buf)
+		die("Cannot malloc");
+	if (fs_format(diskname, &opts) || fs_mount(diskname))
+		die("Cannot mount diskname");
+	if (fs_create("log") || (fd = fs_open("log")) < 0)
+		die("Cannot create file");
+
+	start = now_ms();
+	for (size_t done = 0; done < size; done += record_size) {
+		if (fs_write(fd, (void*)(log + done), record_size) !=
+		    (int)record_size)
+			die("write error");
+	}
+	/* compressed data is only complete once written back */
+	fs_close(fd);
+	write_ms = now_ms() - start;
+
+	fd = fs_open("log");
+	start = now_ms();
+	for (size_t done = 0; done < size; done += 1 << 20) {
+		if (fs_read(fd, buf, 1 << 20) <= 0)
+			die("read error");
+	}
+	read_ms = now_ms() - start;
+	fs_close(fd);
+
+	if (fs_info_get(&st) || fs_umount())
+		die("Cannot unmount diskname");
+	printf("%-10s: write %7.1f MB/s, read %7.1f MB/s, %6zu data blocks "
+	       "(%.2fx)\n", compress ? "compressed" : "plain",
+	       size / write_ms / 1e3, size / read_ms / 1e3, st.used_blk_count,
+	       (double)size / ((double)st.used_blk_count * BLOCK_SIZE));
+	free(buf);
+}
+
+void bench_compress(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	size_t size = 32 << 20, record_size = 200, len = 0;
+	char *log;
+
+	if (b_arg->argc < 1)
+		die("Usage: <diskname> [<log size> [<record size>]]");
+	if (b_arg->argc > 1)
+		size = get_argv(b_arg->argv[1]);
+	if (b_arg->argc > 2)
+		record_size = get_argv(b_arg->argv[2]);
+	size -= size % record_size;
+
+	/* synthetic service log, which compresses like the real ones */
+	log = malloc(size + 256);
+	if (!log)
+		die("Cannot malloc");
+	srand(1);
+	while (len < size) {
+		len += sprintf(log + len, "2024-05-%02d %02d:%02d:%02d.%03d "
+			       "%s worker-%d GET /api/v1/items/%d status=%d "
+			       "latency_ms=%d\n", 1 + rand() % 28,
+			       rand() % 24, rand() % 60, rand() % 60,
+			       rand() % 1000, rand() % 10 ? "INFO " : "WARN ",
+			       rand() % 16, rand() % 100000,
+			       rand() % 20 ? 200 : 404, rand() % 500);
+	}
+
+	printf("Compression: %zu MB of log text in %zu byte writes\n",
+	       size >> 20, record_size);
+	bench_compress_mode(b_arg->argv[0], log, size, record_size, 0);
+	bench_compress_mode(b_arg->argv[0], log, size, record_size, 1);
+	free(log);
+}
+
+/*
+ * Write @files files of @blocks blocks each, made of @tmpl shared template
+ * blocks, zero blocks and unique blocks, read them back and remount
+ */
+static void bench_dedup_mode(char *diskname, size_t files, size_t blocks,
+			     const char *tmpl, int dedup)
+{
+	struct fs_format_opts opts = {
+		.data_blk_count = files * (blocks + 2) + 64,
+		.file_count = FS_FILE_MAX_COUNT,
+		.dedup = dedup,
+	};
+	size_t chunk = 16, total = files * blocks * BLOCK_SIZE;
+	struct fs_info_stats st;
+	double start, write_ms, read_ms, mount_ms;
+	char name[FS_FILENAME_LEN], *buf;
+	int fd;
+
+	buf = malloc(chunk * BLOCK_SIZE);
+	if (!buf)
+		die("Cannot malloc");
+	if (fs_format(diskname, &opts) || fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	srand(1);
+	start = now_ms();
+	for (size_t f = 0; f < files; f++) {
+		snprintf(name, sizeof(name), "file%d", (int)f);
+		if (fs_create(name) || (fd = fs_open(name)) < 0)
+			die("Cannot create file");
+		for (size_t b = 0; b < blocks; b += chunk) {
+			for (size_t i = 0; i < chunk; i++) {
+				char *blk = buf + i * BLOCK_SIZE;
+				int kind = rand() % 8;
+
+				/* 5/8 template, 1/8 zero, 1/4 unique */
+				if (kind < 5) {
+					memcpy(blk, tmpl + (rand() % 16) *
+					       BLOCK_SIZE, BLOCK_SIZE);
+				} else if (kind == 5) {
+					memset(blk, 0, BLOCK_SIZE);
+				} else {
+					for (size_t j = 0; j < BLOCK_SIZE; j++)
+						blk[j] = rand();
+				}
+			}
+			if (fs_write(fd, buf, chunk * BLOCK_SIZE) !=
+			    (int)(chunk * BLOCK_SIZE))
+				die("write error");
+		}
+		fs_close(fd);
+	}
+	write_ms = now_ms() - start;
+
+	start = now_ms();
+	for (size_t f = 0; f < files; f++) {
+		snprintf(name, sizeof(name), "file%d", (int)f);
+		fd = fs_open(name);
+		for (size_t b = 0; b < blocks; b += chunk) {
+			if (fs_read(fd, buf, chunk * BLOCK_SIZE) <= 0)
+				die("read error");
+		}
+		fs_close(fd);
+	}
+	read_ms = now_ms() - start;
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	/* the reference counts of a deduplicated FS are rebuilt at mount */
+	start = now_ms();
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	mount_ms = now_ms() - start;
+	if (fs_info_get(&st) || fs_umount())
+		die("Cannot unmount diskname");
+	printf("%-6s: write %7.1f MB/s, read %7.1f MB/s, mount %6.2f ms, "
+	       "%6zu data blocks (%.2fx)\n", dedup ? "dedup" : "plain",
+	       total / write_ms / 1e3, total / read_ms / 1e3, mount_ms,
+	       st.used_blk_count,
+	       (double)total / ((double)st.used_blk_count * BLOCK_SIZE));
+	free(buf);
+}
+
+void bench_dedup(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	size_t files = 16, blocks = 1024;
+	char *tmpl;
+
+	if (b_arg->argc < 1)
+		die("Usage: <diskname> [<file count> [<blocks per file>]]");
+	if (b_arg->argc > 1)
+		files = get_argv(b_arg->argv[1]);
+	if (b_arg->argc > 2)
+		blocks = get_argv(b_arg->argv[2]);
+	/* whole write chunks */
+	blocks = (blocks + 15) & ~(size_t)15;
+
+	tmpl = malloc(16 * BLOCK_SIZE);
+	if (!tmpl)
+		die("Cannot malloc");
+	srand(2);
+	for (size_t i = 0; i < 16 * BLOCK_SIZE; i++)
+		tmpl[i] = rand();
+
+	printf("Deduplication: %zu files of %zu blocks, 5/8 from 16 template "
+	       "blocks, 1/8 zero\n", files, blocks);
+	bench_dedup_mode(b_arg->argv[0], files, blocks, tmpl, 0);
+	bench_dedup_mode(b_arg->argv[0], files, blocks, tmpl, 1);
+	free(tmpl);
+}
+
+/* Preallocate a @size byte file of zeros, write one @record_size record every
+ * @stride bytes and read the whole file back */
+static void bench_zero_mode(char *diskname, size_t size, size_t record_size,
+			    size_t stride, int dedup)
+{
+	struct fs_format_opts opts = {
+		.data_blk_count = size / BLOCK_SIZE + 64,
+		.file_count = FS_FILE_MAX_COUNT,
+		.dedup = dedup,
+	};
+	struct fs_info_stats st;
+	double start, alloc_ms, write_ms, read_ms;
+	char *buf;
+	int fd;
+
+	buf = malloc(1 << 20);
+	if (!buf)
+		die("Cannot malloc");
+	memset(buf, 'r', record_size);
+	if (fs_format(diskname, &opts) || fs_mount(diskname))
+		die("Cannot mount diskname");
+	if (fs_create("records") || (fd = fs_open("records")) < 0)
+		die("Cannot create file");
+
+	start = now_ms();
+	if (fs_truncate(fd, size))
+		die("truncate error");
+	alloc_ms = now_ms() - start;
+
+	start = now_ms();
+	for (size_t off = 0; off + record_size <= size; off += stride) {
+		if (fs_pwrite(fd, buf, record_size, off) != (int)record_size)
+			die("write error");
+	}
+	write_ms = now_ms() - start;
+
+	start = now_ms();
+	for (size_t done = 0; done < size; done += 1 << 20) {
+		if (fs_read(fd, buf, 1 << 20) <= 0)
+			die("read error");
+	}
+	read_ms = now_ms() - start;
+	fs_close(fd);
+
+	if (fs_info_get(&st) || fs_umount())
+		die("Cannot unmount diskname");
+	printf("%-6s: preallocate %8.2f ms, records %8.2f ms, read %7.1f MB/s, "
+	       "%6zu data blocks\n", dedup ? "dedup" : "plain", alloc_ms,
+	       write_ms, size / read_ms / 1e3, st.used_blk_count);
+	free(buf);
+}
+
+void bench_zero(void *arg)
+{
+	struct bench_arg *b_arg = arg;
+	size_t size = 64 << 20, record_size = 256, stride = 64 * BLOCK_SIZE;
+	double start, ms;
+	char *buf;
+	int zero = 0;
+
+	if (b_arg->argc < 1)
+		die("Usage: <diskname> [<file size> [<record stride>]]");
+	if (b_arg->argc > 1)
+		size = get_argv(b_arg->argv[1]);
+	if (b_arg->argc > 2)
+		stride = get_argv(b_arg->argv[2]);
+	size = (size + (1 << 20) - 1) & ~(size_t)((1 << 20) - 1);
+	if (stride < record_size)
+		stride = record_size;
+
+	buf = block_alloc(1 << 20);
+	if (!buf)
+		die("Cannot malloc");
+	memset(buf, 0, 1 << 20);
+	start = now_ms();
+	for (int r = 0; r < 1000; r++)
+		zero += block_is_zero(buf, 1 << 20);
+	ms = now_ms() - start;
+	/* keep the loop from being optimized out */
+	if (zero != 1000)
+		printf(" ");
+	printf("Zero check of 1 MiB buffers: %.1f GB/s\n",
+	       1000.0 * (1 << 20) / ms / 1e6);
+	free(buf);
+
+	printf("Zero blocks: %zu MB preallocated file, %zu byte records every "
+	       "%zu bytes\n", size >> 20, record_size, stride);
+	bench_zero_mode(b_arg->argv[0], size, record_size, stride, 0);
+	bench_zero_mode(b_arg->argv[0], size, record_size, stride, 1);
+}
+
+static struct {
+	const char *name;
+	void(*func)(void *);
+} commands[] = {
+	{ "fat",	bench_fat },
+	{ "blocksize",	bench_blocksize },
+	{ "prealloc",	bench_prealloc },
+	{ "direct",	bench_direct },
+	{ "checksum",	bench_checksum },
+	{ "compress",	bench_compress },
+	{ "dedup",	bench_dedup },
+	{ "zero",	bench_zero }
+};
+
+void usage(char *program)
+{
+	size_t i;
+	fprintf(stderr, "Usage: %s <command> [<arg>]\n", program);
+	fprintf(stderr, "Possible commands are:\n");
+	for (i = 0; i < ARRAY_SIZE(commands); i++)
+		fprintf(stderr, "\t%s\n", commands[i].name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	size_t i;
+	char *program;
+	char *cmd;
+	struct bench_arg arg;
+
+	program = argv[0];
+
+	if (argc == 1)
+		usage(program);
+
+	/* Skip argv[0] */
+	argc--;
+	argv++;
+
+	cmd = argv[0];
+	arg.argc = --argc;
+	arg.argv = &argv[1];
+
+	for (i = 0; i < ARRAY_SIZE(commands); i++) {
+		if (!strcmp(cmd, commands[i].name)) {
+			commands[i].func(&arg);
+			break;
+		}
+	}
+	if (i == ARRAY_SIZE(commands)) {
+		fs_bench_error("invalid command '%s'", cmd);
+		usage(program);
+	}
+
+	return 0;
+}
@@ -0,0 +1,161 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fs.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define fs_defrag_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_defrag_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+struct defrag_arg {
+	int argc;
+	char **argv;
+};
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static size_t get_argv(char *argv)
+{
+	long int ret = strtol(argv, NULL, 0);
+	if (ret <= 0 || ret == LONG_MAX)
+		die("invalid number '%s'", argv);
+	return (size_t)ret;
+}
+
+static void print_report(const char *title)
+{
+	struct fs_frag_report r;
+
+	if (fs_frag_report(&r))
+		die("Cannot read fragmentation report");
+	printf("%s:\n", title);
+	printf("files=%zu\n", r.file_count);
+	printf("extents=%zu\n", r.extent_count);
+	printf("extents_per_file=%.2f\n",
+	       r.file_count ? (double)r.extent_count / r.file_count : 0);
+	printf("fragmented_files=%zu\n", r.fragmented_count);
+	printf("free_blk_count=%zu\n", r.free_blk_count);
+	printf("free_runs=%zu\n", r.free_run_count);
+	printf("largest_free_run=%zu\n", r.largest_free_run);
+}
+
+void defrag_report(void *arg)
+{
+	struct defrag_arg *d_arg = arg;
+
+	if (d_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	if (fs_mount(d_arg->argv[0]))
+		die("Cannot mount diskname");
+	print_report("Fragmentation");
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void defrag_run(void *arg)
+{
+	struct defrag_arg *d_arg = arg;
+	size_t max_blocks = 0, steps = 0, total = 0;
+	double start, max_ms = 0, total_ms = 0;
+	int moved;
+
+	if (d_arg->argc < 1)
+		die("Usage: <diskname> [<max blocks per step>]");
+	if (d_arg->argc > 1)
+		max_blocks = get_argv(d_arg->argv[1]);
+
+	if (fs_mount(d_arg->argv[0]))
+		die("Cannot mount diskname");
+	print_report("Before");
+
+	/* one step per call, as an application would between requests */
+	do {
+		start = now_ms();
+		moved = fs_defrag(max_blocks);
+		start = now_ms() - start;
+		if (moved < 0) {
+			fs_umount();
+			die("Cannot defragment diskname");
+		}
+		total += moved;
+		total_ms += start;
+		if (start > max_ms)
+			max_ms = start;
+		steps++;
+	} while (moved > 0 && max_blocks);
+
+	print_report("After");
+	printf("Moved %zu blocks in %zu steps, %.2f ms (longest step %.2f ms)\n",
+	       total, steps, total_ms, max_ms);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+static struct {
+	const char *name;
+	void(*func)(void *);
+} commands[] = {
+	{ "report",	defrag_report },
+	{ "run",	defrag_run }
+};
+
+void usage(char *program)
+{
+	size_t i;
+	fprintf(stderr, "Usage: %s <command> [<arg>]\n", program);
+	fprintf(stderr, "Possible commands are:\n");
+	for (i = 0; i < ARRAY_SIZE(commands); i++)
+		fprintf(stderr, "\t%s\n", commands[i].name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	size_t i;
+	char *program;
+	char *cmd;
+	struct defrag_arg arg;
+
+	program = argv[0];
+
+	if (argc == 1)
+		usage(program);
+
+	/* Skip argv[0] */
+	argc--;
+	argv++;
+
+	cmd = argv[0];
+	arg.argc = --argc;
+	arg.argv = &argv[1];
+
+	for (i = 0; i < ARRAY_SIZE(commands); i++) {
+		if (!strcmp(cmd, commands[i].name)) {
+			commands[i].func(&arg);
+			break;
+		}
+	}
+	if (i == ARRAY_SIZE(commands)) {
+		fs_defrag_error("invalid command '%s'", cmd);
+		usage(program);
+	}
+
+	return 0;
+}
@@ -0,0 +1,357 @@
+#define FUSE_USE_VERSION 31
+
+#include <errno.h>
+#include <fuse.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+/*
+ * FUSE daemon exposing an ECS150FS disk as a host directory:
+ *
+ *   fs_fuse.x <diskname> <mountpoint> [<FUSE options>...]
+ *   fusermount3 -u <mountpoint>
+ *
+ * The root directory of the disk is the mounted directory, which has no
+ * subdirectories. Requests are dispatched by several threads (unless -s is
+ * given), reads run in parallel in libfs. Writes of any size are handed over
+ * whole (see the max_write option), and the kernel keeps file data in its
+ * page cache across opens, as the disk is only modified through this daemon.
+ */
+
+#define fs_fuse_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_fuse_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/* Longest fs_list() pattern matching a single name, every character escaped */
+#define PATTERN_LEN (2 * FS_FILENAME_LEN)
+
+/* Writes past the end of file first extend it, as libfs files have no holes.
+ * libfs serializes writes anyway, this only keeps a concurrent write from
+ * being truncated away by the extension. */
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t blk_size;
+static time_t mount_time;
+
+/* Name of the file at @path, "" (an invalid name) if @path is not directly in
+ * the root directory */
+static const char *path_name(const char *path)
+{
+	if (path[0] != '/' || strchr(path + 1, '/'))
+		return "";
+	return path + 1;
+}
+
+/* Find the file at @path, return 0 and fill @ent if it exists */
+static int lookup(const char *path, struct fs_dirent *ent)
+{
+	const char *name = path_name(path);
+	char pattern[PATTERN_LEN + 1];
+	size_t len = 0;
+
+	if (!*name)
+		return -ENOENT;
+	if (strlen(name) >= FS_FILENAME_LEN)
+		return -ENAMETOOLONG;
+
+	/* the name is matched literally, whatever characters it holds */
+	for (; *name; name++) {
+		if (strchr("*?[\\", *name))
+			pattern[len++] = '\\';
+		pattern[len++] = *name;
+	}
+	pattern[len] = '\0';
+
+	if (fs_list(pattern, ent, 1) < 1)
+		return -ENOENT;
+	return 0;
+}
+
+static void fill_stat(struct stat *st, size_t size)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_mode = S_IFREG | 0644;
+	st->st_nlink = 1;
+	st->st_size = size;
+	st->st_blksize = blk_size;
+	st->st_blocks = (size + blk_size - 1) / blk_size * (blk_size / 512);
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+	st->st_atime = st->st_mtime = st->st_ctime = mount_time;
+}
+
+static void *op_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+	/* the page cache stays valid, nothing else modifies the disk */
+	cfg->kernel_cache = 1;
+	cfg->entry_timeout = 60;
+	cfg->attr_timeout = 60;
+	cfg->negative_timeout = 1;
+	/* open files cannot be deleted, so there is nothing to hide them as */
+	cfg->hard_remove = 1;
+	if (conn->capable & FUSE_CAP_WRITEBACK_CACHE)
+		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+
+	/* deleted files are freed in the background, not by the next writer */
+	fs_reclaim_background(1);
+	return NULL;
+}
+
+static void op_destroy(void *private_data)
+{
+	(void)private_data;
+	fs_reclaim_background(0);
+}
+
+static int op_getattr(const char *path, struct stat *st,
+		      struct fuse_file_info *fi)
+{
+	struct fs_dirent ent;
+	int ret;
+
+	if (!strcmp(path, "/")) {
+		memset(st, 0, sizeof(*st));
+		st->st_mode = S_IFDIR | 0755;
+		st->st_nlink = 2;
+		st->st_uid = getuid();
+		st->st_gid = getgid();
+		st->st_atime = st->st_mtime = st->st_ctime = mount_time;
+		return 0;
+	}
+
+	if (fi) {
+		if ((ret = fs_stat(fi->fh)) < 0)
+			return -EBADF;
+		fill_stat(st, ret);
+		return 0;
+	}
+	if ((ret = lookup(path, &ent)))
+		return ret;
+	fill_stat(st, ent.size);
+	return 0;
+}
+
+static int op_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+		      off_t offset, struct fuse_file_info *fi,
+		      enum fuse_readdir_flags flags)
+{
+	struct fs_dirent ent;
+	struct fs_dir *dir;
+	struct stat st;
+	int ret;
+
+	(void)offset;
+	(void)fi;
+	(void)flags;
+
+	if (strcmp(path, "/"))
+		return -ENOTDIR;
+	if (!(dir = fs_opendir(NULL)))
+		return -EIO;
+
+	filler(buf, ".", NULL, 0, 0);
+	filler(buf, "..", NULL, 0, 0);
+	/* the sizes come with the names, which spares a getattr per file */
+	while ((ret = fs_readdir(dir, &ent)) == 1) {
+		fill_stat(&st, ent.size);
+		if (filler(buf, ent.name, &st, 0, FUSE_FILL_DIR_PLUS))
+			break;
+	}
+	fs_closedir(dir);
+	return ret < 0 ? -EIO : 0;
+}
+
+static int op_open(const char *path, struct fuse_file_info *fi)
+{
+	struct fs_dirent ent;
+	int fd, ret;
+
+	/* the kernel checks the access mode, and may read from a file opened
+	 * for writing only to fill its page cache: always open both ways */
+	if ((fd = fs_open(path_name(path))) < 0) {
+		ret = lookup(path, &ent);
+		return ret ? ret : -EMFILE;
+	}
+	fi->fh = fd;
+	fi->keep_cache = 1;
+	return 0;
+}
+
+static int op_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	struct fs_dirent ent;
+	int ret;
+
+	(void)mode;
+
+	if (fs_create(path_name(path))) {
+		ret = lookup(path, &ent);
+		/* a new valid name only fails on a full root directory */
+		if (ret == -ENOENT)
+			return -ENOSPC;
+		return ret ? ret : -EEXIST;
+	}
+	return op_open(path, fi);
+}
+
+static int op_release(const char *path, struct fuse_file_info *fi)
+{
+	(void)path;
+	return fs_close(fi->fh) ? -EIO : 0;
+}
+
+static int op_read(const char *path, char *buf, size_t size, off_t offset,
+		   struct fuse_file_info *fi)
+{
+	int ret;
+
+	(void)path;
+	if ((ret = fs_pread(fi->fh, buf, size, offset)) < 0)
+		return -EIO;
+	return ret;
+}
+
+static int op_write(const char *path, const char *buf, size_t size,
+		    off_t offset, struct fuse_file_info *fi)
+{
+	int ret;
+
+	(void)path;
+	pthread_mutex_lock(&write_lock);
+	ret = fs_stat(fi->fh);
+	if (ret >= 0 && (size_t)offset > (size_t)ret &&
+	    fs_truncate(fi->fh, offset)) {
+		pthread_mutex_unlock(&write_lock);
+		return -ENOSPC;
+	}
+	ret = fs_pwrite(fi->fh, (void *)buf, size, offset);
+	pthread_mutex_unlock(&write_lock);
+
+	if (ret < 0)
+		return -EIO;
+	/* the disk is full, a short count would only be retried */
+	if (ret == 0 && size)
+		return -ENOSPC;
+	return ret;
+}
+
+static int op_truncate(const char *path, off_t size,
+		       struct fuse_file_info *fi)
+{
+	int fd = fi ? (int)fi->fh : -1, ret;
+	struct fuse_file_info tmp;
+
+	if (fd < 0) {
+		if ((ret = op_open(path, &tmp)))
+			return ret;
+		fd = tmp.fh;
+	}
+
+	pthread_mutex_lock(&write_lock);
+	ret = fs_truncate(fd, size) ? -ENOSPC : 0;
+	pthread_mutex_unlock(&write_lock);
+
+	if (!fi)
+		fs_close(fd);
+	return ret;
+}
+
+static int op_unlink(const char *path)
+{
+	struct fs_dirent ent;
+	int ret;
+
+	if (!fs_delete(path_name(path)))
+		return 0;
+	ret = lookup(path, &ent);
+	/* libfs refuses to delete open files */
+	return ret ? ret : -EBUSY;
+}
+
+/* files have no timestamps, accepted so that touch works */
+static int op_utimens(const char *path, const struct timespec tv[2],
+		      struct fuse_file_info *fi)
+{
+	struct fs_dirent ent;
+
+	(void)tv;
+	if (fi || !strcmp(path, "/"))
+		return 0;
+	return lookup(path, &ent);
+}
+
+static int op_statfs(const char *path, struct statvfs *sv)
+{
+	struct fs_statfs st;
+
+	(void)path;
+	if (fs_statfs(&st))
+		return -EIO;
+
+	memset(sv, 0, sizeof(*sv));
+	sv->f_bsize = st.blk_size;
+	sv->f_frsize = st.blk_size;
+	sv->f_blocks = st.data_blk_count;
+	sv->f_bfree = st.free_blk_count;
+	sv->f_bavail = st.free_blk_count;
+	sv->f_files = st.file_max;
+	sv->f_ffree = st.file_max - st.file_count;
+	sv->f_favail = sv->f_ffree;
+	sv->f_namemax = FS_FILENAME_LEN - 1;
+	return 0;
+}
+
+static const struct fuse_operations ops = {
+	.init = op_init,
+	.destroy = op_destroy,
+	.getattr = op_getattr,
+	.readdir = op_readdir,
+	.open = op_open,
+	.create = op_create,
+	.release = op_release,
+	.read = op_read,
+	.write = op_write,
+	.truncate = op_truncate,
+	.unlink = op_unlink,
+	.utimens = op_utimens,
+	.statfs = op_statfs,
+};
+
+int main(int argc, char **argv)
+{
+	struct fs_statfs st;
+	int ret;
+
+	if (argc < 3)
+		die("Usage: <diskname> <mountpoint> [<FUSE options>...]");
+
+	/* mounted before the daemon forks, so that errors show up here */
+	if (fs_mount(argv[1]))
+		die("Cannot mount diskname");
+	if (fs_statfs(&st)) {
+		fs_umount();
+		die("Cannot get file system information");
+	}
+	blk_size = st.blk_size;
+	mount_time = time(NULL);
+
+	/* the FUSE options follow the disk name */
+	argv[1] = argv[0];
+	ret = fuse_main(argc - 1, argv + 1, &ops, NULL);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	return ret;
+}
@@ -0,0 +1,526 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <fs.h>
+
+/*
+ * Synthetic workload generator for the script command of test_fs.x.
+ *
+ * Writes into the output directory:
+ * - script.<k>: one script per parallel worker, on its own set of files,
+ * - data: random payload, written by slices with WRITE FILE,
+ * - expect.<k>: expected result of every READ of script.<k>, read back by
+ *   slices with READ FILE,
+ * - format.args: arguments of `test_fs.x format` for a large enough disk.
+ *
+ * The generator simulates the content of every file, so each READ checks the
+ * exact bytes libfs must return. Scripts reference the data files by their
+ * bare names, run them from the output directory.
+ */
+
+#define fs_gen_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_gen_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+enum { DIST_UNIFORM, DIST_EXP, DIST_BIMODAL };
+enum { PATTERN_SEQ, PATTERN_RANDOM };
+
+static struct {
+	size_t scripts;
+	size_t files;
+	size_t ops;
+	size_t size;
+	size_t read;
+	size_t churn;
+	size_t trunc;
+	size_t open;
+	size_t blocks;
+	size_t bs;
+	size_t seed;
+	int dist;
+	int pattern;
+} opt = {
+	.scripts = 1,
+	.files = 16,
+	.ops = 1000,
+	.size = 65536,
+	.read = 50,
+	.churn = 2,
+	.trunc = 1,
+	.open = 4,
+	.blocks = 16384,
+	.bs = 4096,
+	.seed = 1,
+	.dist = DIST_UNIFORM,
+	.pattern = PATTERN_SEQ,
+};
+
+static const struct {
+	const char *name;
+	size_t *value;
+	const char *help;
+} num_opts[] = {
+	{ "scripts",	&opt.scripts,	"scripts run in parallel, on disjoint files" },
+	{ "files",	&opt.files,	"files per script" },
+	{ "ops",	&opt.ops,	"operations per script" },
+	{ "size",	&opt.size,	"largest read or write, in bytes" },
+	{ "read",	&opt.read,	"percentage of reads among reads and writes" },
+	{ "churn",	&opt.churn,	"percentage of operations deleting and recreating a file" },
+	{ "trunc",	&opt.trunc,	"percentage of operations truncating a file" },
+	{ "open",	&opt.open,	"files kept open at once per script" },
+	{ "blocks",	&opt.blocks,	"data blocks shared by all the files" },
+	{ "bs",		&opt.bs,	"block size of the disk" },
+	{ "seed",	&opt.seed,	"seed of the random generator" },
+};
+
+static const char *dist_names[] = { "uniform", "exp", "bimodal" };
+static const char *pattern_names[] = { "seq", "random" };
+
+/* Simulated file */
+struct gen_file {
+	char name[FS_FILENAME_LEN];
+	uint8_t *content;
+	size_t size;
+	size_t alloc;
+	size_t offset;		/* offset of its file descriptor */
+	int open;		/* rank in the open list, or -1 */
+};
+
+/* Simulated script */
+struct gen_script {
+	int k;
+	FILE *script;
+	FILE *expect;
+	size_t expect_len;
+	struct gen_file *files;
+	int *open_list;		/* open files, least recently used first */
+	size_t open_count;
+	int current;		/* file of the current file descriptor */
+	size_t used_blocks;
+	size_t budget;		/* data blocks available to its files */
+};
+
+/* Totals reported at the end */
+static struct {
+	size_t commands;
+	size_t reads, read_bytes;
+	size_t writes, write_bytes;
+	size_t seeks, churns, truncs;
+} total;
+
+static uint8_t *pool;
+static size_t pool_len;
+static uint64_t rng_state;
+
+/* splitmix64 */
+static uint64_t rng(void)
+{
+	uint64_t z = (rng_state += 0x9E3779B97F4A7C15ull);
+
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+/* Uniform in [0, n] */
+static size_t rng_upto(size_t n)
+{
+	return rng() % (n + 1);
+}
+
+/* Length of one read or write, in [1, opt.size] */
+static size_t rng_len(void)
+{
+	size_t len;
+
+	switch (opt.dist) {
+	case DIST_EXP:
+		/* geometric with mean size / 8: halve for each coin flip lost */
+		len = opt.size / 8 * 2;
+		while (len > 1 && (rng() & 1))
+			len /= 2;
+		len = rng_upto(len);
+		break;
+	case DIST_BIMODAL:
+		/* mostly small records, one in ten large transfer */
+		if (rng() % 10)
+			len = rng_upto(opt.size < 512 ? opt.size : 512);
+		else
+			len = opt.size / 2 + rng_upto(opt.size / 2);
+		break;
+	default:
+		len = rng_upto(opt.size);
+		break;
+	}
+
+	return len ? len : 1;
+}
+
+static size_t blocks_of(size_t size)
+{
+	return (size + opt.bs - 1) / opt.bs;
+}
+
+static void emit(struct gen_script *g, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void emit(struct gen_script *g, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(g->script, fmt, ap);
+	va_end(ap);
+	fputc('\n', g->script);
+	total.commands++;
+}
+
+static void file_resize(struct gen_file *f, size_t size)
+{
+	if (size > f->alloc) {
+		size_t alloc = f->alloc ? f->alloc : 4096;
+
+		while (alloc < size)
+			alloc *= 2;
+		f->content = realloc(f->content, alloc);
+		if (!f->content)
+			die_perror("realloc");
+		f->alloc = alloc;
+	}
+	/* truncating up zero-fills, like fs_truncate() */
+	if (size > f->size)
+		memset(f->content + f->size, 0, size - f->size);
+	f->size = size;
+}
+
+static void set_size(struct gen_script *g, struct gen_file *f, size_t size)
+{
+	g->used_blocks = g->used_blocks - blocks_of(f->size) + blocks_of(size);
+	file_resize(f, size);
+}
+
+static void open_forget(struct gen_script *g, int i)
+{
+	size_t rank = g->files[i].open;
+
+	memmove(&g->open_list[rank], &g->open_list[rank + 1],
+		(g->open_count - rank - 1) * sizeof(int));
+	g->open_count--;
+	for (size_t r = rank; r < g->open_count; r++)
+		g->files[g->open_list[r]].open = r;
+	g->files[i].open = -1;
+}
+
+static void file_close(struct gen_script *g, int i)
+{
+	emit(g, "CLOSE\t%s", g->files[i].name);
+	open_forget(g, i);
+	if (g->current == i)
+		g->current = -1;
+}
+
+/* Make file @i the current file descriptor, opening it if needed */
+static void file_use(struct gen_script *g, int i)
+{
+	struct gen_file *f = &g->files[i];
+
+	if (f->open < 0) {
+		if (g->open_count == opt.open)
+			file_close(g, g->open_list[0]);
+		emit(g, "OPEN\t%s\t%s", f->name, f->name);
+		f->offset = 0;
+	} else {
+		if (g->current != i)
+			emit(g, "USE\t%s", f->name);
+		open_forget(g, i);
+	}
+	/* most recently used last */
+	f->open = g->open_count;
+	g->open_list[g->open_count++] = i;
+	g->current = i;
+}
+
+static void file_seek(struct gen_script *g, struct gen_file *f, size_t offset)
+{
+	emit(g, "SEEK\t%zu", offset);
+	f->offset = offset;
+	total.seeks++;
+}
+
+/* Read @len bytes from the current offset of file @i, check the result */
+static void gen_read(struct gen_script *g, int i, size_t len)
+{
+	struct gen_file *f = &g->files[i];
+	size_t count = f->offset < f->size ? f->size - f->offset : 0;
+
+	if (count > len)
+		count = len;
+	if (fwrite(f->content + f->offset, 1, count, g->expect) != count)
+		die_perror("fwrite");
+	emit(g, "READ\t%zu\tFILE\texpect.%d\t%zu\t%zu", len, g->k,
+	     g->expect_len, count);
+	g->expect_len += count;
+	f->offset += count;
+	total.reads++;
+	total.read_bytes += count;
+}
+
+static void gen_write(struct gen_script *g, int i, size_t len)
+{
+	struct gen_file *f = &g->files[i];
+	size_t end, max_end, src;
+
+	/* clip to the blocks left in the budget */
+	max_end = (blocks_of(f->size) + g->budget - g->used_blocks) * opt.bs;
+	end = f->offset + len;
+	if (end > max_end)
+		end = max_end;
+	if (end <= f->offset)
+		return;
+	len = end - f->offset;
+
+	src = rng_upto(pool_len - len);
+	emit(g, "WRITE\tFILE\tdata\t%zu\t%zu", src, len);
+	if (end > f->size)
+		set_size(g, f, end);
+	memcpy(f->content + f->offset, pool + src, len);
+	f->offset = end;
+	total.writes++;
+	total.write_bytes += len;
+}
+
+static void gen_churn(struct gen_script *g, int i)
+{
+	struct gen_file *f = &g->files[i];
+
+	if (f->open >= 0)
+		file_close(g, i);
+	emit(g, "DELETE\t%s", f->name);
+	emit(g, "CREATE\t%s", f->name);
+	set_size(g, f, 0);
+	total.churns++;
+}
+
+static void gen_trunc(struct gen_script *g, int i)
+{
+	struct gen_file *f = &g->files[i];
+	size_t size = rng_upto(f->size);
+
+	file_use(g, i);
+	emit(g, "TRUNCATE\t%zu", size);
+	set_size(g, f, size);
+	total.truncs++;
+	if (f->offset > size)
+		file_seek(g, f, size);
+}
+
+/* One random operation on a random file */
+static void gen_op(struct gen_script *g)
+{
+	int i = rng() % opt.files;
+	struct gen_file *f = &g->files[i];
+	size_t dice = rng() % 100;
+	int is_read;
+
+	if (dice < opt.churn) {
+		gen_churn(g, i);
+		return;
+	}
+	if (dice < opt.churn + opt.trunc) {
+		gen_trunc(g, i);
+		return;
+	}
+
+	/* a full disk only leaves reads */
+	is_read = rng() % 100 < opt.read || g->used_blocks >= g->budget;
+	file_use(g, i);
+	if (opt.pattern == PATTERN_RANDOM)
+		file_seek(g, f, rng_upto(f->size));
+	else if (is_read && f->offset == f->size && f->size)
+		file_seek(g, f, 0);
+
+	if (is_read)
+		gen_read(g, i, rng_len());
+	else
+		gen_write(g, i, rng_len());
+}
+
+static FILE *out_open(const char *dir, const char *name, int k)
+{
+	char path[PATH_MAX];
+	FILE *f;
+
+	if (k < 0)
+		snprintf(path, sizeof(path), "%s/%s", dir, name);
+	else
+		snprintf(path, sizeof(path), "%s/%s.%d", dir, name, k);
+	f = fopen(path, "w");
+	if (!f)
+		die_perror(path);
+	return f;
+}
+
+static void gen_script(const char *dir, int k)
+{
+	struct gen_script g = { .k = k, .current = -1 };
+
+	g.script = out_open(dir, "script", k);
+	g.expect = out_open(dir, "expect", k);
+	g.budget = (opt.blocks - 1) / opt.scripts;
+	g.files = calloc(opt.files, sizeof(*g.files));
+	g.open_list = calloc(opt.open, sizeof(int));
+	if (!g.files || !g.open_list)
+		die_perror("calloc");
+
+	emit(&g, "MOUNT");
+	for (size_t i = 0; i < opt.files; i++) {
+		/* at most 5 digits each, see the checks of main() */
+		snprintf(g.files[i].name, FS_FILENAME_LEN, "g%u_%u",
+			 (unsigned)k % 100000, (unsigned)i % 100000);
+		g.files[i].open = -1;
+		emit(&g, "CREATE\t%s", g.files[i].name);
+	}
+
+	for (size_t n = 0; n < opt.ops; n++)
+		gen_op(&g);
+
+	/* check the final content of every file */
+	while (g.open_count)
+		file_close(&g, g.open_list[0]);
+	for (size_t i = 0; i < opt.files; i++) {
+		file_use(&g, i);
+		gen_read(&g, i, g.files[i].size);
+		file_close(&g, i);
+	}
+	emit(&g, "UMOUNT");
+
+	if (fclose(g.script) || fclose(g.expect))
+		die_perror("fclose");
+
+	for (size_t i = 0; i < opt.files; i++)
+		free(g.files[i].content);
+	free(g.files);
+	free(g.open_list);
+}
+
+static int parse_name(const char *arg, const char **names, int count)
+{
+	for (int i = 0; i < count; i++) {
+		if (!strcmp(arg, names[i]))
+			return i;
+	}
+	die("Invalid value '%s'", arg);
+}
+
+static void parse_opt(char *arg)
+{
+	char *eq = strchr(arg, '=');
+
+	if (!eq)
+		die("Invalid option '%s'", arg);
+	*eq++ = '\0';
+
+	if (!strcmp(arg, "dist")) {
+		opt.dist = parse_name(eq, dist_names, 3);
+		return;
+	}
+	if (!strcmp(arg, "pattern")) {
+		opt.pattern = parse_name(eq, pattern_names, 2);
+		return;
+	}
+	for (size_t i = 0; i < sizeof(num_opts) / sizeof(num_opts[0]); i++) {
+		if (!strcmp(arg, num_opts[i].name)) {
+			*num_opts[i].value = strtoull(eq, NULL, 0);
+			return;
+		}
+	}
+	die("Invalid option '%s'", arg);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: fs_gen.x <output directory> [<option>=<value>...]\n");
+	fprintf(stderr, "Options and their defaults:\n");
+	for (size_t i = 0; i < sizeof(num_opts) / sizeof(num_opts[0]); i++)
+		fprintf(stderr, "\t%s=%zu\t%s\n", num_opts[i].name,
+			*num_opts[i].value, num_opts[i].help);
+	fprintf(stderr, "\tdist=uniform\tsizes of reads and writes: uniform, "
+		"exp or bimodal\n");
+	fprintf(stderr, "\tpattern=seq\toffsets of reads and writes: seq or "
+		"random\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	char *dir;
+	FILE *f;
+
+	if (argc < 2)
+		usage();
+	dir = argv[1];
+	for (int i = 2; i < argc; i++)
+		parse_opt(argv[i]);
+
+	if (!opt.scripts || !opt.files || !opt.open || !opt.size || !opt.bs ||
+	    opt.read > 100 || opt.churn + opt.trunc > 100 ||
+	    opt.blocks <= opt.scripts)
+		die("Invalid options");
+	if (opt.scripts * opt.files > FS_FILE_MAX_COUNT_EXT ||
+	    opt.scripts > 99999)
+		die("Too many files");
+
+	if (mkdir(dir, 0755) && errno != EEXIST)
+		die_perror("mkdir");
+
+	/* payload, twice the largest write so that slices vary */
+	rng_state = opt.seed;
+	pool_len = opt.size * 2;
+	pool = malloc(pool_len);
+	if (!pool)
+		die_perror("malloc");
+	for (size_t i = 0; i < pool_len; i++)
+		pool[i] = rng();
+	f = out_open(dir, "data", -1);
+	if (fwrite(pool, 1, pool_len, f) != pool_len || fclose(f))
+		die_perror("fwrite");
+
+	for (size_t k = 0; k < opt.scripts; k++)
+		gen_script(dir, k);
+
+	/* one spare block per file covers the index of deduplicated files */
+	f = out_open(dir, "format.args", -1);
+	fprintf(f, "%zu %zu bs=%zu%s\n", opt.blocks + opt.scripts * opt.files,
+		opt.scripts * opt.files < FS_FILE_MAX_COUNT ?
+		(size_t)FS_FILE_MAX_COUNT : opt.scripts * opt.files, opt.bs,
+		opt.blocks + opt.scripts * opt.files >= 0xFFFF ? " fat32" : "");
+	if (fclose(f))
+		die_perror("fclose");
+
+	printf("Generated %zu script(s) of %zu commands in total: %zu reads "
+	       "(%zu bytes), %zu writes (%zu bytes), %zu seeks, %zu churns, "
+	       "%zu truncates\n", opt.scripts, total.commands, total.reads,
+	       total.read_bytes, total.writes, total.write_bytes, total.seeks,
+	       total.churns, total.truncs);
+
+	free(pool);
+	return 0;
+}
@@ -0,0 +1,387 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+#include <trace.h>
+
+#define fs_replay_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_replay_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+/* Latency histogram buckets, bucket i counts calls of [2^i, 2^(i+1)) ns */
+#define HIST_BUCKETS 32
+
+/* Entries returned by the replayed fs_list() calls, the others are counted */
+#define LIST_MAX 64
+
+static const char *op_names[TRACE_OP_COUNT] = {
+	[TRACE_MOUNT] = "mount",
+	[TRACE_UMOUNT] = "umount",
+	[TRACE_INFO] = "info",
+	[TRACE_CREATE] = "create",
+	[TRACE_DELETE] = "delete",
+	[TRACE_LS] = "ls",
+	[TRACE_OPEN] = "open",
+	[TRACE_CLOSE] = "close",
+	[TRACE_STAT] = "stat",
+	[TRACE_LSEEK] = "lseek",
+	[TRACE_WRITE] = "write",
+	[TRACE_READ] = "read",
+	[TRACE_PWRITE] = "pwrite",
+	[TRACE_PREAD] = "pread",
+	[TRACE_WRITEV] = "writev",
+	[TRACE_READV] = "readv",
+	[TRACE_TRUNCATE] = "truncate",
+	[TRACE_FALLOCATE] = "fallocate",
+	[TRACE_RECLAIM] = "reclaim",
+	[TRACE_DEFRAG] = "defrag",
+	[TRACE_FRAG_REPORT] = "frag",
+	[TRACE_INFO_GET] = "info_get",
+	[TRACE_STATFS] = "statfs",
+	[TRACE_LIST] = "list",
+};
+
+/* Latencies of all the replayed calls of one operation */
+struct op_stats {
+	uint64_t *lat_ns;
+	size_t count;
+	size_t alloc;
+	uint64_t total_ns;
+};
+
+static struct op_stats stats[TRACE_OP_COUNT];
+static uint64_t hist[HIST_BUCKETS];
+
+/* Recorded file descriptor -> replayed file descriptor */
+static int *fd_map;
+static size_t fd_map_len;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int *fd_slot(int fd)
+{
+	if (fd < 0)
+		return NULL;
+	if ((size_t)fd >= fd_map_len) {
+		size_t len = fd_map_len ? fd_map_len : 64;
+
+		while (len <= (size_t)fd)
+			len *= 2;
+		fd_map = realloc(fd_map, len * sizeof(*fd_map));
+		if (!fd_map)
+			die_perror("realloc");
+		for (size_t i = fd_map_len; i < len; i++)
+			fd_map[i] = -1;
+		fd_map_len = len;
+	}
+	return &fd_map[fd];
+}
+
+static int live_fd(int fd)
+{
+	int *slot = fd_slot(fd);
+
+	return slot ? *slot : -1;
+}
+
+static void record_latency(int op, uint64_t ns)
+{
+	struct op_stats *st = &stats[op];
+	int bucket = 0;
+
+	if (st->count == st->alloc) {
+		st->alloc = st->alloc ? st->alloc * 2 : 1024;
+		st->lat_ns = realloc(st->lat_ns, st->alloc * sizeof(uint64_t));
+		if (!st->lat_ns)
+			die_perror("realloc");
+	}
+	st->lat_ns[st->count++] = ns;
+	st->total_ns += ns;
+
+	while (bucket < HIST_BUCKETS - 1 && (ns >> (bucket + 1)))
+		bucket++;
+	hist[bucket]++;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* fs_ls() and fs_info() print their results, keep them out of the report */
+static int quiet_begin(void)
+{
+	int saved, null;
+
+	fflush(stdout);
+	saved = dup(STDOUT_FILENO);
+	null = open("/dev/null", O_WRONLY);
+	if (saved < 0 || null < 0)
+		die_perror("open");
+	dup2(null, STDOUT_FILENO);
+	close(null);
+	return saved;
+}
+
+static void quiet_end(int saved)
+{
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+}
+
+static void report(uint64_t elapsed_ns, size_t calls, size_t diverged,
+		   uint64_t bytes_read, uint64_t bytes_written)
+{
+	double secs = elapsed_ns / 1e9;
+
+	printf("Replayed %zu calls in %.2f ms (%.0f calls/s), %zu diverged "
+	       "from the trace\n", calls, elapsed_ns / 1e6,
+	       secs > 0 ? calls / secs : 0, diverged);
+	printf("Read %llu bytes (%.1f MB/s), wrote %llu bytes (%.1f MB/s)\n",
+	       (unsigned long long)bytes_read,
+	       secs > 0 ? bytes_read / secs / 1e6 : 0,
+	       (unsigned long long)bytes_written,
+	       secs > 0 ? bytes_written / secs / 1e6 : 0);
+
+	printf("%-8s %10s %10s %10s %10s %10s\n", "op", "count", "mean_us",
+	       "p50_us", "p99_us", "max_us");
+	for (int op = 1; op < TRACE_OP_COUNT; op++) {
+		struct op_stats *st = &stats[op];
+
+		if (!st->count)
+			continue;
+		qsort(st->lat_ns, st->count, sizeof(uint64_t), cmp_u64);
+		printf("%-8s %10zu %10.2f %10.2f %10.2f %10.2f\n",
+		       op_names[op], st->count,
+		       st->total_ns / 1e3 / st->count,
+		       st->lat_ns[st->count / 2] / 1e3,
+		       st->lat_ns[st->count * 99 / 100] / 1e3,
+		       st->lat_ns[st->count - 1] / 1e3);
+	}
+
+	printf("Latency histogram (all calls):\n");
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		if (!hist[i])
+			continue;
+		printf("  [%10.3f, %10.3f) us %10llu\n", (1ull << i) / 1e3,
+		       (2ull << i) / 1e3, (unsigned long long)hist[i]);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct trace_header header;
+	struct trace_record rec;
+	struct fs_frag_report frag;
+	struct fs_info_stats info;
+	struct fs_statfs space;
+	struct fs_dirent ents[LIST_MAX];
+	char name[FS_FILENAME_LEN];
+	char *diskname, *buf = NULL;
+	size_t buf_len = 0, calls = 0, diverged = 0;
+	uint64_t start, begin, bytes_read = 0, bytes_written = 0;
+	int paced = 0, mounted = 0;
+	FILE *trace;
+
+	if (argc < 3)
+		die("Usage: <diskname> <trace file> [paced]");
+	diskname = argv[1];
+	if (argc > 3 && !strcmp(argv[3], "paced"))
+		paced = 1;
+
+	trace = fopen(argv[2], "rb");
+	if (!trace)
+		die_perror("fopen");
+	if (fread(&header, sizeof(header), 1, trace) != 1 ||
+	    memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) ||
+	    header.record_size != sizeof(rec))
+		die("Not a trace file: %s", argv[2]);
+
+	begin = now_ns();
+	while (fread(&rec, sizeof(rec), 1, trace) == 1) {
+		int ret = -1, fd = live_fd(rec.fd), quiet;
+		struct iovec iov;
+
+		if (rec.op == 0 || rec.op >= TRACE_OP_COUNT ||
+		    rec.name_len >= FS_FILENAME_LEN)
+			die("Corrupted trace file: %s", argv[2]);
+		if (fread(name, 1, rec.name_len, trace) != rec.name_len)
+			die("Truncated trace file: %s", argv[2]);
+		name[rec.name_len] = '\0';
+
+		/* never hand a NULL buffer to zero-sized calls */
+		if (rec.size > buf_len || !buf) {
+			buf = realloc(buf, rec.size ? rec.size : 1);
+			if (!buf)
+				die_perror("realloc");
+			memset(buf + buf_len, 0xA5, rec.size - buf_len);
+			buf_len = rec.size;
+		}
+		iov.iov_base = buf;
+		iov.iov_len = rec.size;
+
+		/* Traces started after fs_mount() still need a mounted FS */
+		if (!mounted && rec.op != TRACE_MOUNT) {
+			if (fs_mount(diskname))
+				die("Cannot mount diskname");
+			mounted = 1;
+		}
+
+		if (paced) {
+			uint64_t elapsed = now_ns() - begin;
+
+			if (rec.start_ns > elapsed) {
+				uint64_t wait = rec.start_ns - elapsed;
+				struct timespec ts = {
+					.tv_sec = wait / 1000000000,
+					.tv_nsec = wait % 1000000000,
+				};
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		start = now_ns();
+		switch (rec.op) {
+		case TRACE_MOUNT:
+			ret = fs_mount_flags(diskname, rec.offset);
+			mounted = mounted || !ret;
+			break;
+		case TRACE_UMOUNT:
+			ret = fs_umount();
+			mounted = mounted && ret;
+			break;
+		case TRACE_INFO:
+			quiet = quiet_begin();
+			ret = fs_info();
+			quiet_end(quiet);
+			break;
+		case TRACE_LS:
+			quiet = quiet_begin();
+			ret = fs_ls();
+			quiet_end(quiet);
+			break;
+		case TRACE_CREATE:
+			ret = fs_create(name);
+			break;
+		case TRACE_DELETE:
+			ret = fs_delete(name);
+			break;
+		case TRACE_OPEN:
+			ret = fs_open_flags(name, rec.offset);
+			if (rec.ret >= 0)
+				*fd_slot(rec.ret) = ret;
+			break;
+		case TRACE_CLOSE:
+			ret = fs_close(fd);
+			if (!ret)
+				*fd_slot(rec.fd) = -1;
+			break;
+		case TRACE_STAT:
+			ret = fs_stat(fd);
+			break;
+		case TRACE_LSEEK:
+			ret = fs_lseek(fd, rec.offset);
+			break;
+		case TRACE_WRITE:
+			ret = fs_write(fd, buf, rec.size);
+			break;
+		case TRACE_READ:
+			ret = fs_read(fd, buf, rec.size);
+			break;
+		case TRACE_PWRITE:
+			ret = fs_pwrite(fd, buf, rec.size, rec.offset);
+			break;
+		case TRACE_PREAD:
+			ret = fs_pread(fd, buf, rec.size, rec.offset);
+			break;
+		case TRACE_WRITEV:
+			/* the buffer layout is not recorded, only its size */
+			ret = fs_writev(fd, &iov, 1);
+			break;
+		case TRACE_READV:
+			ret = fs_readv(fd, &iov, 1);
+			break;
+		case TRACE_TRUNCATE:
+			ret = fs_truncate(fd, rec.offset);
+			break;
+		case TRACE_FALLOCATE:
+			ret = fs_fallocate(fd, rec.offset);
+			break;
+		case TRACE_RECLAIM:
+			ret = fs_reclaim();
+			break;
+		case TRACE_DEFRAG:
+			ret = fs_defrag(rec.offset);
+			break;
+		case TRACE_FRAG_REPORT:
+			ret = fs_frag_report(&frag);
+			break;
+		case TRACE_INFO_GET:
+			ret = fs_info_get(&info);
+			break;
+		case TRACE_STATFS:
+			ret = fs_statfs(&space);
+			break;
+		case TRACE_LIST:
+			ret = fs_list(rec.name_len ? name : NULL, ents,
+				      rec.offset < LIST_MAX ? rec.offset : LIST_MAX);
+			break;
+		}
+		record_latency(rec.op, now_ns() - start);
+
+		if (ret > 0 && (rec.op == TRACE_READ || rec.op == TRACE_PREAD ||
+				rec.op == TRACE_READV))
+			bytes_read += ret;
+		if (ret > 0 && (rec.op == TRACE_WRITE ||
+				rec.op == TRACE_PWRITE ||
+				rec.op == TRACE_WRITEV))
+			bytes_written += ret;
+		/* descriptor numbers may differ, only success must match */
+		if (rec.op == TRACE_OPEN ?
+		    (ret >= 0) != (rec.ret >= 0) : ret != rec.ret)
+			diverged++;
+		calls++;
+	}
+
+	/* descriptors left open by the trace would prevent fs_umount() */
+	for (size_t i = 0; i < fd_map_len; i++) {
+		if (fd_map[i] >= 0)
+			fs_close(fd_map[i]);
+	}
+	if (mounted)
+		fs_umount();
+	report(now_ns() - begin, calls, diverged, bytes_read, bytes_written);
+
+	fclose(trace);
+	free(buf);
+	free(fd_map);
+	for (int op = 0; op < TRACE_OP_COUNT; op++)
+		free(stats[op].lat_ns);
+
+	return 0;
+}
@@ -1,6 +1,9 @@
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,241 +37,932 @@ struct thread_arg {
 	char **argv;
 };
 
-void thread_fs_script(void *arg)
+/*
+ * Script interpreter, shared by the script and shell commands.
+ *
+ * A standalone script mounts and unmounts its disk itself with MOUNT and
+ * UMOUNT. Within a shell session, the disk stays mounted for the whole session:
+ * MOUNT and UMOUNT only report success, and several scripts can run at once in
+ * parallel threads, each with its own file descriptors.
+ */
+#define SCRIPT_LINE_LEN	1024
+#define SCRIPT_ARGS_MAX	8
+#define SCRIPT_FD_MAX	64
+#define SCRIPT_NAME_LEN	32
+
+struct script {
+	const char *diskname;
+	const char *who;	/* prefix of the error messages */
+	const char *tag;	/* prefix of the output lines */
+	int session;		/* disk mounted by the shell */
+	int mounted;
+	int fd;			/* current file descriptor */
+	int fd_count;
+	struct {
+		char name[SCRIPT_NAME_LEN];
+		int fd;
+	} fds[SCRIPT_FD_MAX];	/* named file descriptors */
+};
+
+#define script_error(s, fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", (s)->who, ##__VA_ARGS__)
+
+#define script_printf(s, fmt, ...) \
+	printf("%s"fmt, (s)->tag, ##__VA_ARGS__)
+
+static int script_run_parallel(const char *diskname, char **paths, int count);
+
+static void script_init(struct script *s, const char *diskname,
+			const char *who, const char *tag, int session)
 {
-	struct thread_arg *t_arg = arg;
-	struct stat st;
-	char *diskname, *script;
-	FILE *fd_script;
-	char *command, *data_source, *data_description, *data, *fs_filename;
-	const int total_command_parts = 4;
-	char *command_args[total_command_parts];
-	int offset;
-	char mounted = 0;
+	memset(s, 0, sizeof(*s));
+	s->diskname = diskname;
+	s->who = who;
+	s->tag = tag;
+	s->session = session;
+	s->fd = -1;
+}
 
-	char line_buffer[1024];
-	int command_index = 1;
+static int script_fd_find(struct script *s, const char *name)
+{
+	for (int i = 0; i < s->fd_count; i++) {
+		if (!strcmp(s->fds[i].name, name))
+			return i;
+	}
+	return -1;
+}
 
-	if (t_arg->argc < 2)
-		die("Usage: <diskname> <script filename>");
+/* Forget the name of closed file descriptor @fd, if it has one */
+static void script_fd_forget(struct script *s, int fd)
+{
+	for (int i = 0; i < s->fd_count; i++) {
+		if (s->fds[i].fd == fd) {
+			s->fds[i] = s->fds[--s->fd_count];
+			break;
+		}
+	}
+	if (s->fd == fd)
+		s->fd = -1;
+}
 
-	diskname = t_arg->argv[0];
-	script = t_arg->argv[1];
+/* Close the file descriptors a script left open on the session's mount */
+static void script_close_all(struct script *s)
+{
+	for (int i = 0; i < s->fd_count; i++) {
+		if (s->fds[i].fd != s->fd)
+			fs_close(s->fds[i].fd);
+	}
+	if (s->fd >= 0)
+		fs_close(s->fd);
+	s->fd_count = 0;
+	s->fd = -1;
+}
 
-	/* Open script on host computer */
-	fd_script = fopen(script, "r");
-	if (!fd_script)
-		die_perror("fopen");
+static int script_open(struct script *s, const char *filename,
+		       const char *name)
+{
+	int fd;
+
+	if (*name) {
+		if (strlen(name) >= SCRIPT_NAME_LEN) {
+			script_error(s, "File descriptor name too long: %s", name);
+			return -1;
+		}
+		if (script_fd_find(s, name) >= 0) {
+			script_error(s, "File descriptor already open: %s", name);
+			return -1;
+		}
+		if (s->fd_count == SCRIPT_FD_MAX) {
+			script_error(s, "Too many named file descriptors");
+			return -1;
+		}
+	}
+
+	fd = fs_open(filename);
+	if (fd < 0) {
+		script_error(s, "Cannot open file");
+		return -1;
+	}
+
+	if (*name) {
+		strcpy(s->fds[s->fd_count].name, name);
+		s->fds[s->fd_count++].fd = fd;
+	}
+	s->fd = fd;
+
+	return 0;
+}
 
-	int fs_fd = -1;
+static int script_close(struct script *s, const char *name)
+{
+	int fd = s->fd;
+
+	if (*name) {
+		int i = script_fd_find(s, name);
+
+		if (i < 0) {
+			script_error(s, "Unknown file descriptor: %s", name);
+			return -1;
+		}
+		fd = s->fds[i].fd;
+	}
 
-	/* Loop through the script and execute the specified commands */
-	while (fgets(line_buffer, 1024, fd_script) != NULL) {
-		/* Remove trailing newline from command line */
-		char *nl = strchr(line_buffer, '\n');
-		if (nl)
-			*nl = '\0';
+	if (fs_close(fd)) {
+		script_error(s, "Cannot close file");
+		return -1;
+	}
+	script_fd_forget(s, fd);
 
-		/* Tokenize line */
-		command_args[0] = strtok(line_buffer, "\t");
-		command_index = 1;
-		do {
-			command_args[command_index] = strtok(NULL, "\t");
-		} while (command_index < total_command_parts && command_args[command_index++] != NULL);
-		command = command_args[0];
+	return 0;
+}
+
+/* Copy the file of @fd from its offset to stdout, one chunk at a time */
+static int cat_stream(int fd)
+{
+	struct fs_iter *it;
+	const void *chunk;
+	int n;
+
+	it = fs_iter_open(fd, 0);
+	if (!it)
+		return -1;
+	while ((n = fs_iter_next(it, &chunk)) > 0)
+		fwrite(chunk, 1, n, stdout);
+	fs_iter_close(it);
+	fflush(stdout);
 
-		int data_fd;
-		int count, data_size;
+	return n;
+}
 
-		char *read_buf;
+/*
+ * Streaming ingest from host files which cannot be mapped (pipes, sockets,
+ * terminals). A producer thread fills chunks from the host file while the
+ * caller writes the previous ones to the file system, so that host reads
+ * overlap image writes. Short reads are coalesced into whole chunks, so that
+ * the writes cover whole blocks, unless the host file has no data ready.
+ */
+#define INGEST_CHUNK	(1 << 20)
+#define INGEST_BUFS	4
+
+struct ingest {
+	int host_fd;
+	char *buf[INGEST_BUFS];
+	size_t len[INGEST_BUFS];
+	int count;		/* filled buffers not written yet */
+	int done;		/* end of the host file, or read error */
+	int error;		/* errno of the failed read */
+	int stop;		/* the consumer gave up */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
 
-		/* End when no command present */
-		if (!command)
+static void *ingest_producer(void *arg)
+{
+	struct ingest *in = arg;
+	struct pollfd pfd = { .fd = in->host_fd, .events = POLLIN };
+	int head = 0, done = 0, error = 0, old;
+	size_t len;
+	ssize_t n;
+
+	/* only a blocked read can be cancelled, see ingest() */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+	while (!done) {
+		pthread_mutex_lock(&in->lock);
+		while (in->count == INGEST_BUFS && !in->stop)
+			pthread_cond_wait(&in->cond, &in->lock);
+		done = in->stop;
+		pthread_mutex_unlock(&in->lock);
+		if (done)
 			break;
 
-		if (strcmp(command, "MOUNT") == 0) {
-			if (fs_mount(diskname))
-				die("Cannot mount disk");
-			else {
-				printf("MOUNT successful.\n");
-				mounted = 1;
+		for (len = 0; len < INGEST_CHUNK; len += n) {
+			pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &old);
+			n = read(in->host_fd, in->buf[head] + len,
+				 INGEST_CHUNK - len);
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+			if (n < 0 && errno == EINTR) {
+				n = 0;
+				continue;
 			}
-
-		} else if (strcmp(command, "UMOUNT") == 0) {
-			if (mounted && fs_umount())
-				die("Cannot unmount");
-			else {
-				printf("UMOUNT successful.\n");
-				mounted = 0;
+			if (n <= 0) {
+				error = n < 0 ? errno : 0;
+				done = 1;
+				break;
+			}
+			/* don't hold data back waiting for a slow writer */
+			if (len + n < INGEST_CHUNK && !poll(&pfd, 1, 0)) {
+				len += n;
+				break;
 			}
+		}
 
-		} else if (strcmp(command, "CREATE") == 0) {
-			fs_filename = command_args[1];
+		pthread_mutex_lock(&in->lock);
+		in->len[head] = len;
+		in->count++;
+		in->done = done;
+		in->error = error;
+		pthread_cond_broadcast(&in->cond);
+		pthread_mutex_unlock(&in->lock);
+		head = (head + 1) % INGEST_BUFS;
+	}
 
-			if(fs_create(fs_filename)) {
-				fs_umount();
-				die("Cannot create file");
-			}
+	return NULL;
+}
 
-			printf("CREATE successful.\n");
+/*
+ * Copy host file @host_fd into file @fs_fd until the end of the host file, or
+ * until the file system is full. @written and @read are set to the number of
+ * bytes written and read. Return -1 if the host file cannot be read.
+ */
+static int ingest(int host_fd, int fs_fd, size_t *written, size_t *read)
+{
+	struct ingest in = { .host_fd = host_fd };
+	pthread_t producer;
+	int tail = 0, full = 0, ret = -1, n;
+
+	*written = *read = 0;
+	for (int i = 0; i < INGEST_BUFS; i++) {
+		in.buf[i] = malloc(INGEST_CHUNK);
+		if (!in.buf[i]) {
+			perror("malloc");
+			goto out;
+		}
+	}
+	pthread_mutex_init(&in.lock, NULL);
+	pthread_cond_init(&in.cond, NULL);
+	if (pthread_create(&producer, NULL, ingest_producer, &in)) {
+		perror("pthread_create");
+		goto out_sync;
+	}
 
-		} else if (strcmp(command, "DELETE") == 0) {
-			fs_filename = command_args[1];
+	for (;;) {
+		pthread_mutex_lock(&in.lock);
+		while (!in.count && !in.done)
+			pthread_cond_wait(&in.cond, &in.lock);
+		n = in.count;
+		pthread_mutex_unlock(&in.lock);
+		if (!n)
+			break;
 
-			if(fs_delete(fs_filename)) {
-				fs_umount();
-				die("Cannot delete file");
-			}
+		*read += in.len[tail];
+		n = in.len[tail] ? fs_write(fs_fd, in.buf[tail], in.len[tail]) : 0;
+		if (n > 0)
+			*written += n;
+		if (n != (int)in.len[tail]) {
+			full = 1;
+			break;
+		}
 
-			printf("DELETE successful.\n");
+		pthread_mutex_lock(&in.lock);
+		in.count--;
+		pthread_cond_broadcast(&in.cond);
+		pthread_mutex_unlock(&in.lock);
+		tail = (tail + 1) % INGEST_BUFS;
+	}
 
-		} else if (strcmp(command, "OPEN") == 0) {
-			fs_filename = command_args[1];
+	if (full) {
+		/* the producer may be blocked reading an idle pipe */
+		pthread_mutex_lock(&in.lock);
+		in.stop = 1;
+		pthread_cond_broadcast(&in.cond);
+		pthread_mutex_unlock(&in.lock);
+		pthread_cancel(producer);
+	}
+	pthread_join(producer, NULL);
 
-			fs_fd = fs_open(fs_filename);
+	ret = 0;
+	if (!full && in.error) {
+		errno = in.error;
+		perror("read");
+		ret = -1;
+	}
+out_sync:
+	pthread_cond_destroy(&in.cond);
+	pthread_mutex_destroy(&in.lock);
+out:
+	for (int i = 0; i < INGEST_BUFS; i++)
+		free(in.buf[i]);
+	return ret;
+}
 
-			if (fs_fd < 0) {
-				fs_umount();
-				die("Cannot open file");
-			}
+/* Whether host file @st is read by ingest() rather than mapped */
+static int ingest_streamed(const struct stat *st)
+{
+	return S_ISFIFO(st->st_mode) || S_ISSOCK(st->st_mode) ||
+		S_ISCHR(st->st_mode);
+}
 
-			printf("OPEN successful.\n");
+static int script_cat(struct script *s, const char *filename)
+{
+	int fd, stat;
 
-		} else if (strcmp(command, "CLOSE") == 0) {
-			if (fs_close(fs_fd)) {
-				fs_umount();
-				die("Cannot close file");
-			}
+	fd = fs_open(filename);
+	if (fd < 0) {
+		script_error(s, "Cannot open file");
+		return -1;
+	}
 
-			printf("CLOSE successful.\n");
+	stat = fs_stat(fd);
+	if (stat <= 0) {
+		fs_close(fd);
+		if (stat < 0) {
+			script_error(s, "Cannot stat file");
+			return -1;
+		}
+		script_printf(s, "Empty file\n");
+		return 0;
+	}
 
-		} else if (strcmp(command, "SEEK") == 0) {
-			offset = atoi(command_args[1]);
+	script_printf(s, "Read file '%s' (%d/%d bytes)\n", filename, stat, stat);
+	script_printf(s, "Content of the file:\n");
+	if (cat_stream(fd)) {
+		script_error(s, "Cannot read file");
+		fs_close(fd);
+		return -1;
+	}
+	if (fs_close(fd)) {
+		script_error(s, "Cannot close file");
+		return -1;
+	}
 
-			if (fs_lseek(fs_fd, offset)) {
-				fs_umount();
-				die("Cannot seek to position");
-			} else {
-				printf("SEEK successful.\n");
-			}
+	return 0;
+}
+
+static int script_add(struct script *s, const char *filename,
+		      const char *fs_filename)
+{
+	struct stat st;
+	int fd, fs_fd, streamed;
+	size_t written = 0, size;
+	char *buf = NULL;
+	int ret = -1;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		perror("open");
+		return -1;
+	}
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		goto out;
+	}
+	streamed = ingest_streamed(&st);
+	if (!S_ISREG(st.st_mode) && !streamed) {
+		script_error(s, "Not a regular file: %s", filename);
+		goto out;
+	}
+	size = st.st_size;
+	if (!streamed && size) {
+		buf = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (buf == MAP_FAILED) {
+			perror("mmap");
+			goto out;
+		}
+	}
+
+	if (fs_create(fs_filename)) {
+		script_error(s, "Cannot create file");
+		goto out_unmap;
+	}
+	fs_fd = fs_open(fs_filename);
+	if (fs_fd < 0) {
+		script_error(s, "Cannot open file");
+		goto out_unmap;
+	}
+	if (streamed) {
+		if (ingest(fd, fs_fd, &written, &size)) {
+			fs_close(fs_fd);
+			goto out_unmap;
+		}
+	} else if (size) {
+		int n = fs_write(fs_fd, buf, size);
+
+		written = n > 0 ? n : 0;
+	}
+	if (fs_close(fs_fd)) {
+		script_error(s, "Cannot close file");
+		goto out_unmap;
+	}
+
+	script_printf(s, "Wrote file '%s' (%zu/%zu bytes)\n", fs_filename,
+		      written, size);
+	ret = 0;
+
+out_unmap:
+	if (buf)
+		munmap(buf, st.st_size);
+out:
+	close(fd);
+	return ret;
+}
+
+static int script_stat(struct script *s, const char *filename)
+{
+	int fd, stat;
+
+	fd = fs_open(filename);
+	if (fd < 0) {
+		script_error(s, "Cannot open file");
+		return -1;
+	}
+	stat = fs_stat(fd);
+	if (fs_close(fd) || stat < 0) {
+		script_error(s, "Cannot stat file");
+		return -1;
+	}
+
+	if (!stat)
+		script_printf(s, "Empty file\n");
+	else
+		script_printf(s, "Size of file '%s' is %d bytes\n", filename, stat);
+
+	return 0;
+}
 
-		} else if (strcmp(command, "WRITE") == 0) {
-			data_source = command_args[1];
-			data_description = command_args[2];
-
-			if (strcmp(data_source, "DATA") == 0) {
-				data = data_description;
-				data_size = strlen(data);
-			} else if (strcmp(data_source, "FILE") == 0) {
-				data_fd = open(data_description, O_RDONLY);
-				if (data_fd < 0) {
-					fs_umount();
-					die_perror("open");
-				}
-				if (fstat(data_fd, &st)) {
-					fs_umount();
-					die_perror("fstat");
-				}
-				if (!S_ISREG(st.st_mode)) {
-					fs_umount();
-					die("Not a regular file: %s\n", data_description);
-				}
-				data_size = st.st_size;
-				data = mmap(NULL, data_size, PROT_READ, MAP_PRIVATE, data_fd, 0);
-			} else {
-				data = NULL;
-				data_size = 0;
+/*
+ * Get the bytes of host file @st that a WRITE or READ command uses: @len_arg
+ * bytes from offset @off_arg if given, up to the end of the file by default.
+ */
+static int script_slice(struct script *s, const struct stat *st,
+			const char *off_arg, const char *len_arg, off_t *off,
+			int *len)
+{
+	*off = *off_arg ? atoll(off_arg) : 0;
+	*len = *len_arg ? atoi(len_arg) : st->st_size - *off;
+	if (*off < 0 || *len < 0 || *off + *len > st->st_size) {
+		script_error(s, "Invalid file slice: %s %s", off_arg, len_arg);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Execute one script line. Return 0 on success, 1 at the end of the script
+ * (empty line or QUIT), and -1 after reporting an error.
+ */
+static int script_exec(struct script *s, char *line)
+{
+	struct stat st;
+	char *command, *data_source, *data_description, *data, *fs_filename;
+	char *command_args[SCRIPT_ARGS_MAX];
+	char *saveptr;
+	int nargs, offset;
+	int data_fd;
+	int count, data_size;
+	char *read_buf;
+	off_t slice;
+
+	/* Remove trailing newline from command line */
+	char *nl = strchr(line, '\n');
+	if (nl)
+		*nl = '\0';
+
+	/* Tokenize line, missing arguments are empty */
+	command_args[0] = strtok_r(line, "\t", &saveptr);
+	for (nargs = 1; nargs < SCRIPT_ARGS_MAX; nargs++) {
+		command_args[nargs] = strtok_r(NULL, "\t", &saveptr);
+		if (!command_args[nargs])
+			break;
+	}
+	for (int i = nargs; i < SCRIPT_ARGS_MAX; i++)
+		command_args[i] = "";
+	command = command_args[0];
+
+	/* End when no command present */
+	if (!command || strcmp(command, "QUIT") == 0)
+		return 1;
+
+	if (strcmp(command, "MOUNT") == 0) {
+		if (!s->session) {
+			if (fs_mount(s->diskname)) {
+				script_error(s, "Cannot mount disk");
+				return -1;
 			}
+			s->mounted = 1;
+		}
+		script_printf(s, "MOUNT successful.\n");
 
-			if (!data) {
-				fs_umount();
-				die_perror("Could not find data to write");
+	} else if (strcmp(command, "UMOUNT") == 0) {
+		if (!s->session) {
+			if (s->mounted && fs_umount()) {
+				script_error(s, "Cannot unmount");
+				return -1;
 			}
+			s->mounted = 0;
+		}
+		script_printf(s, "UMOUNT successful.\n");
+
+	} else if (strcmp(command, "CREATE") == 0) {
+		fs_filename = command_args[1];
+
+		if(fs_create(fs_filename)) {
+			script_error(s, "Cannot create file");
+			return -1;
+		}
+
+		script_printf(s, "CREATE successful.\n");
+
+	} else if (strcmp(command, "DELETE") == 0) {
+		fs_filename = command_args[1];
+
+		if(fs_delete(fs_filename)) {
+			script_error(s, "Cannot delete file");
+			return -1;
+		}
+
+		script_printf(s, "DELETE successful.\n");
+
+	} else if (strcmp(command, "OPEN") == 0) {
+		if (script_open(s, command_args[1], command_args[2]))
+			return -1;
+
+		script_printf(s, "OPEN successful.\n");
+
+	} else if (strcmp(command, "CLOSE") == 0) {
+		if (script_close(s, command_args[1]))
+			return -1;
+
+		script_printf(s, "CLOSE successful.\n");
+
+	} else if (strcmp(command, "USE") == 0) {
+		int i = script_fd_find(s, command_args[1]);
+
+		if (i < 0) {
+			script_error(s, "Unknown file descriptor: %s",
+				     command_args[1]);
+			return -1;
+		}
+		s->fd = s->fds[i].fd;
+
+		script_printf(s, "USE successful.\n");
+
+	} else if (strcmp(command, "SEEK") == 0) {
+		offset = atoi(command_args[1]);
+
+		if (fs_lseek(s->fd, offset)) {
+			script_error(s, "Cannot seek to position");
+			return -1;
+		}
+
+		script_printf(s, "SEEK successful.\n");
 
-			count = fs_write(fs_fd, data, data_size);
-			if (count < 0) {
-				fs_umount();
-				die("write error");
+	} else if (strcmp(command, "TRUNCATE") == 0) {
+		if (fs_truncate(s->fd, atoi(command_args[1]))) {
+			script_error(s, "Cannot truncate file");
+			return -1;
+		}
+
+		script_printf(s, "TRUNCATE successful.\n");
+
+	} else if (strcmp(command, "FALLOCATE") == 0) {
+		if (fs_fallocate(s->fd, atoi(command_args[1]))) {
+			script_error(s, "Cannot preallocate file");
+			return -1;
+		}
+
+		script_printf(s, "FALLOCATE successful.\n");
+
+	} else if (strcmp(command, "WRITE") == 0) {
+		char mapped = 0, *map = NULL;
+
+		data_source = command_args[1];
+		data_description = command_args[2];
+
+		if (strcmp(data_source, "DATA") == 0) {
+			data = data_description;
+			data_size = strlen(data);
+		} else if (strcmp(data_source, "FILE") == 0) {
+			data_fd = open(data_description, O_RDONLY);
+			if (data_fd < 0) {
+				perror("open");
+				return -1;
 			}
-			printf("Wrote %d bytes to file.\n", count);
-
-		} else if (strcmp(command, "READ") == 0) {
-			int read_req_length = atoi(command_args[1]);
-			data_source = command_args[2];
-			data_description = command_args[3];
-
-			char file_loaded = 0;
-
-			if (strcmp(data_source, "DATA") == 0) {
-				data = data_description;
-				data_size = strlen(data);
-			} else if (strcmp(data_source, "FILE") == 0) {
-				data_fd = open(data_description, O_RDONLY);
-				if (data_fd < 0) {
-					fs_umount();
-					die_perror("open");
-				}
-				if (fstat(data_fd, &st)) {
-					fs_umount();
-					die_perror("fstat");
-				}
-				if (!S_ISREG(st.st_mode)) {
-					fs_umount();
-					die("Not a regular file: %s\n", data_description);
-				}
-
-				FILE *data_file = fopen(data_description, "r");
-				data_size = st.st_size;
-				data = calloc(data_size+1, sizeof(char));
-				size_t n = fread (data, sizeof(char), data_size, data_file);
-				assert(n == sizeof(char) * data_size);
-				fclose(data_file);
-				file_loaded = 1;
-			} else {
-				fs_umount();
-				die("Invalid data description");
+			if (fstat(data_fd, &st)) {
+				perror("fstat");
+				close(data_fd);
+				return -1;
 			}
-
-			if (!data) {
-				fs_umount();
-				die_perror("Could not find data to write");
+			if (!S_ISREG(st.st_mode)) {
+				script_error(s, "Not a regular file: %s\n",
+					     data_description);
+				close(data_fd);
+				return -1;
 			}
-
-			if (read_req_length < 0) {
-				fs_umount();
-				die("invalid data read length");
+			if (script_slice(s, &st, command_args[3], command_args[4],
+					 &slice, &data_size)) {
+				close(data_fd);
+				return -1;
 			}
+			map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, data_fd, 0);
+			close(data_fd);
+			mapped = map != MAP_FAILED;
+			data = map + (mapped ? slice : 0);
+		} else {
+			data = NULL;
+			data_size = 0;
+		}
 
-			read_buf = calloc(read_req_length+1, sizeof(char));
-			count = fs_read(fs_fd, read_buf, read_req_length);
+		if (!data) {
+			perror("Could not find data to write");
+			return -1;
+		}
 
-			if (count < 0) {
-				fs_umount();
-				die("read error");
+		count = fs_write(s->fd, data, data_size);
+		if (mapped)
+			munmap(map, st.st_size);
+		if (count < 0) {
+			script_error(s, "write error");
+			return -1;
+		}
+		script_printf(s, "Wrote %d bytes to file.\n", count);
+
+	} else if (strcmp(command, "READ") == 0) {
+		int read_req_length = atoi(command_args[1]);
+		data_source = command_args[2];
+		data_description = command_args[3];
+
+		char file_loaded = 0;
+
+		if (strcmp(data_source, "DATA") == 0) {
+			data = data_description;
+			data_size = strlen(data);
+		} else if (strcmp(data_source, "FILE") == 0) {
+			data_fd = open(data_description, O_RDONLY);
+			if (data_fd < 0) {
+				perror("open");
+				return -1;
+			}
+			if (fstat(data_fd, &st)) {
+				perror("fstat");
+				close(data_fd);
+				return -1;
 			}
+			if (!S_ISREG(st.st_mode)) {
+				script_error(s, "Not a regular file: %s\n",
+					     data_description);
+				close(data_fd);
+				return -1;
+			}
+			if (script_slice(s, &st, command_args[4], command_args[5],
+					 &slice, &data_size)) {
+				close(data_fd);
+				return -1;
+			}
+
+			data = calloc(data_size+1, sizeof(char));
+			ssize_t n = pread(data_fd, data, data_size, slice);
+			assert(n == sizeof(char) * data_size);
+			close(data_fd);
+			file_loaded = 1;
+		} else {
+			script_error(s, "Invalid data description");
+			return -1;
+		}
+
+		if (!data) {
+			perror("Could not find data to write");
+			return -1;
+		}
+
+		if (read_req_length < 0) {
+			script_error(s, "invalid data read length");
+			goto read_fail;
+		}
 
-			// both data and read_buf were allocated with an extra zero byte
-			// +1 here to check for the canaries
-			if (memcmp(data, read_buf, data_size+1) == 0)
-				printf("Read %d bytes from file. Compared %d correct.\n", count, data_size);
-			else
-				printf("Read unexpected data! %s read vs given %s\n", read_buf, data);
+		read_buf = calloc(read_req_length+1, sizeof(char));
+		count = fs_read(s->fd, read_buf, read_req_length);
 
+		if (count < 0) {
+			script_error(s, "read error");
 			free(read_buf);
-			if(file_loaded){
-				free(data);
-			}
+			goto read_fail;
+		}
+
+		// both data and read_buf were allocated with an extra zero byte
+		// +1 here to check for the canaries
+		if (memcmp(data, read_buf, data_size+1) == 0)
+			script_printf(s, "Read %d bytes from file. Compared %d correct.\n", count, data_size);
+		else
+			script_printf(s, "Read unexpected data! %s read vs given %s\n", read_buf, data);
+
+		free(read_buf);
+		if(file_loaded){
+			free(data);
+		}
+		return 0;
+read_fail:
+		if (file_loaded)
+			free(data);
+		return -1;
+
+	} else if (strcmp(command, "INFO") == 0) {
+		if (fs_info()) {
+			script_error(s, "Cannot get file system information");
+			return -1;
+		}
+
+	} else if (strcmp(command, "LS") == 0) {
+		if (fs_ls()) {
+			script_error(s, "Cannot list files");
+			return -1;
+		}
+
+	} else if (strcmp(command, "STAT") == 0) {
+		return script_stat(s, command_args[1]);
+
+	} else if (strcmp(command, "CAT") == 0) {
+		return script_cat(s, command_args[1]);
+
+	} else if (strcmp(command, "ADD") == 0) {
+		return script_add(s, command_args[1], *command_args[2] ?
+				  command_args[2] : command_args[1]);
+
+	} else if (strcmp(command, "RUN") == 0) {
+		int failed;
+
+		if (!s->session) {
+			script_error(s, "RUN needs a shell session");
+			return -1;
+		}
+
+		failed = script_run_parallel(s->diskname, &command_args[1],
+					     nargs - 1);
+		if (failed) {
+			script_error(s, "%d script(s) failed", failed);
+			return -1;
 		}
+
+		script_printf(s, "RUN successful.\n");
+	}
+
+	return 0;
+}
+
+/* Execute the lines of @f until its end, an empty line, or an error */
+static int script_run(struct script *s, FILE *f)
+{
+	char line_buffer[SCRIPT_LINE_LEN];
+	int ret;
+
+	while (fgets(line_buffer, sizeof(line_buffer), f) != NULL) {
+		ret = script_exec(s, line_buffer);
+		if (ret)
+			return ret < 0 ? -1 : 0;
+	}
+
+	return 0;
+}
+
+struct script_thread {
+	pthread_t tid;
+	struct script s;
+	char tag[16];
+	int started;
+	int ret;
+};
+
+static void *script_thread(void *arg)
+{
+	struct script_thread *t = arg;
+	FILE *f;
+
+	f = fopen(t->s.who, "r");
+	if (!f) {
+		perror(t->s.who);
+		t->ret = -1;
+		return NULL;
+	}
+
+	t->ret = script_run(&t->s, f);
+	script_close_all(&t->s);
+	fclose(f);
+
+	return NULL;
+}
+
+/*
+ * Run scripts @paths in parallel threads on the session's mount of @diskname,
+ * return the number of scripts which failed. With several scripts, each output
+ * line is prefixed by the index of its script.
+ */
+static int script_run_parallel(const char *diskname, char **paths, int count)
+{
+	struct script_thread *t;
+	int failed = 0;
+
+	t = calloc(count, sizeof(*t));
+	if (!t) {
+		perror("calloc");
+		return count;
+	}
+
+	for (int i = 0; i < count; i++) {
+		snprintf(t[i].tag, sizeof(t[i].tag), "[%d] ", i);
+		script_init(&t[i].s, diskname, paths[i],
+			    count > 1 ? t[i].tag : "", 1);
+		t[i].started = !pthread_create(&t[i].tid, NULL, script_thread,
+					       &t[i]);
+		if (!t[i].started)
+			script_thread(&t[i]);
+	}
+
+	for (int i = 0; i < count; i++) {
+		if (t[i].started)
+			pthread_join(t[i].tid, NULL);
+		failed += t[i].ret < 0;
+	}
+
+	free(t);
+	return failed;
+}
+
+void thread_fs_script(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct script s;
+	char *diskname, *script;
+	FILE *fd_script;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <script filename>");
+
+	diskname = t_arg->argv[0];
+	script = t_arg->argv[1];
+
+	/* Open script on host computer */
+	fd_script = fopen(script, "r");
+	if (!fd_script)
+		die_perror("fopen");
+
+	script_init(&s, diskname, __func__, "", 0);
+	if (script_run(&s, fd_script)) {
+		if (s.mounted)
+			fs_umount();
+		exit(1);
 	}
 
 	/* unmount at the end just to be safe in case there is
 	   no UMOUNT command in script */
-	if (mounted && fs_umount())
+	if (s.mounted && fs_umount())
 		die("Cannot unmount diskname");
 
 	fclose(fd_script);
 }
 
+void thread_fs_shell(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct script s;
+	char line_buffer[SCRIPT_LINE_LEN];
+	char *diskname;
+	int interactive, ret, failed = 0;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<script filename>...]");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (t_arg->argc > 1) {
+		/* Batch of scripts run in parallel */
+		failed = script_run_parallel(diskname, &t_arg->argv[1],
+					     t_arg->argc - 1);
+	} else {
+		/* Commands read from the standard input */
+		interactive = isatty(STDIN_FILENO);
+		script_init(&s, diskname, __func__, "", 1);
+		for (;;) {
+			if (interactive) {
+				printf("fs> ");
+				fflush(stdout);
+			}
+			if (!fgets(line_buffer, sizeof(line_buffer), stdin))
+				break;
+			/* Skip empty lines, they end scripts only */
+			if (!line_buffer[strspn(line_buffer, "\t\n")])
+				continue;
+			ret = script_exec(&s, line_buffer);
+			if (ret > 0)
+				break;
+			/* Errors end a batch, not an interactive session */
+			if (ret < 0 && !interactive) {
+				failed = 1;
+				break;
+			}
+		}
+		script_close_all(&s);
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	if (failed)
+		exit(1);
+}
+
 void thread_fs_stat(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -319,9 +1013,9 @@ void thread_fs_stat(void *arg)
 void thread_fs_cat(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
+	char *diskname, *filename;
 	int fs_fd;
-	int stat, read;
+	int stat;
 
 	if (t_arg->argc < 2)
 		die("need <diskname> <filename>");
@@ -348,15 +1042,14 @@ void thread_fs_cat(void *arg)
 		printf("Empty file\n");
 		return;
 	}
-	buf = malloc(stat);
-	if (!buf) {
-		perror("malloc");
+	/* stream the content, memory use does not depend on the file size */
+	printf("Read file '%s' (%d/%d bytes)\n", filename, stat, stat);
+	printf("Content of the file:\n");
+	if (cat_stream(fs_fd)) {
 		fs_umount();
-		die("Cannot malloc");
+		die("Cannot read file");
 	}
 
-	read = fs_read(fs_fd, buf, stat);
-
 	if (fs_close(fs_fd)) {
 		fs_umount();
 		die("Cannot close file");
@@ -364,13 +1057,6 @@ void thread_fs_cat(void *arg)
 
 	if (fs_umount())
 		die("cannot unmount diskname");
-
-	printf("Read file '%s' (%d/%d bytes)\n", filename, read, stat);
-	printf("Content of the file:\n");
-	fwrite(buf, 1, stat, stdout);
-	fflush(stdout);
-
-	free(buf);
 }
 
 void thread_fs_rm(void *arg)
@@ -401,30 +1087,41 @@ void thread_fs_rm(void *arg)
 void thread_fs_add(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
-	int fd, fs_fd;
+	char *diskname, *filename, *fs_filename, *buf = NULL;
+	int fd, fs_fd, streamed;
 	struct stat st;
-	int written;
+	size_t size, written;
 
 	if (t_arg->argc < 2)
-		die("Usage: <diskname> <host filename>");
+		die("Usage: <diskname> <host filename> [<fs filename>]");
 
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
-
-	/* Open file on host computer */
-	fd = open(filename, O_RDONLY);
-	if (fd < 0)
-		die_perror("open");
+	fs_filename = t_arg->argc > 2 ? t_arg->argv[2] : filename;
+
+	/* Open file on host computer, - is the standard input */
+	if (!strcmp(filename, "-")) {
+		if (t_arg->argc < 3)
+			die("Need a file name for the standard input");
+		fd = STDIN_FILENO;
+	} else {
+		fd = open(filename, O_RDONLY);
+		if (fd < 0)
+			die_perror("open");
+	}
 	if (fstat(fd, &st))
 		die_perror("fstat");
-	if (!S_ISREG(st.st_mode))
+	streamed = ingest_streamed(&st);
+	if (!S_ISREG(st.st_mode) && !streamed)
 		die("Not a regular file: %s\n", filename);
 
-	/* Map file into buffer */
-	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (!buf)
-		die_perror("mmap");
+	/* Map regular files into buffer, stream the others */
+	size = st.st_size;
+	if (!streamed) {
+		buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (!buf)
+			die_perror("mmap");
+	}
 
 	/* Now, deal with our filesystem:
 	 * - mount, create a new file, copy content of host file into this new
@@ -433,18 +1130,26 @@ void thread_fs_add(void *arg)
 	if (fs_mount(diskname))
 		die("Cannot mount diskname");
 
-	if (fs_create(filename)) {
+	if (fs_create(fs_filename)) {
 		fs_umount();
 		die("Cannot create file");
 	}
 
-	fs_fd = fs_open(filename);
+	fs_fd = fs_open(fs_filename);
 	if (fs_fd < 0) {
 		fs_umount();
 		die("Cannot open file");
 	}
 
-	written = fs_write(fs_fd, buf, st.st_size);
+	if (streamed) {
+		if (ingest(fd, fs_fd, &written, &size)) {
+			fs_close(fs_fd);
+			fs_umount();
+			exit(1);
+		}
+	} else {
+		written = fs_write(fs_fd, buf, st.st_size);
+	}
 
 	if (fs_close(fs_fd)) {
 		fs_umount();
@@ -454,10 +1159,11 @@ void thread_fs_add(void *arg)
 	if (fs_umount())
 		die("Cannot unmount diskname");
 
-	printf("Wrote file '%s' (%d/%zu bytes)\n", filename, written,
-		   st.st_size);
+	printf("Wrote file '%s' (%d/%zu bytes)\n", fs_filename, (int)written,
+		   size);
 
-	munmap(buf, st.st_size);
+	if (buf)
+		munmap(buf, st.st_size);
 	close(fd);
 }
 
@@ -480,6 +1186,45 @@ void thread_fs_ls(void *arg)
 		die("Cannot unmount diskname");
 }
 
+void thread_fs_list(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_dirent ent;
+	struct fs_dir *dir;
+	char *diskname;
+	int ret;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<filename pattern>]");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	dir = fs_opendir(t_arg->argc > 1 ? t_arg->argv[1] : NULL);
+	if (!dir) {
+		fs_umount();
+		die("Cannot list the files");
+	}
+	while ((ret = fs_readdir(dir, &ent)) > 0) {
+		if (ent.data_blk == FS_DIRENT_NO_BLK)
+			printf("file: %s, size: %zu, data_blk: none\n",
+			       ent.name, ent.size);
+		else
+			printf("file: %s, size: %zu, data_blk: %zu\n",
+			       ent.name, ent.size, ent.data_blk);
+	}
+	fs_closedir(dir);
+	if (ret) {
+		fs_umount();
+		die("Cannot list the files");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
 void thread_fs_info(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -507,17 +1252,148 @@ size_t get_argv(char *argv)
 	return (size_t)ret;
 }
 
+static void print_hist(const char *name, const size_t *hist)
+{
+	for (int i = 0; i < FS_INFO_HIST_BUCKETS; i++) {
+		if (hist[i])
+			printf("%s[%llu-%llu]=%zu\n", name, 1ull << i,
+			       (2ull << i) - 1, hist[i]);
+	}
+}
+
+void thread_fs_stats(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_info_stats st;
+	char *diskname;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_info_get(&st)) {
+		fs_umount();
+		die("Cannot get file system statistics");
+	}
+
+	printf("FS Stats:\n");
+	printf("blk_size=%zu\n", st.blk_size);
+	printf("csum_blk_count=%zu\n", st.csum_blk_count);
+	printf("data_blk_count=%zu\n", st.data_blk_count);
+	printf("fat_free=%zu\n", st.fat_free);
+	printf("file_count=%zu\n", st.file_count);
+	printf("used_blk_count=%zu\n", st.used_blk_count);
+	printf("reserved_blk_count=%zu\n", st.reserved_blk_count);
+	printf("slack_bytes=%zu\n", st.slack_bytes);
+	printf("extent_count=%zu\n", st.extent_count);
+	printf("max_file_extents=%zu\n", st.max_file_extents);
+	printf("fragmented_count=%zu\n", st.fragmented_count);
+	printf("free_extent_count=%zu\n", st.free_extent_count);
+	printf("largest_free_extent=%zu\n", st.largest_free_extent);
+	printf("compressed_count=%zu\n", st.compressed_count);
+	printf("compressed_bytes=%zu\n", st.compressed_bytes);
+	printf("compressed_blk_count=%zu\n", st.compressed_blk_count);
+	printf("dedup_count=%zu\n", st.dedup_count);
+	printf("dedup_blk_count=%zu\n", st.dedup_blk_count);
+	printf("dedup_ref_count=%zu\n", st.dedup_ref_count);
+	printf("zero_blk_count=%zu\n", st.zero_blk_count);
+	printf("bounce_blk_count=%zu\n", st.bounce_blk_count);
+	print_hist("file_extents", st.extent_hist);
+	print_hist("file_blocks", st.chain_hist);
+	print_hist("free_extent_blocks", st.free_extent_hist);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_statfs(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_statfs st;
+	char *diskname;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_statfs(&st)) {
+		fs_umount();
+		die("Cannot get file system free space");
+	}
+
+	printf("FS Statfs:\n");
+	printf("blk_size=%zu\n", st.blk_size);
+	printf("data_blk_count=%zu\n", st.data_blk_count);
+	printf("free_blk_count=%zu\n", st.free_blk_count);
+	printf("file_count=%zu\n", st.file_count);
+	printf("file_max=%zu\n", st.file_max);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_format(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_format_opts opts = { 0 };
+	char *diskname;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <data block count> [<file count> [fat32] "
+		    "[bs=<block size>] [csum] [compress|dedup]]");
+
+	diskname = t_arg->argv[0];
+	opts.data_blk_count = get_argv(t_arg->argv[1]);
+	opts.file_count = FS_FILE_MAX_COUNT;
+	if (t_arg->argc > 2)
+		opts.file_count = get_argv(t_arg->argv[2]);
+	for (int i = 3; i < t_arg->argc; i++) {
+		if (!strcmp(t_arg->argv[i], "fat32"))
+			opts.fat32 = 1;
+		else if (!strncmp(t_arg->argv[i], "bs=", 3))
+			opts.block_size = get_argv(t_arg->argv[i] + 3);
+		else if (!strcmp(t_arg->argv[i], "csum"))
+			opts.checksum = 1;
+		else if (!strcmp(t_arg->argv[i], "compress"))
+			opts.compress = 1;
+		else if (!strcmp(t_arg->argv[i], "dedup"))
+			opts.dedup = 1;
+		else
+			die("Invalid format option '%s'", t_arg->argv[i]);
+	}
+
+	if (fs_format(diskname, &opts))
+		die("Cannot format diskname");
+
+	printf("Created virtual disk '%s' with '%zu' data blocks and '%zu' "
+	       "root directory entries\n", diskname, opts.data_blk_count,
+	       opts.file_count);
+}
+
 static struct {
 	const char *name;
 	void(*func)(void *);
 } commands[] = {
 	{ "info",	thread_fs_info },
+	{ "stats",	thread_fs_stats },
+	{ "statfs",	thread_fs_statfs },
 	{ "ls",		thread_fs_ls },
+	{ "list",	thread_fs_list },
 	{ "add",	thread_fs_add },
 	{ "rm",		thread_fs_rm },
 	{ "cat",	thread_fs_cat },
 	{ "stat",	thread_fs_stat },
-	{ "script",	thread_fs_script }
+	{ "script",	thread_fs_script },
+	{ "shell",	thread_fs_shell },
+	{ "format",	thread_fs_format }
 };
 
 void usage(char *program)
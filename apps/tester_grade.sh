@@ -244,6 +244,42 @@ END_SCRIPT
     log "Score: ${score}"
 }
 
+# blocks reserved with FALLOCATE, then freed by fs_ref.x, which leaves the
+# root directory entry as it was
+info_reserved() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool dd if=/dev/urandom of=test-file-1 bs=100 count=1
+	run_tool ./fs_ref.x add test.fs test-file-1
+    cat <<END_SCRIPT > info_reserved.script
+MOUNT
+OPEN	test-file-1
+FALLOCATE	40960
+CLOSE
+UMOUNT
+END_SCRIPT
+	run_tool ./test_fs.x script test.fs info_reserved.script
+	run_tool ./fs_ref.x rm test.fs test-file-1
+	run_tool ./fs_ref.x add test.fs test-file-1
+
+	local line_array=()
+	run_test ./test_fs.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	# the count saved by the first unmount is used by the next mount
+	run_test ./test_fs.x info test.fs
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	rm -f test.fs test-file-1 info_reserved.script
+
+	local corr_array=()
+	corr_array+=("fat_free_ratio=98/100")
+	corr_array+=("fat_free_ratio=98/100")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
 #
 # Run tests
 #
@@ -255,6 +291,7 @@ run_tests() {
 	create_simple
     # Phase 3 + 4
 	read_block
+	info_reserved
 }
 
 make_fs() {
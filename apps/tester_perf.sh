@@ -0,0 +1,194 @@
+#!/bin/bash
+
+#
+# Differential performance harness: runs the same workloads on fs_ref.x and
+# test_fs.x, on images from 1 data block to the largest fs_make.x can create,
+# and reports the speed of test_fs.x relative to the reference.
+#
+# Usage: ./tester_perf.sh [<runs> [<data block count>...]]
+#
+# Every workload is timed <runs> times per binary (default 20), alternating
+# between the two so that drifts of the machine affect both alike. For each
+# workload, the report gives the mean wall time of both binaries with its 95%
+# confidence interval, and the speedup of test_fs.x (reference time / test_fs.x
+# time, above 1 when test_fs.x is faster) with its own 95% confidence interval.
+# A workload is a regression when the whole interval of its speedup is below 1.
+# The outputs of both binaries are also compared once per workload.
+#
+# Exit status is 1 if any workload regressed or produced a different output.
+#
+
+set -o pipefail
+
+#
+# Logging helpers
+#
+log() {
+    echo -e "${*}"
+}
+
+warning() {
+    log "Warning: ${*}"
+}
+error() {
+    log "Error: ${*}"
+}
+die() {
+    error "${*}"
+    exit 1
+}
+
+RUNS=${1:-20}
+shift
+SIZES=("${@}")
+[[ ${#SIZES[@]} -eq 0 ]] && SIZES=(1 100 1024 4096 8192)
+
+# largest file of the cat, add and script workloads, in blocks
+MAX_FILE_BLOCKS=1024
+
+APPS=$(cd "$(dirname "${0}")" && pwd)
+REF="${APPS}/fs_ref.x"
+LIB="${APPS}/test_fs.x"
+MAKE="${APPS}/fs_make.x"
+
+REGRESSIONS=0
+MISMATCHES=0
+
+#
+# Timing helpers
+#
+
+# Wall time of a command in microseconds, its outputs are discarded
+time_us() {
+    local start=${EPOCHREALTIME/./}
+
+    "${@}" >/dev/null 2>&1
+    echo $(( ${EPOCHREALTIME/./} - start ))
+}
+
+# Compare the outputs of one run of both binaries
+# 1: setup command run before each binary, or ""
+# 2...: arguments of the binaries
+check_outputs() {
+    local setup="${1}"
+    shift
+
+    [[ -n "${setup}" ]] && eval "${setup}"
+    timeout 2 "${REF}" "${@}" >ref.stdout 2>ref.stderr
+    [[ -n "${setup}" ]] && eval "${setup}"
+    timeout 2 "${LIB}" "${@}" >lib.stdout 2>lib.stderr
+
+    if ! cmp -s ref.stdout lib.stdout || ! cmp -s ref.stderr lib.stderr; then
+        warning "outputs of '${*}' differ"
+        MISMATCHES=$(( MISMATCHES + 1 ))
+    fi
+    rm -f ref.stdout ref.stderr lib.stdout lib.stderr
+}
+
+# Time both binaries on one workload and report the comparison
+# 1: workload name
+# 2: data block count
+# 3: setup command run before each timed run, or ""
+# 4...: arguments of the binaries
+bench() {
+    local name="${1}" blocks="${2}" setup="${3}" ref_us=() lib_us=() i
+    shift 3
+
+    check_outputs "${setup}" "${@}"
+    for (( i = 0; i < RUNS; i++ )); do
+        [[ -n "${setup}" ]] && eval "${setup}"
+        ref_us+=($(time_us "${REF}" "${@}"))
+        [[ -n "${setup}" ]] && eval "${setup}"
+        lib_us+=($(time_us "${LIB}" "${@}"))
+    done
+
+    # Student t quantile approximated by 1.96 + 2.4 / df, within 1% for
+    # df >= 5. The speedup interval follows from the relative standard
+    # errors of both means (delta method).
+    awk -v name="${name}" -v blocks="${blocks}" \
+        -v ref="${ref_us[*]}" -v lib="${lib_us[*]}" '
+    function stats(str, out,    n, v, i, sum, sq) {
+        n = split(str, v, " ")
+        for (i = 1; i <= n; i++)
+            sum += v[i]
+        out["n"] = n
+        out["mean"] = sum / n
+        for (i = 1; i <= n; i++)
+            sq += (v[i] - out["mean"]) ^ 2
+        out["se"] = n > 1 ? sqrt(sq / (n - 1) / n) : 0
+    }
+    BEGIN {
+        stats(ref, r)
+        stats(lib, l)
+        t = 1.96 + 2.4 / (r["n"] + l["n"] - 2 > 0 ? r["n"] + l["n"] - 2 : 1)
+        speedup = r["mean"] / l["mean"]
+        rel = sqrt((r["se"] / r["mean"]) ^ 2 + (l["se"] / l["mean"]) ^ 2)
+        low = speedup * (1 - t * rel)
+        high = speedup * (1 + t * rel)
+        verdict = high < 1 ? "REGRESSION" : low > 1 ? "faster" : "same"
+        printf("%-7s %6d %9.3f +-%7.3f %9.3f +-%7.3f %7.2fx [%5.2f, %5.2f] %s\n",
+               name, blocks, r["mean"] / 1e3, t * r["se"] / 1e3,
+               l["mean"] / 1e3, t * l["se"] / 1e3, speedup, low, high,
+               verdict)
+        exit verdict == "REGRESSION"
+    }' || REGRESSIONS=$(( REGRESSIONS + 1 ))
+}
+
+#
+# Workloads
+#
+run_size() {
+    local blocks="${1}" file_blocks=$(( ${1} - 1 )) i
+
+    (( file_blocks > MAX_FILE_BLOCKS )) && file_blocks=${MAX_FILE_BLOCKS}
+
+    # empty image, and the same holding one large and ten empty files
+    "${MAKE}" empty.fs "${blocks}" >/dev/null ||
+        die "Cannot create a disk of ${blocks} blocks"
+    head -c $(( file_blocks * 4096 )) /dev/urandom >big_file
+    cp empty.fs full.fs
+    "${REF}" add full.fs big_file >/dev/null 2>&1 ||
+        die "Cannot add a file to a disk of ${blocks} blocks"
+    for i in $(seq 0 9); do
+        touch "small_${i}"
+        "${REF}" add full.fs "small_${i}" >/dev/null 2>&1
+    done
+
+    cat <<END_SCRIPT >rw.script
+MOUNT
+CREATE	rw_file
+OPEN	rw_file
+WRITE	FILE	big_file
+SEEK	0
+READ	$(( file_blocks * 4096 ))	FILE	big_file
+CLOSE
+DELETE	rw_file
+UMOUNT
+END_SCRIPT
+
+    bench info "${blocks}" "" info full.fs
+    bench ls "${blocks}" "" ls full.fs
+    bench cat "${blocks}" "" cat full.fs big_file
+    bench add "${blocks}" "cp empty.fs work.fs" add work.fs big_file
+    bench script "${blocks}" "cp empty.fs work.fs" script work.fs rw.script
+
+    rm -f empty.fs full.fs work.fs big_file small_* rw.script
+}
+
+for x in "${REF}" "${LIB}" "${MAKE}"; do
+    [[ -x "${x}" ]] || die "Can't find executable ${x}"
+done
+
+WORKDIR=$(mktemp -d) || die "Cannot create a work directory"
+trap 'rm -rf "${WORKDIR}"' EXIT
+cd "${WORKDIR}" || die "Cannot enter ${WORKDIR}"
+
+log "${RUNS} runs per binary and workload, times in ms with 95% confidence intervals"
+printf "%-7s %6s %20s %20s %24s\n" "command" "blocks" "fs_ref.x" "test_fs.x" \
+    "speedup"
+for blocks in "${SIZES[@]}"; do
+    run_size "${blocks}"
+done
+
+log "${REGRESSIONS} regression(s), ${MISMATCHES} output mismatch(es)"
+[[ ${REGRESSIONS} -eq 0 && ${MISMATCHES} -eq 0 ]]
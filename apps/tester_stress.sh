@@ -0,0 +1,114 @@
+#!/bin/bash
+
+#
+# Stress harness: generates a synthetic workload with fs_gen.x, runs it on a
+# fresh disk with the script command of test_fs.x, and reports its throughput.
+# Workloads of several scripts run in parallel threads on a single mount, with
+# the shell command of test_fs.x.
+#
+# Usage: ./tester_stress.sh [<runs>] [<option>=<value>...] [<format option>...]
+#
+# Options with a value go to fs_gen.x, run it without arguments for the list.
+# Other words (fat32, csum, compress, dedup) go to `test_fs.x format`. The
+# workload is run <runs> times (default 3), each on a freshly formatted disk.
+#
+# Exit status is 1 if any command failed or any READ returned unexpected data.
+#
+
+set -o pipefail
+
+#
+# Logging helpers
+#
+log() {
+    echo -e "${*}"
+}
+
+error() {
+    log "Error: ${*}"
+}
+die() {
+    error "${*}"
+    exit 1
+}
+
+RUNS=3
+if [[ "${1}" =~ ^[0-9]+$ ]]; then
+    RUNS=${1}
+    shift
+fi
+
+GEN_OPTS=()
+FORMAT_OPTS=()
+for arg in "${@}"; do
+    if [[ "${arg}" == *=* ]]; then
+        GEN_OPTS+=("${arg}")
+    else
+        FORMAT_OPTS+=("${arg}")
+    fi
+done
+
+APPS=$(cd "$(dirname "${0}")" && pwd)
+LIB="${APPS}/test_fs.x"
+GEN="${APPS}/fs_gen.x"
+
+for x in "${LIB}" "${GEN}"; do
+    [[ -x "${x}" ]] || die "Can't find executable ${x}"
+done
+
+WORKDIR=$(mktemp -d) || die "Cannot create a work directory"
+trap 'rm -rf "${WORKDIR}"' EXIT
+
+summary=$("${GEN}" "${WORKDIR}" "${GEN_OPTS[@]}") ||
+    die "Cannot generate the workload"
+log "${summary}"
+cd "${WORKDIR}" || die "Cannot enter ${WORKDIR}"
+
+# bytes moved by the reads and the writes of the workload
+bytes=$(sed -E 's/.* \(([0-9]+) bytes\).* \(([0-9]+) bytes\).*/\1 + \2/' \
+        <<<"${summary}")
+commands=$(cat script.* | wc -l)
+scripts=(script.*)
+
+FAILURES=0
+TIMES=()
+for (( i = 0; i < RUNS; i++ )); do
+    rm -f disk.fs
+    # shellcheck disable=SC2046
+    "${LIB}" format disk.fs $(cat format.args) "${FORMAT_OPTS[@]}" \
+        >/dev/null || die "Cannot format the disk"
+
+    start=${EPOCHREALTIME/./}
+    if [[ ${#scripts[@]} -eq 1 ]]; then
+        "${LIB}" script disk.fs script.0 >run.stdout 2>run.stderr
+    else
+        "${LIB}" shell disk.fs "${scripts[@]}" >run.stdout 2>run.stderr
+    fi
+    status=$?
+    TIMES+=($(( ${EPOCHREALTIME/./} - start )))
+
+    unexpected=$(grep -c "unexpected data" run.stdout)
+    if [[ ${status} -ne 0 || ${unexpected} -ne 0 ]]; then
+        error "run ${i}: exit status ${status}, ${unexpected} unexpected read(s)"
+        head -n 5 run.stderr
+        FAILURES=$(( FAILURES + 1 ))
+    fi
+done
+
+awk -v times="${TIMES[*]}" -v commands="${commands}" \
+    -v bytes="$(( bytes ))" -v scripts="${#scripts[@]}" '
+BEGIN {
+    n = split(times, t, " ")
+    min = t[1]
+    for (i = 1; i <= n; i++) {
+        sum += t[i]
+        if (t[i] < min)
+            min = t[i]
+    }
+    printf("%d run(s) of %d script(s): mean %.3f ms, best %.3f ms, " \
+           "%.0f commands/s, %.1f MB/s\n", n, scripts, sum / n / 1e3,
+           min / 1e3, commands / (min / 1e6), bytes / min)
+}'
+
+log "${FAILURES} failed run(s)"
+[[ ${FAILURES} -eq 0 ]]
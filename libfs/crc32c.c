@@ -0,0 +1,209 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <nmmintrin.h>
+#endif
+
+#include "crc32c.h"
+
+/* Reflected CRC32C polynomial */
+#define CRC32C_POLY 0x82F63B78
+
+/* Lengths of the three interleaved streams of the hardware version, powers of
+ * two: a 4 KiB block is five rounds of three 256-byte streams plus a tail */
+#define CRC32C_LONG 8192
+#define CRC32C_SHORT 256
+
+/* table[k][b] is the CRC of byte b followed by k zero bytes */
+static uint32_t table[8][256];
+
+/* operators appending CRC32C_LONG and CRC32C_SHORT zero bytes to a CRC */
+static uint32_t zeros_long[4][256];
+static uint32_t zeros_short[4][256];
+
+static uint32_t (*crc32c_impl)(uint32_t, const void *, size_t);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static uint32_t slice8(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint32_t c = ~crc;
+
+	while (len && ((uintptr_t)p & 7)) {
+		c = table[0][(c ^ *p++) & 0xFF] ^ (c >> 8);
+		len--;
+	}
+
+	/* eight bytes per step, one table lookup per byte (little endian) */
+	while (len >= 8) {
+		uint32_t lo, hi;
+
+		memcpy(&lo, p, 4);
+		memcpy(&hi, p + 4, 4);
+		lo ^= c;
+		c = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^
+			table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24] ^
+			table[3][hi & 0xFF] ^ table[2][(hi >> 8) & 0xFF] ^
+			table[1][(hi >> 16) & 0xFF] ^ table[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		c = table[0][(c ^ *p++) & 0xFF] ^ (c >> 8);
+	return ~c;
+}
+
+/* multiply vector @vec by the 32x32 GF(2) matrix @mat */
+static uint32_t gf2_times(const uint32_t *mat, uint32_t vec)
+{
+	uint32_t sum = 0;
+
+	for (; vec; vec >>= 1, mat++) {
+		if (vec & 1)
+			sum ^= *mat;
+	}
+	return sum;
+}
+
+static void gf2_square(uint32_t *square, const uint32_t *mat)
+{
+	for (int n = 0; n < 32; n++)
+		square[n] = gf2_times(mat, mat[n]);
+}
+
+/* build the tables appending @len zero bytes (a power of two) to a CRC */
+static void zeros_init(uint32_t zeros[4][256], size_t len)
+{
+	uint32_t odd[32], even[32], *op = even;
+
+	/* operator for one zero bit, then squared up to one zero byte */
+	odd[0] = CRC32C_POLY;
+	for (int n = 1; n < 32; n++)
+		odd[n] = 1u << (n - 1);
+	gf2_square(even, odd);
+	gf2_square(odd, even);
+	for (;;) {
+		gf2_square(even, odd);
+		op = even;
+		if (!(len >>= 1))
+			break;
+		gf2_square(odd, even);
+		op = odd;
+		if (!(len >>= 1))
+			break;
+	}
+
+	for (uint32_t n = 0; n < 256; n++) {
+		zeros[0][n] = gf2_times(op, n);
+		zeros[1][n] = gf2_times(op, n << 8);
+		zeros[2][n] = gf2_times(op, n << 16);
+		zeros[3][n] = gf2_times(op, n << 24);
+	}
+}
+
+static inline uint32_t zeros_shift(uint32_t zeros[4][256], uint32_t crc)
+{
+	return zeros[0][crc & 0xFF] ^ zeros[1][(crc >> 8) & 0xFF] ^
+		zeros[2][(crc >> 16) & 0xFF] ^ zeros[3][crc >> 24];
+}
+
+#if defined(__x86_64__)
+/* three independent streams hide the latency of the CRC32 instruction; the
+ * CRCs of the second and third streams are combined into the first one by
+ * appending zeros to it, which is linear */
+#define CRC32C_STREAMS(len, zeros)					\
+do {									\
+	while (n >= 3 * (len)) {					\
+		uint64_t c1 = 0, c2 = 0, v0, v1, v2;			\
+		const uint8_t *end = p + (len);				\
+									\
+		do {							\
+			memcpy(&v0, p, 8);				\
+			memcpy(&v1, p + (len), 8);			\
+			memcpy(&v2, p + 2 * (len), 8);			\
+			c = _mm_crc32_u64(c, v0);			\
+			c1 = _mm_crc32_u64(c1, v1);			\
+			c2 = _mm_crc32_u64(c2, v2);			\
+			p += 8;						\
+		} while (p < end);					\
+		c = zeros_shift(zeros, c) ^ c1;				\
+		c = zeros_shift(zeros, c) ^ c2;				\
+		p += 2 * (len);						\
+		n -= 3 * (len);						\
+	}								\
+} while (0)
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t n)
+{
+	const uint8_t *p = buf;
+	uint64_t c = ~crc & 0xFFFFFFFF, v;
+
+	while (n && ((uintptr_t)p & 7)) {
+		c = _mm_crc32_u8(c, *p++);
+		n--;
+	}
+	CRC32C_STREAMS(CRC32C_LONG, zeros_long);
+	CRC32C_STREAMS(CRC32C_SHORT, zeros_short);
+	while (n >= 8) {
+		memcpy(&v, p, 8);
+		c = _mm_crc32_u64(c, v);
+		p += 8;
+		n -= 8;
+	}
+	while (n--)
+		c = _mm_crc32_u8(c, *p++);
+	return ~(uint32_t)c;
+}
+#endif
+
+static void crc32c_init(void)
+{
+	for (int b = 0; b < 256; b++) {
+		uint32_t c = b;
+
+		for (int k = 0; k < 8; k++)
+			c = (c >> 1) ^ (c & 1 ? CRC32C_POLY : 0);
+		table[0][b] = c;
+	}
+	for (int b = 0; b < 256; b++) {
+		for (int k = 1; k < 8; k++)
+			table[k][b] = table[0][table[k - 1][b] & 0xFF] ^
+				(table[k - 1][b] >> 8);
+	}
+
+	crc32c_impl = slice8;
+#if defined(__x86_64__)
+	/* not __builtin_cpu_supports(), whose libgcc constructor runs CPUID at
+	 * the start of every program, and CPUID traps in virtual machines */
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2)) {
+		zeros_init(zeros_long, CRC32C_LONG);
+		zeros_init(zeros_short, CRC32C_SHORT);
+		crc32c_impl = crc32c_hw;
+	}
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+	return crc32c_impl(crc, buf, len);
+}
+
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+	return slice8(crc, buf, len);
+}
+
+int crc32c_hw_available(void)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+	return crc32c_impl != slice8;
+}
@@ -0,0 +1,22 @@
+#ifndef _CRC32C_H
+#define _CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC32C (Castagnoli), as used by iSCSI, ext4 and btrfs. crc32c(0, "123456789",
+ * 9) is 0xE3069283. A checksum is extended over several buffers by passing the
+ * previous result as @crc.
+ */
+
+/* Hardware CRC32 instruction when the CPU has one, slicing-by-8 otherwise */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* Slicing-by-8 table implementation only, for comparison */
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+
+/* Whether crc32c() uses the hardware CRC32 instruction */
+int crc32c_hw_available(void);
+
+#endif /* _CRC32C_H */
@@ -1,10 +1,19 @@
+#define _GNU_SOURCE /* for O_DIRECT */
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
 #include "disk.h"
 
 #define block_error(fmt, ...) \
@@ -13,18 +22,36 @@
 /* Invalid file descriptor */
 #define INVALID_FD -1
 
+/* Largest copy through the aligned buffer of a direct disk */
+#define DIRECT_BOUNCE_MAX (1 << 20)
+
 /* Disk instance description */
 struct disk {
 	/* File descriptor */
 	int fd;
 	/* Block count */
 	size_t bcount;
+	/* Block size, always a power of two */
+	size_t bsize;
+	/* Opened with O_DIRECT */
+	int direct;
+	/* Aligned copy of unaligned buffers, for direct disks */
+	void *bounce;
+	size_t bounce_len;
 };
 
 /* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+static struct disk disk = { .fd = INVALID_FD, .bsize = BLOCK_SIZE };
+
+/* Serializes the users of the aligned buffer, reads can be concurrent */
+static pthread_mutex_t bounce_lock = PTHREAD_MUTEX_INITIALIZER;
 
 int block_disk_open(const char *diskname)
+{
+	return block_disk_open_flags(diskname, 0);
+}
+
+int block_disk_open_flags(const char *diskname, int flags)
 {
 	int fd;
 	struct stat st;
@@ -34,30 +61,71 @@ int block_disk_open(const char *diskname)
 		return -1;
 	}
 
+	if (flags & ~BLOCK_DISK_DIRECT) {
+		block_error("invalid flags '%#x'", flags);
+		return -1;
+	}
+
 	if (disk.fd != INVALID_FD) {
 		block_error("disk already open");
 		return -1;
 	}
 
-	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
+	if ((fd = open(diskname, O_RDWR |
+		       (flags & BLOCK_DISK_DIRECT ? O_DIRECT : 0), 0644)) < 0) {
 		perror("open");
 		return -1;
 	}
 
 	if (fstat(fd, &st)) {
 		perror("fstat");
+		close(fd);
 		return -1;
 	}
 
 	/* The disk image's size should be a multiple of the block size */
-	if (st.st_size % BLOCK_SIZE != 0) {
-		block_error("size '%zu' is not multiple of '%d'",
-			    st.st_size, BLOCK_SIZE);
+	if (st.st_size % disk.bsize != 0) {
+		block_error("size '%zu' is not multiple of '%zu'",
+			    st.st_size, disk.bsize);
+		close(fd);
 		return -1;
 	}
 
 	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	disk.bcount = st.st_size / disk.bsize;
+	disk.direct = (flags & BLOCK_DISK_DIRECT) != 0;
+
+	return 0;
+}
+
+int block_disk_create(const char *diskname, size_t bcount)
+{
+	int fd;
+
+	if (!diskname) {
+		block_error("invalid file diskname");
+		return -1;
+	}
+
+	if (!bcount) {
+		block_error("invalid block count");
+		return -1;
+	}
+
+	if ((fd = open(diskname, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	/* A sparse file reads back as zeroes, which is an empty FAT and root
+	 * directory */
+	if (ftruncate(fd, bcount * disk.bsize)) {
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
 
 	return 0;
 }
@@ -72,10 +140,48 @@ int block_disk_close(void)
 	close(disk.fd);
 
 	disk.fd = INVALID_FD;
+	disk.bsize = BLOCK_SIZE;
+	disk.direct = 0;
+	free(disk.bounce);
+	disk.bounce = NULL;
+	disk.bounce_len = 0;
 
 	return 0;
 }
 
+int block_disk_set_size(size_t size)
+{
+	struct stat st;
+
+	if (size < BLOCK_SIZE_MIN || size > BLOCK_SIZE_MAX ||
+	    (size & (size - 1))) {
+		block_error("invalid block size '%zu'", size);
+		return -1;
+	}
+
+	if (disk.fd != INVALID_FD) {
+		if (fstat(disk.fd, &st)) {
+			perror("fstat");
+			return -1;
+		}
+		if (st.st_size % size != 0) {
+			block_error("size '%zu' is not multiple of '%zu'",
+				    st.st_size, size);
+			return -1;
+		}
+		disk.bcount = st.st_size / size;
+	}
+
+	disk.bsize = size;
+
+	return 0;
+}
+
+size_t block_disk_block_size(void)
+{
+	return disk.bsize;
+}
+
 int block_disk_count(void)
 {
 	if (disk.fd == INVALID_FD) {
@@ -86,59 +192,207 @@ int block_disk_count(void)
 	return disk.bcount;
 }
 
-int block_write(size_t block, const void *buf)
+void *block_alloc(size_t size)
 {
-	if (disk.fd == INVALID_FD) {
-		block_error("no disk currently open");
-		return -1;
+	void *buf;
+
+	if (posix_memalign(&buf, BLOCK_DIRECT_ALIGN, size ? size : 1))
+		return NULL;
+	return buf;
+}
+
+/* Bytes checked between two early exits of block_is_zero() */
+#define ZERO_STRIDE 128
+
+static int zero_tail(const uint8_t *buf, size_t len)
+{
+	uint8_t acc = 0;
+
+	while (len--)
+		acc |= *buf++;
+	return acc == 0;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static int zero_avx2(const uint8_t *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + ZERO_STRIDE <= len; i += ZERO_STRIDE) {
+		const __m256i *p = (const __m256i *)(buf + i);
+		__m256i acc = _mm256_or_si256(
+			_mm256_or_si256(_mm256_loadu_si256(p),
+					_mm256_loadu_si256(p + 1)),
+			_mm256_or_si256(_mm256_loadu_si256(p + 2),
+					_mm256_loadu_si256(p + 3)));
+
+		if (!_mm256_testz_si256(acc, acc))
+			return 0;
 	}
+	return zero_tail(buf + i, len - i);
+}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
-		return -1;
+/* SSE2 is part of x86-64 */
+static int zero_sse2(const uint8_t *buf, size_t len)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i;
+
+	for (i = 0; i + ZERO_STRIDE <= len; i += ZERO_STRIDE) {
+		const __m128i *p = (const __m128i *)(buf + i);
+		__m128i acc = _mm_loadu_si128(p);
+
+		for (int k = 1; k < ZERO_STRIDE / 16; k++)
+			acc = _mm_or_si128(acc, _mm_loadu_si128(p + k));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF)
+			return 0;
 	}
+	return zero_tail(buf + i, len - i);
+}
+#else
+static int zero_words(const uint8_t *buf, size_t len)
+{
+	size_t i;
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
-		return -1;
+	for (i = 0; i + ZERO_STRIDE <= len; i += ZERO_STRIDE) {
+		uint64_t acc = 0, w;
+
+		for (int k = 0; k < ZERO_STRIDE; k += sizeof(w)) {
+			memcpy(&w, buf + i + k, sizeof(w));
+			acc |= w;
+		}
+		if (acc)
+			return 0;
 	}
+	return zero_tail(buf + i, len - i);
+}
+#endif
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
-		return -1;
+static int (*zero_impl)(const uint8_t *, size_t);
+static pthread_once_t zero_once = PTHREAD_ONCE_INIT;
+
+/* CPUID is only run once a zero check is needed, see crc32c_init() */
+static void zero_init(void)
+{
+#if defined(__x86_64__)
+	unsigned int eax, ebx, ecx, edx, xcr0 = 0;
+
+	zero_impl = zero_sse2;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) ||
+	    !(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+		return;
+	/* the OS must save the AVX registers */
+	__asm__("xgetbv" : "=a"(xcr0) : "c"(0) : "edx");
+	if ((xcr0 & 6) == 6 && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) &&
+	    (ebx & bit_AVX2))
+		zero_impl = zero_avx2;
+#else
+	zero_impl = zero_words;
+#endif
+}
+
+int block_is_zero(const void *buf, size_t len)
+{
+	pthread_once(&zero_once, zero_init);
+	return zero_impl(buf, len);
+}
+
+/* Transfer @len bytes at @offset with as few system calls as possible */
+static int disk_pio(int write, void *buf, size_t len, off_t offset)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		if (write)
+			ret = pwrite(disk.fd, (char *)buf + done, len - done,
+				     offset + done);
+		else
+			ret = pread(disk.fd, (char *)buf + done, len - done,
+				    offset + done);
+		if (ret < 0) {
+			perror(write ? "pwrite" : "pread");
+			return -1;
+		}
+		if (ret == 0) {
+			block_error("unexpected end of disk");
+			return -1;
+		}
+		done += ret;
 	}
 
 	return 0;
 }
 
-int block_read(size_t block, void *buf)
+/* Transfer @count blocks from block @block, copying through the aligned
+ * buffer when a direct disk is given an unaligned buffer */
+static int disk_xfer(int write, size_t block, size_t count, void *buf)
 {
+	size_t len, chunk, done = 0;
+
 	if (disk.fd == INVALID_FD) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	if (block >= disk.bcount || count > disk.bcount - block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, count, disk.bcount);
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
-		return -1;
-	}
+	len = count * disk.bsize;
+	if (!disk.direct || !((uintptr_t)buf & (BLOCK_DIRECT_ALIGN - 1)))
+		return disk_pio(write, buf, len, block * disk.bsize);
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
-		return -1;
+	chunk = len < DIRECT_BOUNCE_MAX ? len : DIRECT_BOUNCE_MAX;
+	pthread_mutex_lock(&bounce_lock);
+	if (disk.bounce_len < chunk) {
+		free(disk.bounce);
+		disk.bounce = block_alloc(chunk);
+		disk.bounce_len = disk.bounce ? chunk : 0;
+		if (!disk.bounce) {
+			pthread_mutex_unlock(&bounce_lock);
+			block_error("cannot allocate aligned buffer");
+			return -1;
+		}
+	}
+	while (done < len) {
+		if (chunk > len - done)
+			chunk = len - done;
+		if (write)
+			memcpy(disk.bounce, (char *)buf + done, chunk);
+		if (disk_pio(write, disk.bounce, chunk,
+			     block * disk.bsize + done)) {
+			pthread_mutex_unlock(&bounce_lock);
+			return -1;
+		}
+		if (!write)
+			memcpy((char *)buf + done, disk.bounce, chunk);
+		done += chunk;
 	}
+	pthread_mutex_unlock(&bounce_lock);
 
 	return 0;
 }
 
+int block_write(size_t block, const void *buf)
+{
+	return disk_xfer(1, block, 1, (void *)buf);
+}
+
+int block_read(size_t block, void *buf)
+{
+	return disk_xfer(0, block, 1, buf);
+}
+
+int block_write_multi(size_t block, size_t count, const void *buf)
+{
+	return disk_xfer(1, block, count, (void *)buf);
+}
+
+int block_read_multi(size_t block, size_t count, void *buf)
+{
+	return disk_xfer(0, block, count, buf);
+}
@@ -3,9 +3,19 @@
 
 #include <stddef.h> /* for size_t definition */
 
-/** Size of a disk block in bytes */
+/** Size of a disk block in bytes, unless changed with block_disk_set_size() */
 #define BLOCK_SIZE 4096
 
+/** Smallest and largest supported disk block sizes (powers of two) */
+#define BLOCK_SIZE_MIN 512
+#define BLOCK_SIZE_MAX 65536
+
+/** block_disk_open_flags() flags */
+#define BLOCK_DISK_DIRECT 0x1 /* bypass the host page cache (O_DIRECT) */
+
+/** Memory alignment of buffers that direct I/O can use without copy */
+#define BLOCK_DIRECT_ALIGN 4096
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
@@ -19,6 +29,36 @@
  */
 int block_disk_open(const char *diskname);
 
+/**
+ * block_disk_open_flags - Open virtual disk file with flags
+ * @diskname: Name of the virtual disk file
+ * @flags: %BLOCK_DISK_DIRECT, or 0
+ *
+ * Same as block_disk_open(). With %BLOCK_DISK_DIRECT, the virtual disk file is
+ * opened with O_DIRECT so that block transfers bypass the page cache of the
+ * host. Buffers aligned on %BLOCK_DIRECT_ALIGN bytes (see block_alloc()) are
+ * transferred directly; other buffers are copied through an aligned buffer.
+ *
+ * Return: -1 if @diskname or @flags is invalid, if the virtual disk file cannot
+ * be opened (e.g., if its file system does not support O_DIRECT) or is already
+ * open. 0 otherwise.
+ */
+int block_disk_open_flags(const char *diskname, int flags);
+
+/**
+ * block_disk_create - Create virtual disk file
+ * @diskname: Name of the virtual disk file
+ * @bcount: Number of blocks of the new disk
+ *
+ * Create virtual disk file @diskname, or truncate it if it already exists, so
+ * that it holds @bcount zero-filled blocks of the current block size. The new
+ * disk is not opened.
+ *
+ * Return: -1 if @diskname is invalid, if @bcount is 0 or if the virtual disk
+ * file cannot be created. 0 otherwise.
+ */
+int block_disk_create(const char *diskname, size_t bcount);
+
 /**
  * block_disk_close - Close virtual disk file
  *
@@ -26,6 +66,28 @@ int block_disk_open(const char *diskname);
  */
 int block_disk_close(void);
 
+/**
+ * block_disk_set_size - Set disk's block size
+ * @size: Block size in bytes
+ *
+ * Set the block size used by block_read() and block_write(), and by the next
+ * block_disk_open() if no virtual disk is currently open. If a virtual disk is
+ * open, its block count is recomputed. The block size reverts to %BLOCK_SIZE
+ * when the virtual disk is closed.
+ *
+ * Return: -1 if @size is not a power of two between %BLOCK_SIZE_MIN and
+ * %BLOCK_SIZE_MAX, or if the size of the open virtual disk file is not a
+ * multiple of @size. 0 otherwise.
+ */
+int block_disk_set_size(size_t size);
+
+/**
+ * block_disk_block_size - Get disk's block size
+ *
+ * Return: The current block size in bytes.
+ */
+size_t block_disk_block_size(void);
+
 /**
  * block_disk_count - Get disk's block count
  *
@@ -34,12 +96,36 @@ int block_disk_close(void);
  */
 int block_disk_count(void);
 
+/**
+ * block_alloc - Allocate a buffer for block transfers
+ * @size: Size of the buffer in bytes
+ *
+ * Allocate a buffer aligned on %BLOCK_DIRECT_ALIGN bytes, which a virtual disk
+ * opened with %BLOCK_DISK_DIRECT can transfer without copy. The buffer is
+ * released with free().
+ *
+ * Return: The buffer, or NULL if it cannot be allocated.
+ */
+void *block_alloc(size_t size);
+
+/**
+ * block_is_zero - Check whether a buffer only holds zero bytes
+ * @buf: Buffer
+ * @len: Size of the buffer in bytes
+ *
+ * The buffer is scanned with SSE2 or AVX2 vector instructions when the CPU has
+ * them, and the scan stops at the first non-zero bytes.
+ *
+ * Return: 1 if all the @len bytes of @buf are zero, 0 otherwise.
+ */
+int block_is_zero(const void *buf, size_t len);
+
 /**
  * block_write - Write a block to disk
  * @block: Index of the block to write to
  * @buf: Data buffer to write in the block
  *
- * Write the content of buffer @buf (%BLOCK_SIZE bytes) in the virtual disk's
+ * Write the content of buffer @buf (one block size) in the virtual disk's
  * block @block.
  *
  * Return: -1 if @block is out of bounds or inaccessible or if the writing
@@ -52,7 +138,7 @@ int block_write(size_t block, const void *buf);
  * @block: Index of the block to read from
  * @buf: Data buffer to be filled with content of block
  *
- * Read the content of virtual disk's block @block (%BLOCK_SIZE bytes) into
+ * Read the content of virtual disk's block @block (one block size) into
  * buffer @buf.
  *
  * Return: -1 if @block is out of bounds or inaccessible, or if the reading
@@ -60,5 +146,33 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_write_multi - Write consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Write the content of buffer @buf (@count blocks) in the virtual disk's blocks
+ * @block to @block + @count - 1, with as few system calls as possible.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible or if the
+ * writing operation fails. 0 otherwise.
+ */
+int block_write_multi(size_t block, size_t count, const void *buf);
+
+/**
+ * block_read_multi - Read consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of blocks
+ *
+ * Read the content of virtual disk's blocks @block to @block + @count - 1 into
+ * buffer @buf, with as few system calls as possible.
+ *
+ * Return: -1 if any of the blocks is out of bounds or inaccessible, or if the
+ * reading operation fails. 0 otherwise.
+ */
+int block_read_multi(size_t block, size_t count, void *buf);
+
 #endif /* _DISK_H */
 
@@ -1,11 +1,19 @@
 #include <assert.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 
+#include "crc32c.h"
 #include "disk.h"
 #include "fs.h"
+#include "hash64.h"
+#include "lz.h"
+#include "trace.h"
 
 int MOUNTED = -1;
 int FILE_COUNT = 0;
@@ -24,550 +32,3584 @@ struct __attribute__((packed)) Superblock {
 	uint16_t dataBlockCt;
 	uint8_t fatBlocks;
 
-	// 1 byte * 4079
-	uint8_t padding[4079];
+	/* format extensions, left zeroed by the original format (version 0) */
+	uint8_t version;
+	uint32_t features;
+	uint16_t rootBlocks;
+	/* FAT32 images leave the 16-bit geometry above zeroed and use these */
+	uint32_t totalBlocks32;
+	uint32_t rootBlockIndex32;
+	uint32_t dataBlockStart32;
+	uint32_t dataBlockCt32;
+	uint32_t fatBlocks32;
+	/* log2 of the block size, 0 for the original BLOCK_SIZE */
+	uint8_t blockShift;
+	/* checksum table, FEAT_CHECKSUM images only */
+	uint32_t csumBlockIndex;
+	uint32_t csumBlocks;
+	/* CRC32C of the superblock, computed with this field zeroed */
+	uint32_t sbCsum;
+	/* log2 of the blocks per cluster, FEAT_COMPRESS images only */
+	uint8_t clusterShift;
+	/* counts saved at the last clean unmount, see sumLoad(). Not a feature:
+	 * images stay readable by the original code, which ignores them */
+	uint32_t sumMagic;
+	uint32_t sumFreeBlocks;
+	uint32_t sumFileCount;
+	uint32_t sumFreeHint;
+	uint64_t sumRootHash;
+
+	// 1 byte * 4014
+	uint8_t padding[4014];
 };
 
+/* superblock.sumMagic of a valid summary, "SUM1" */
+#define SUM_MAGIC 0x314D5553
+
+/* superblock.features */
+#define FEAT_HASHED_ROOT 0x0001 /* root directory is a hash table */
+#define FEAT_FAT32       0x0002 /* 32-bit FAT entries and geometry */
+#define FEAT_CHECKSUM    0x0004 /* CRC32C of every block in a table */
+#define FEAT_COMPRESS    0x0008 /* new files are stored compressed */
+#define FEAT_DEDUP       0x0010 /* new files share identical data blocks */
+#define FEAT_KNOWN       (FEAT_HASHED_ROOT | FEAT_FAT32 | FEAT_CHECKSUM | \
+			  FEAT_COMPRESS | FEAT_DEDUP)
+
+/* in-memory FAT_EOC, whatever the width of the on-disk entries */
+#define FAT_EOC 0xFFFFFFFF
+
 struct __attribute__((packed)) FAT {
-	uint16_t *flatArray;
+	union {
+		uint16_t *flatArray;
+		uint32_t *flatArray32;
+	};
+	uint8_t wide;
+	/* free entries, counted at mount and kept up to date by (de)allocation */
+	uint32_t freeCt;
+	/* no entry below the hint is free, allocation scans start there */
+	uint32_t hint;
+	/* one flag per FAT block, only modified blocks are written back */
+	uint8_t *dirty;
+};
+
+/* geometry of the mounted disk, decoded from either superblock format */
+struct Geometry {
+	uint32_t totalBlocks;
+	uint32_t fatBlocks;
+	uint32_t rootBlockIndex;
+	uint32_t rootBlocks;
+	uint32_t dataBlockStart;
+	uint32_t dataBlockCt;
+	uint32_t csumBlockIndex;
+	uint32_t csumBlocks;
+	uint32_t blockSize;
+	uint32_t blockShift;
+	uint32_t blockMask;
+	/* compressed files, log2 of the blocks and of the bytes per cluster */
+	uint32_t clusterShift;
+	uint32_t clusterBytesShift;
 };
 
 struct __attribute__((packed)) RootDir {
 	uint8_t filename[FS_FILENAME_LEN];
 	uint32_t fileSize;
 	uint16_t firstBlockIn;
-	// 1 byte * 10
-	uint8_t padding[10];
+	uint8_t flags;
+	uint16_t firstBlockHi; /* FAT32 images only */
+	// 1 byte * 7
+	uint8_t padding[7];
+};
+
+/* RootDir.flags */
+#define RD_TOMBSTONE 0x01 /* deleted entry of older images, dropped at mount */
+#define RD_COMPRESSED 0x02 /* data stored in compressed clusters, see zOpen() */
+#define RD_DEDUP 0x04 /* data blocks listed in an index, see dedupBuild() */
+
+#define RD_PER_BLOCK(bs) ((bs) / sizeof(struct RootDir))
+
+/*
+ * Compressed files are cut into clusters of 2^clusterShift blocks of data,
+ * each stored as the fewest blocks that hold it: compressed when this saves at
+ * least one block, raw otherwise. The chain of such a file starts with its
+ * cluster map, one byte per cluster giving the number of blocks it occupies
+ * and whether they are compressed, followed by the clusters in order.
+ * Compressed clusters start with the 32-bit length of their LZ data.
+ */
+#define ZMAP_COMPRESSED 0x80
+#define ZMAP_BLOCKS(e) ((e) & 0x7F)
+
+/* at most 64 KiB or 64 blocks per cluster */
+#define ZCLUSTER_BYTES (1 << 16)
+#define ZCLUSTER_MAX_SHIFT 6
+
+#define ZNONE UINT32_MAX
+
+/* state of an open compressed file; the cluster last accessed is cached, and
+ * written back when another one is accessed or the file is closed */
+struct zFile {
+	uint8_t *map;
+	uint32_t *mapBlk;      /* blocks holding the map */
+	uint32_t mapBlocks;
+	uint32_t *clusterBlk;  /* first block of each stored cluster */
+	uint32_t clusters;     /* number of stored clusters */
+	uint32_t alloc;
+	uint8_t *buf;          /* data of cluster @cached */
+	uint32_t cached;
+	int dirty;
+};
+
+/*
+ * The chain of a deduplicated file holds its index: the data block number of
+ * each of its blocks. Data blocks are shared by all the files, and all the
+ * blocks of a file, with the same content. Each is a single-block chain, and
+ * its references are counted at mount. All-zero blocks are not stored, their
+ * index entry is DZERO.
+ */
+struct dFile {
+	uint32_t *index;
+	uint32_t *idxBlk;  /* blocks holding the index */
+	uint8_t *dirty;    /* per index block, written back at close */
+	uint32_t idxBlocks;
+};
+
+/* open state shared by all the file descriptors of one file */
+struct openFile {
+    uint32_t rIn;
+    uint32_t refs;
+    struct zFile *z; /* compressed files only */
+    struct dFile *d; /* deduplicated files only */
 };
 
-struct __attribute__((packed)) openFileContent {
+struct openFileContent {
     size_t offset;
-    uint8_t filename[FS_FILENAME_LEN];
+    struct openFile *file; /* NULL for a free file descriptor */
+    int flags;
+    int nextFree; /* next free file descriptor, -1 for the last one */
 };
 
-//create fd table
-struct openFileContent fdir[FS_OPEN_MAX_COUNT];
+//create fd table, grown on demand up to FS_OPEN_MAX_COUNT_EXT entries
+struct openFileContent *fdir;
+int fdirLen;
+int fdirFree = -1;
+int fdirOpen;
+// open state of each root directory entry, NULL if the file is not open
+struct openFile **rdOpen;
+// root directory entries of the FILE_COUNT files, sorted by filename
+uint32_t *rdSorted;
 // global Superblock, Root Directory, and FAT
 struct Superblock superblock;
+struct Geometry geom;
 struct FAT fat;
-struct RootDir rd[FS_FILE_MAX_COUNT];
+struct RootDir *rd;
+size_t rdCount;
+
+/* CRC32C of each block of the disk, indexed by block number. The entries of
+ * the superblock and of the table blocks themselves are unused */
+struct Checksums {
+	uint32_t *table;
+	/* one flag per table block, only modified blocks are written back */
+	uint8_t *dirty;
+};
+struct Checksums csum;
+
+/* compressed form of a cluster, shared by all the compressed files */
+uint8_t *zScratch;
+/* free blocks promised to the dirty clusters of compressed files, so that
+ * writing them back cannot run out of space */
+uint32_t zPending;
+
+/* data block 0 is never allocated: it ends the hash bucket lists below, and
+ * marks all-zero blocks in the indexes of deduplicated files */
+#define DZERO 0
+
+/* content index of the data blocks of deduplicated files */
+struct Dedup {
+	uint32_t *refs;    /* references to each data block */
+	uint64_t *hash;    /* hash64() of each referenced data block */
+	uint32_t *next;    /* next block of the same bucket */
+	uint32_t *buckets;
+	uint32_t mask;
+	uint8_t *scratch;  /* one block, to compare candidates */
+	size_t zeros;      /* DZERO index entries */
+	uint64_t refTotal; /* sum of refs */
+	uint32_t used;     /* data blocks with references */
+};
+struct Dedup dedup;
 
-int fs_mount(const char *diskname)
+/* chains of deleted files, not yet returned to the free pool */
+struct Reclaim {
+	uint32_t *heads;
+	size_t count;
+	size_t alloc;
+};
+struct Reclaim reclaim;
+
+/* one block bounce buffer per thread doing partial block I/O, so that reads
+ * and writes do not allocate. The buffers are freed at umount, those of exited
+ * threads are kept for the next ones */
+struct Bounce {
+	pthread_mutex_t lock;
+	uint8_t **bufs;   /* all the buffers of the mount */
+	uint8_t **idle;   /* the buffers of exited threads */
+	size_t count;
+	size_t idleCount;
+	size_t alloc;
+	uint32_t gen;     /* mount generation, stale thread buffers differ */
+};
+struct Bounce bounce = { .lock = PTHREAD_MUTEX_INITIALIZER, .gen = 1 };
+
+/* the buffer of the calling thread, and the generation it belongs to */
+struct bounceBuf {
+	uint8_t *buf;
+	uint32_t gen;
+};
+static __thread struct bounceBuf bounceBuf;
+static pthread_key_t bounceKey;
+static pthread_once_t bounceOnce = PTHREAD_ONCE_INIT;
+
+/* chains freed by the reclamation thread per hold of the lock */
+#define RECLAIM_BATCH 64
+
+/* serializes all the public entry points that modify the file system, and the
+ * reclamation thread; the others only wait for it, see fsLockShared() */
+static pthread_mutex_t fsLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* readers of each slot, one cache line per slot */
+#define READER_SLOTS 64
+struct readerSlot {
+	uint32_t count;
+} __attribute__((aligned(64)));
+static struct readerSlot readerSlots[READER_SLOTS];
+static uint32_t readerSlotsUsed;
+static __thread int readerSlot = -1;
+/* set by the holder of fsLock while it can modify the file system */
+static int writerActive;
+
+/* file offsets moved by shared calls, locked per file descriptor modulo */
+#define FD_LOCKS 64
+static struct {
+	pthread_mutex_t lock;
+} __attribute__((aligned(64))) fdLocks[FD_LOCKS] = {
+	[0 ... FD_LOCKS - 1] = { PTHREAD_MUTEX_INITIALIZER }
+};
+static pthread_cond_t reclaimCond = PTHREAD_COND_INITIALIZER;
+static pthread_t reclaimThread;
+static int reclaimRunning;
+
+/* root directory entry the next incremental fs_defrag() call starts at */
+size_t defragNext;
+
+/* blocks moved per batched read/write of fs_defrag() */
+#define DEFRAG_BATCH_BYTES (1 << 20)
+
+static void fatReclaim(size_t max);
+static void reclaimPush(uint32_t blk);
+static struct zFile *zOpen(int rIn);
+static int zFlush(int rIn, struct zFile *z);
+static void zFree(struct zFile *z);
+static struct dFile *dOpen(int rIn);
+static int dFlush(struct dFile *d);
+static void dFree(struct dFile *d);
+static int dRelease(int rIn);
+static int dedupBuild(void);
+static void dedupFree(void);
+static void bounceFree(void);
+
+static inline uint32_t fatGet(uint32_t i)
 {
-	/* TODO: Phase 1 */
-	// open disk, return -1 if open errors
-	if (block_disk_open(diskname))
-		return -1;
+	if (fat.wide)
+		return fat.flatArray32[i];
+	return fat.flatArray[i] == 0xFFFF ? FAT_EOC : fat.flatArray[i];
+}
 
+static inline void fatSet(uint32_t i, uint32_t next)
+{
+	if (fat.wide)
+		fat.flatArray32[i] = next;
+	else
+		fat.flatArray[i] = next; /* FAT_EOC truncates to 0xFFFF */
+	fat.dirty[((size_t)i << (fat.wide ? 2 : 1)) >> geom.blockShift] = 1;
+}
 
-	
+/*
+ * fatCountFree - count the free FAT entries
+ *
+ * Eight bytes of entries are tested at once: the top bit of each lane of z is
+ * set when the lane is zero, and the multiplication adds up these bits in the
+ * top lane. Entry 0 is never free, so it can be counted along.
+ */
+static uint32_t fatCountFree(void)
+{
+	int esz = fat.wide ? 4 : 2, bits = esz * 8;
+	uint64_t low = fat.wide ? 0x7FFFFFFF7FFFFFFFull : 0x7FFF7FFF7FFF7FFFull;
+	uint64_t ones = fat.wide ? 0x0000000100000001ull : 0x0001000100010001ull;
+	size_t len = (size_t)geom.dataBlockCt * esz, i;
+	const uint8_t *p = (const uint8_t*)fat.flatArray;
+	uint32_t n = 0;
+
+	for (i = 0; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+		uint64_t w, z;
+
+		memcpy(&w, p + i, sizeof(w));
+		z = ~(((w & low) + low) | w | low);
+		n += ((z >> (bits - 1)) * ones) >> (64 - bits);
+	}
+	for (i /= esz; i < geom.dataBlockCt; i++)
+		n += fatGet(i) == 0;
+	return n;
+}
 
-	/* read 0th block from the @disk to the superblock,
-	return -1 if errors */
-	if (block_read(0, &superblock))
-		return -1;
+/* block index and in-block offset of a file offset. All block sizes are
+ * powers of two, so this is a shift and a mask rather than a division */
+static inline size_t blkIndex(size_t offset)
+{
+	return offset >> geom.blockShift;
+}
 
-	/* now that the first block is in the superblock,
-	check if the signature is correct */
-	if (strcmp("ECS150FS", superblock.sig) == -1) {
-		//fprintf(stderr, "Signature not accepted");
-		return -1;
-	}
+static inline size_t blkOffset(size_t offset)
+{
+	return offset & geom.blockMask;
+}
 
-	if (block_disk_count() != superblock.totalBlocks) {
-		return -1;
-	} 
+static inline uint32_t rdFirst(int i)
+{
+	if (fat.wide)
+		return rd[i].firstBlockIn | (uint32_t)rd[i].firstBlockHi << 16;
+	return rd[i].firstBlockIn == 0xFFFF ? FAT_EOC : rd[i].firstBlockIn;
+}
 
-	fat.flatArray = malloc(BLOCK_SIZE * superblock.fatBlocks * 2);
-	
-	/* start at 1 since signature is 0th index */
-	for(int i = 1; i <= superblock.fatBlocks; i++) {
-		if(block_read(i, &fat.flatArray[i-1]))
-			return -1;
-		
+static inline void rdSetFirst(int i, uint32_t first)
+{
+	rd[i].firstBlockIn = first;
+	rd[i].firstBlockHi = fat.wide ? first >> 16 : 0;
+}
+
+/* FNV-1a, only used to place entries in a hashed root directory */
+static uint32_t rdHash(const char *filename)
+{
+	uint32_t h = 2166136261u;
+
+	while (*filename) {
+		h ^= (uint8_t)*filename++;
+		h *= 16777619u;
 	}
-		uint16_t FAT_EOC = 0xFFFF;
-		if (fat.flatArray[0] != FAT_EOC) {
+	return h;
+}
+
+static int rdHashed(void)
+{
+	return superblock.features & FEAT_HASHED_ROOT;
+}
+
+/* find the root directory entry of @filename, -1 if there is none */
+static int rdFind(const char *filename)
+{
+	if (!rdHashed()) {
+		for (size_t i = 0; i < rdCount; i++) {
+			if (rd[i].filename[0] != '\0' &&
+			    !strcmp((char*)rd[i].filename, filename))
+				return i;
+		}
 		return -1;
 	}
 
-	if (block_read(superblock.rootBlockIndex, &rd)) {
-		return -1;
+	/* linear probing, stops at the first never-used entry */
+	size_t i = rdHash(filename) % rdCount;
+	for (size_t n = 0; n < rdCount; n++, i = (i + 1) % rdCount) {
+		if (rd[i].filename[0] == '\0') {
+			if (!(rd[i].flags & RD_TOMBSTONE))
+				return -1;
+		} else if (!strcmp((char*)rd[i].filename, filename)) {
+			return i;
+		}
 	}
-    MOUNTED = 0;
-	 return 0;
+	return -1;
 }
 
-int fs_umount(void)
+/* find an empty root directory entry for new file @filename */
+static int rdFreeSlot(const char *filename)
 {
-	/* write from superblock to disk. 
-	here, we simulate saving the changes to our disk
-	 */
-
-	if (block_write(0, &superblock))
-		
+	size_t i = rdHashed() ? rdHash(filename) % rdCount : 0;
 
-	for(int i = 1; 1<= superblock.fatBlocks; i++) {
-		if(block_write(i, &fat.flatArray[i-1]))
-			return -1;
+	for (size_t n = 0; n < rdCount; n++, i = (i + 1) % rdCount) {
+		if (rd[i].filename[0] == '\0')
+			return i;
 	}
-	
-	if (block_write(superblock.rootBlockIndex, &rd))
-		return -1;
+	return -1;
+}
 
+/* re-insert all live entries of a hashed root directory, which drops the
+ * tombstones that deletions left on older images */
+static int rdRehash(void)
+{
+	struct RootDir *old = rd;
 
-	if (block_disk_close())
+	rd = block_alloc(rdCount * sizeof(struct RootDir));
+	if (!rd) {
+		rd = old;
 		return -1;
-
-    MOUNTED = -1;
+	}
+	memset(rd, 0, rdCount * sizeof(struct RootDir));
+	for (size_t i = 0; i < rdCount; i++) {
+		if (old[i].filename[0] == '\0')
+			continue;
+		rd[rdFreeSlot((char*)old[i].filename)] = old[i];
+	}
+	free(old);
 	return 0;
 }
 
-
-int fs_info(void)
+/*
+ * rdSortedFind - binary search of the sorted filename index
+ * @key: Filename, or filename prefix
+ * @len: Characters of the filenames compared with @key
+ * @after: Skip the filenames equal to @key as well
+ *
+ * Return: the first position of rdSorted whose filename, cut to @len
+ * characters, is not below @key (is above @key if @after). FILE_COUNT if there
+ * is none.
+ */
+static size_t rdSortedFind(const char *key, size_t len, int after)
 {
-	/* TODO: Phase 1 */
+	size_t lo = 0, hi = FILE_COUNT;
 
-	int i = 0, fatFree = 0, rdFree =0;
-	
-	
-	/* Calculating fat free blocks */
-	for(i; i<superblock.dataBlockCt; i++) {
-		if(fat.flatArray[i] == 0)
-			fatFree++;
-	}
-	/* Calculating rdir free files. */
-	for(i=0; i<FS_FILE_MAX_COUNT; i++) {
-		/* "An empty entry is defined by the first character of
-		the entry’s filename being equal to the NULL character." */
-		if(rd[i].filename[0] == NULL)
-			rdFree++;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int c = strncmp((char*)rd[rdSorted[mid]].filename, key, len);
+
+		if (c < 0 || (after && c == 0))
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+	return lo;
+}
 
-	/* On format specifiers for (un)signed integers:
-	https://utat-ss.readthedocs.io/en/master/c-programming/print-formatting.html */
-	printf("FS Info:\n");
-	printf("total_blk_count=%u\n",superblock.totalBlocks);
-	printf("fat_blk_count=%u\n",superblock.fatBlocks);
-	printf("rdir_blk=%u\n",superblock.rootBlockIndex);
-	printf("data_blk=%u\n",superblock.dataBlockStart);
-	printf("data_blk_count=%u\n",superblock.dataBlockCt);
-	printf("fat_free_ratio=%d/%u\n", fatFree, superblock.dataBlockCt);
-	printf("rdir_free_ratio=%d/%d\n", rdFree, FS_FILE_MAX_COUNT);
-	return 0;
+/* index new file @rIn, before FILE_COUNT counts it */
+static void rdSortedAdd(uint32_t rIn)
+{
+	size_t k = rdSortedFind((char*)rd[rIn].filename, FS_FILENAME_LEN, 0);
 
+	memmove(rdSorted + k + 1, rdSorted + k,
+		(FILE_COUNT - k) * sizeof(*rdSorted));
+	rdSorted[k] = rIn;
 }
 
-int fs_create(const char *filename)
+/* unindex file @rIn, before its name is erased and FILE_COUNT drops it */
+static void rdSortedRemove(uint32_t rIn)
 {
-	/* TODO: Phase 2 */
-    uint16_t FAT_EOC = 0xFFFF;
+	size_t k = rdSortedFind((char*)rd[rIn].filename, FS_FILENAME_LEN, 0);
+
+	/* images written elsewhere could hold the same name twice */
+	while (k < (size_t)FILE_COUNT && rdSorted[k] != rIn &&
+	       !strcmp((char*)rd[rdSorted[k]].filename, (char*)rd[rIn].filename))
+		k++;
+	if (k < (size_t)FILE_COUNT && rdSorted[k] == rIn)
+		memmove(rdSorted + k, rdSorted + k + 1,
+			(FILE_COUNT - k - 1) * sizeof(*rdSorted));
+}
 
-   	if(strlen(filename) >= FS_FILENAME_LEN || filename == NULL || MOUNTED == -1 || FILE_COUNT >= FS_FILE_MAX_COUNT) {
-        return -1;
-    }
+/* move file entry @from to the empty entry @to, with its open state and its
+ * place in the sorted index */
+static void rdMove(uint32_t from, uint32_t to)
+{
+	size_t k = rdSortedFind((char*)rd[from].filename, FS_FILENAME_LEN, 0);
+
+	while (k < (size_t)FILE_COUNT && rdSorted[k] != from)
+		k++;
+	assert(k < (size_t)FILE_COUNT);
+	rdSorted[k] = to;
+	rd[to] = rd[from];
+	rdOpen[to] = rdOpen[from];
+	if (rdOpen[to])
+		rdOpen[to]->rIn = to;
+	rdOpen[from] = NULL;
+}
 
-    // check if the file exits and count number of existed files
-    for(int i=0; i < FS_FILE_MAX_COUNT; i++) {
-        // check if the file already exists. if exist return -1
-        if(strcmp(filename, (char*)rd[i].filename) == 0) {
-            return -1;
-        }
-    }
+/*
+ * rdShiftBack - close the hole left by a deletion in a hashed root directory
+ * @hole: Entry of the deleted file, already unindexed
+ *
+ * Backward shift deletion for linear probing: the following entries of the
+ * probe run move back into the hole when their home entry does not lie after
+ * it, so lookups still reach them and no tombstone is needed. Without it,
+ * tombstones would pile up until the next mount and lengthen every probe.
+ *
+ * Return: the entry left empty, to be cleared by the caller
+ */
+static uint32_t rdShiftBack(uint32_t hole)
+{
+	for (uint32_t j = (hole + 1) % rdCount; j != hole;
+	     j = (j + 1) % rdCount) {
+		if (rd[j].filename[0] == '\0')
+			break;
+
+		uint32_t home = rdHash((char*)rd[j].filename) % rdCount;
 
-    for(int i=0; i < FS_FILE_MAX_COUNT; i++) {
-        // check for empty entry in root directory.
-		// https://www.tutorialandexample.com/null-character-in-c null characters
-        if(rd[i].filename[0] == '\0') {
-            rd[i].firstBlockIn = FAT_EOC;
-            memcpy(rd[i].filename, filename, FS_FILENAME_LEN);
-            rd[i].fileSize = 0;
-            FILE_COUNT++;
-            return 0;
-        }
-   	}
-    return -1;
+		/* entries whose home is in (hole, j] cannot move before it */
+		if (hole < j ? home > hole && home <= j :
+		    home > hole || home <= j)
+			continue;
+		rdMove(j, hole);
+		hole = j;
+	}
+	return hole;
 }
 
-int fs_delete(const char *filename)
+static int rdSortedCmp(const void *a, const void *b)
 {
-	/* TODO: Phase 2 */
+	return strcmp((char*)rd[*(const uint32_t*)a].filename,
+		      (char*)rd[*(const uint32_t*)b].filename);
+}
 
-    uint16_t FAT_EOC = 0xFFFF;
-    uint16_t starting_data_index = 0xFFFF;
+/* build the index at mount, once the root directory entries are in place */
+static void rdSortedBuild(void)
+{
+	size_t n = 0;
 
-    if(filename == NULL || MOUNTED == -1) {
-        return -1;
-    }
+	for (size_t i = 0; i < rdCount; i++) {
+		if (rd[i].filename[0] != '\0')
+			rdSorted[n++] = i;
+	}
+	qsort(rdSorted, n, sizeof(*rdSorted), rdSortedCmp);
+}
 
-    for(int i=0; i < FS_FILE_MAX_COUNT; i++) {
-        if(strcmp((char*)rd[i].filename, filename) == 0) {
-            // file’s entry must be emptied
-            starting_data_index = rd[i].firstBlockIn;
-            rd[i].filename[0] = '\0';
-            rd[i].fileSize = 0;
-            rd[i].firstBlockIn = FAT_EOC;
-            FILE_COUNT--;
-            // all the data blocks containing the file’s contents must be freed in the FAT??????
-            for(int i = starting_data_index; i < sizeof(*fat.flatArray)/sizeof(fat.flatArray[0]) - 1; i = starting_data_index) {
-                uint16_t next = fat.flatArray[i];
-                if(fat.flatArray[i] != 0xFFFF) {
-                    fat.flatArray[i] = 0;
-                }
-
-                if (fat.flatArray[i] == 0xFFFF) { break;}
-                starting_data_index = next;
-            }
-            return 0;
-        }
-    }
+/* log2 of a power-of-two block size */
+static uint8_t log2Size(size_t bs)
+{
+	uint8_t shift = 0;
 
+	while (((size_t)1 << shift) < bs)
+		shift++;
+	return shift;
+}
 
-    return -1;
+/* number of @bs blocks needed by a FAT of @entries entries of @width bytes */
+static size_t fatBlocksFor(size_t entries, size_t width, size_t bs)
+{
+	return (entries * width + bs - 1) / bs;
 }
 
-int fs_ls(void)
+/* number of @bs blocks of a checksum table covering @blocks blocks plus the
+ * table blocks themselves */
+static size_t csumBlocksFor(size_t blocks, size_t bs)
 {
-    /* TODO: Phase 2 */
-    if(MOUNTED == -1) {
-        return -1;
-    }
+	size_t width = sizeof(uint32_t);
 
-	printf("FS Ls:\n");
-	for(int i=0; i < FS_FILE_MAX_COUNT; i++) {
-        	if(rd[i].filename[0] != '\0') {
-            		printf("file: %s, size: %d, data_blk: %d\n", rd[i].filename, rd[i].fileSize, rd[i].firstBlockIn);
-        	}
-    }
-	return 0;
+	return (blocks * width + bs - width - 1) / (bs - width);
 }
 
-	
-	
-int fs_open(const char *filename)
+static uint32_t sbChecksum(const struct Superblock *sb)
 {
-	// check if file exists in root directory; we can use a similar loop from our create file
-	int fExists = -1;
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		
-        	if(!strcmp((char*)rd[i].filename, filename)) {
-            		fExists = 0;
-					//printf("EXISTS %d\n", fExists);
-					break;
-        	}
-    	}
-	// VALIDATION
-	if (MOUNTED == -1 || strlen(filename) >= FS_FILENAME_LEN || filename == NULL || fExists)
-		return -1;
+	struct Superblock copy = *sb;
 
-	for(int i = 0; i < FS_FILE_MAX_COUNT; i++) {
-		if (fdir[i].filename[0] == '\0') {
-			fdir[i].offset = 0;
-			// "man memcpy" command to understand how it works
-			memcpy(fdir[i].filename, filename, FS_FILENAME_LEN);
-		
-			return i;
-		}
-			
+	copy.sbCsum = 0;
+	return crc32c(0, &copy, sizeof(copy));
+}
+
+/* the superblock sits at the start of block 0, which can be smaller or larger
+ * than struct Superblock; the part that does not fit a small block is zero */
+static int sbRead(struct Superblock *sb)
+{
+	size_t bs = block_disk_block_size();
+	uint8_t *block = block_alloc(bs);
+	int ret = -1;
+
+	if (block && !block_read(0, block)) {
+		memset(sb, 0, sizeof(*sb));
+		memcpy(sb, block, bs < sizeof(*sb) ? bs : sizeof(*sb));
+		ret = 0;
 	}
+	free(block);
+	return ret;
+}
 
-	return -1;
+static int sbWrite(const struct Superblock *sb)
+{
+	size_t bs = block_disk_block_size();
+	uint8_t *block = block_alloc(bs);
+	int ret = -1;
+
+	if (block) {
+		struct Superblock copy = *sb;
+
+		if (copy.features & FEAT_CHECKSUM)
+			copy.sbCsum = sbChecksum(&copy);
+		memset(block, 0, bs);
+		memcpy(block, &copy, bs < sizeof(copy) ? bs : sizeof(copy));
+		ret = block_write(0, block);
+	}
+	free(block);
+	return ret;
 }
 
-int fs_close(int fd)
+/* not crc32c(), whose first call costs more than a mount on some machines */
+static uint64_t rdHashAll(void)
 {
-	if (fdir[fd].filename[0] == '\0' || MOUNTED == -1 || fd >= FS_OPEN_MAX_COUNT || fd < 0)
-		return -1;
-	fdir[fd].filename[0] = '\0';
-	fdir[fd].offset = 0;
+	return hash64(rd, (size_t)geom.rootBlocks * geom.blockSize);
+}
 
-	
-	/* TODO: Phase 3 */
+/*
+ * sumLoad - take the free block count from the superblock summary at mount
+ *
+ * The summary is saved at unmount, see sumClear(). Writers that do not know
+ * it, such as the original code, leave it stale. Their changes that take
+ * blocks from the free pool or return them also change the root directory,
+ * except for freeing blocks reserved past the end of a file: a file deleted
+ * and added again with the same content can get back the same entry. So the
+ * summary is not saved while files hold such blocks, see sumSave(), and is
+ * only trusted while the directory has the hash it was saved with.
+ *
+ * Return: 0 if the counts were loaded, -1 if the FAT must be scanned
+ */
+static int sumLoad(void)
+{
+	if (superblock.sumMagic != SUM_MAGIC ||
+	    superblock.sumFreeBlocks >= geom.dataBlockCt ||
+	    superblock.sumFileCount != (uint32_t)FILE_COUNT ||
+	    superblock.sumFreeHint == 0 ||
+	    superblock.sumFreeHint > geom.dataBlockCt ||
+	    superblock.sumRootHash != rdHashAll())
+		return -1;
+	fat.freeCt = superblock.sumFreeBlocks;
+	fat.hint = superblock.sumFreeHint;
 	return 0;
 }
 
-int fs_stat(int fd)
+/*
+ * sumClear - invalidate the summary on disk before the metadata is written
+ * @rootHash: rdHashAll() of the root directory to write
+ *
+ * The FAT and the root directory are only written by the unmount, so a crash
+ * at any other time leaves them as the summary describes. An unmount that
+ * does not complete could leave them partly written.
+ *
+ * Return: -1 if the superblock cannot be written, 0 otherwise
+ */
+static int sumClear(uint64_t rootHash)
 {
-	/* TODO: Phase 3 */
-    // Return -1 if no FS is currently mounted, or fd is out of bound, or it is not currently open
-    if(MOUNTED == -1 || fd >= FS_OPEN_MAX_COUNT || fd < 0 || fdir[fd].filename[0] == '\0') {
-        return -1;
-    }
-
-    //first find the open file in the root directory, then, return the size of the open file
-    for(int i=0; i < FS_FILE_MAX_COUNT; i++) {
-        if(strcmp((char*)fdir[fd].filename, (char*)rd[i].filename) == 0) {
-            return rd[i].fileSize;
-        }
-    }
-
-    //if file not found, return -1
-	return -1;
+	int dirty = superblock.sumRootHash != rootHash;
+
+	for (uint32_t i = 0; i < geom.fatBlocks && !dirty; i++)
+		dirty = fat.dirty[i];
+	if (superblock.sumMagic != SUM_MAGIC || !dirty)
+		return 0;
+	superblock.sumMagic = 0;
+	return sbWrite(&superblock);
 }
 
-int fs_lseek(int fd, size_t offset)
+/*
+ * sumReserved - tell if files hold data blocks past their end
+ *
+ * On images with plain files only, all the used blocks but entry 0 belong to
+ * the files, which need blkCount() of their size each: any other used block
+ * was reserved by fs_fallocate() (or leaked). Compressed and deduplicated
+ * files cannot reserve blocks.
+ */
+static int sumReserved(void)
 {
-	// to do: check if fd is valid
-    if(MOUNTED == -1 || fd >= FS_OPEN_MAX_COUNT || fd < 0 || fdir[fd].filename[0] == '\0') {
-        return -1;
-    }
-
+	uint64_t need = 1;
+
+	if (superblock.features & (FEAT_COMPRESS | FEAT_DEDUP))
+		return 0;
+	for (size_t i = 0, left = FILE_COUNT; i < rdCount && left; i++) {
+		if (rd[i].filename[0] == '\0')
+			continue;
+		need += ((uint64_t)rd[i].fileSize + geom.blockSize - 1) >>
+			geom.blockShift;
+		left--;
+	}
+	return geom.dataBlockCt - fat.freeCt != need;
+}
 
+/* the summary is left invalid while blocks are reserved, see sumLoad() */
+static void sumSave(uint64_t rootHash)
+{
+	if (sumReserved()) {
+		superblock.sumMagic = 0;
+		return;
+	}
+	superblock.sumMagic = SUM_MAGIC;
+	superblock.sumFreeBlocks = fat.freeCt;
+	superblock.sumFileCount = FILE_COUNT;
+	superblock.sumFreeHint = fat.hint;
+	superblock.sumRootHash = rootHash;
+}
 
-    // set the offset
-	fdir[fd].offset = offset;
+/*
+ * All the blocks but the superblock and the checksum table go through these
+ * wrappers of block_read_multi()/block_write_multi(): on images with
+ * checksums, reads fail when a block does not match its CRC32C and writes
+ * update the table, which is written back at unmount.
+ */
+static int devReadMulti(uint32_t blk, uint32_t n, void *buf)
+{
+	if (block_read_multi(blk, n, buf))
+		return -1;
+	for (uint32_t i = 0; csum.table && i < n; i++) {
+		if (crc32c(0, (uint8_t*)buf + ((size_t)i << geom.blockShift),
+			   geom.blockSize) != csum.table[blk + i])
+			return -1;
+	}
 	return 0;
 }
 
-// helper function to find first index of data block corresponding to file's offset
-int dbFind(int fd, size_t offset) {
-	int dbIndex;
-	 for(int i=0; i < FS_FILE_MAX_COUNT; i++) {
-        if(strcmp((char*)fdir[fd].filename, (char*)rd[i].filename) == 0){
-            return rd[i].firstBlockIn + (offset/BLOCK_SIZE);
-		}
-	 }
-	
-}
-int dbFind2(int fd, size_t offset) {
-	int dbIndex;
-	 for(int i=0; i < FS_FILE_MAX_COUNT; i++) {
-        if(strcmp((char*)fdir[fd].filename, (char*)rd[i].filename) == 0){
-            return i;
-		}
-	 }
-	
+static int devWriteMulti(uint32_t blk, uint32_t n, const void *buf)
+{
+	if (block_write_multi(blk, n, buf))
+		return -1;
+	for (uint32_t i = 0; csum.table && i < n; i++) {
+		csum.table[blk + i] = crc32c(0, (const uint8_t*)buf +
+					     ((size_t)i << geom.blockShift),
+					     geom.blockSize);
+		csum.dirty[((size_t)(blk + i) * sizeof(uint32_t)) >>
+			   geom.blockShift] = 1;
+	}
+	return 0;
 }
-int rootIn(fd) {
- for(int i=0; i < FS_FILE_MAX_COUNT; i++) {
-        if(strcmp((char*)fdir[fd].filename, (char*)rd[i].filename) == 0){
-            return i;
-		}
 
+static inline int devRead(uint32_t blk, void *buf)
+{
+	return devReadMulti(blk, 1, buf);
 }
+
+static inline int devWrite(uint32_t blk, const void *buf)
+{
+	return devWriteMulti(blk, 1, buf);
 }
 
-int emptyFat() {
-	uint16_t FAT_EOC = 0xFFFF;
-	int i = 1;
-	for(i; i<superblock.dataBlockCt; i++) {
-		if(fat.flatArray[i] == 0)
-		//fat.flatArray[i] == 0xFFFF;
-			return i;
+int fs_format(const char *diskname, const struct fs_format_opts *opts)
+{
+	struct Superblock sb;
+	uint8_t *fatBuf, *csumBuf = NULL;
+	size_t bs, count, fatBlocks, rootBlocks, csumBlocks = 0, total;
+	int wide;
+
+	if (MOUNTED != -1 || opts == NULL || opts->data_blk_count == 0 ||
+	    opts->file_count > FS_FILE_MAX_COUNT_EXT ||
+	    (opts->compress && opts->dedup))
+		return -1;
+
+	bs = opts->block_size ? opts->block_size : BLOCK_SIZE;
+	if (bs < BLOCK_SIZE_MIN || bs > BLOCK_SIZE_MAX || (bs & (bs - 1)))
+		return -1;
+
+	count = opts->data_blk_count;
+	rootBlocks = (opts->file_count + RD_PER_BLOCK(bs) - 1) / RD_PER_BLOCK(bs);
+	if (rootBlocks == 0)
+		rootBlocks = 1;
+
+	/* one FAT entry per data block, all-ones is reserved for EOC. Switch to
+	 * 32-bit entries when the disk does not fit the 16-bit geometry */
+	fatBlocks = fatBlocksFor(count, sizeof(uint16_t), bs);
+	total = 1 + fatBlocks + rootBlocks + count;
+	if (opts->checksum)
+		csumBlocks = csumBlocksFor(total, bs);
+	total += csumBlocks;
+	wide = opts->fat32 || count >= 0xFFFF || fatBlocks > UINT8_MAX ||
+		total > UINT16_MAX;
+	if (wide) {
+		fatBlocks = fatBlocksFor(count, sizeof(uint32_t), bs);
+		total = 1 + fatBlocks + rootBlocks + count;
+		if (opts->checksum)
+			csumBlocks = csumBlocksFor(total, bs);
+		total += csumBlocks;
 	}
-	return -1;
-}
+	/* block_disk_count() reports the disk size as an int */
+	if (total > INT_MAX)
+		return -1;
 
+	memset(&sb, 0, sizeof(sb));
+	memcpy(sb.sig, "ECS150FS", sizeof(sb.sig));
+	if (wide) {
+		sb.totalBlocks32 = total;
+		sb.fatBlocks32 = fatBlocks;
+		sb.rootBlockIndex32 = 1 + fatBlocks;
+		sb.dataBlockStart32 = 1 + fatBlocks + rootBlocks + csumBlocks;
+		sb.dataBlockCt32 = count;
+		sb.features |= FEAT_FAT32;
+	} else {
+		sb.totalBlocks = total;
+		sb.fatBlocks = fatBlocks;
+		sb.rootBlockIndex = 1 + fatBlocks;
+		sb.dataBlockStart = 1 + fatBlocks + rootBlocks + csumBlocks;
+		sb.dataBlockCt = count;
+	}
+	if (rootBlocks > 1)
+		sb.features |= FEAT_HASHED_ROOT;
+	if (csumBlocks) {
+		sb.features |= FEAT_CHECKSUM;
+		sb.csumBlockIndex = 1 + fatBlocks + rootBlocks;
+		sb.csumBlocks = csumBlocks;
+	}
+	if (opts->compress) {
+		sb.features |= FEAT_COMPRESS;
+		sb.clusterShift = log2Size(ZCLUSTER_BYTES / bs);
+		if (sb.clusterShift > ZCLUSTER_MAX_SHIFT)
+			sb.clusterShift = ZCLUSTER_MAX_SHIFT;
+	}
+	if (opts->dedup)
+		sb.features |= FEAT_DEDUP;
+	if (bs != BLOCK_SIZE)
+		sb.blockShift = log2Size(bs);
+	if (sb.features || sb.blockShift) {
+		sb.version = 1;
+		sb.rootBlocks = rootBlocks;
+	}
 
+	/* data block 0 is reserved, the root directory starts zeroed */
+	fatBuf = calloc(rootBlocks > fatBlocks ? rootBlocks : fatBlocks, bs);
+	if (!fatBuf)
+		return -1;
+	sb.sumMagic = SUM_MAGIC;
+	sb.sumFreeBlocks = count - 1;
+	sb.sumFreeHint = 1;
+	sb.sumRootHash = hash64(fatBuf, rootBlocks * bs);
+
+	if (wide)
+		((uint32_t*)fatBuf)[0] = FAT_EOC;
+	else
+		((uint16_t*)fatBuf)[0] = 0xFFFF;
+
+	/* every block but the FAT starts zeroed, see block_disk_create() */
+	if (csumBlocks) {
+		uint32_t *table, zero;
+
+		csumBuf = calloc(csumBlocks + 1, bs);
+		if (!csumBuf) {
+			free(fatBuf);
+			return -1;
+		}
+		table = (uint32_t*)csumBuf;
+		zero = crc32c(0, csumBuf + csumBlocks * bs, bs);
+		for (size_t i = 0; i < total; i++)
+			table[i] = zero;
+		for (size_t i = 0; i < fatBlocks; i++)
+			table[1 + i] = crc32c(0, fatBuf + i * bs, bs);
+	}
 
+	if (block_disk_set_size(bs) || block_disk_create(diskname, total) ||
+	    block_disk_open(diskname)) {
+		block_disk_set_size(BLOCK_SIZE);
+		free(fatBuf);
+		free(csumBuf);
+		return -1;
+	}
+	int ret = sbWrite(&sb);
+	for (size_t i = 0; i < fatBlocks && !ret; i++)
+		ret = block_write(1 + i, fatBuf + i * bs);
+	for (size_t i = 0; i < csumBlocks && !ret; i++)
+		ret = block_write(sb.csumBlockIndex + i, csumBuf + i * bs);
+	free(fatBuf);
+	free(csumBuf);
+
+	if (block_disk_close() || ret)
+		return -1;
+	return 0;
+}
 
-int fs_write(int fd, void *buf, size_t count)
+static int doMount(const char *diskname, int flags)
 {
-	// 	for (int w = 1; w <= 5; w++) {
-	// 	printf("fat[%d] = %d", w, fat.flatArray[w]);
-	// }
-    /* TODO: Phase 4 */
-	/* what needs to be done :
-		IDEAL CASE: to be written fits within a single datablock
-		- start by reading datablock to bounce buffer
-		- copy buffer to bounce+offset
-		- then write bounce to datablock
-	*/
-    //Return: -1 if no FS is currently mounted, or if file descriptor @fd is
-    //invalid (out of bounds or not currently open), or if @buf is NULL.
-    if(MOUNTED == -1 || fd >= FS_OPEN_MAX_COUNT || fd < 0 || buf == NULL || fdir[fd].filename[0] == '\0') {
-        return -1;
-    }
-	//int curFat = emptyFat(); // delete
-	
-	int rIn = rootIn(fd);
-    void *bounce = (void*)malloc(BLOCK_SIZE);
-	int db = emptyFat();
-	int fBlock = db;
-	//printf("EMPTY FAT %d\n", db);
-	// int db = emptyFat();
-	
-	
-	//fat.flatArray[db] = curFat;
-	// if (block_read(db + superblock.dataBlockStart, bounce))
-	// 	return -1;
-	int tempDB = db + superblock.dataBlockStart;
-
-	fat.flatArray[db] = 0xFFFF;
-	int bounceOffset = fdir[fd].offset % BLOCK_SIZE;
-	size_t dbStart = fdir[fd].offset / BLOCK_SIZE;
-	
-		
+	/* TODO: Phase 1 */
+	// open disk, return -1 if open errors. The block size is not known
+	// yet, so open it with the smallest one
+	if (MOUNTED != -1 || (flags & ~FS_MOUNT_DIRECT) ||
+	    block_disk_set_size(BLOCK_SIZE_MIN))
+		return -1;
+	if (block_disk_open_flags(diskname, flags & FS_MOUNT_DIRECT ?
+				  BLOCK_DISK_DIRECT : 0)) {
+		block_disk_set_size(BLOCK_SIZE);
+		return -1;
+	}
 
-	// if(rd[rIn].fileSize == 0) {
-	// 	int nFat = emptyFat();
-	// 	fat.flatArray[tempDB] = nFat;
-		
-	// }
-if (db != 0xFFFF) {
-		block_read(db + superblock.dataBlockStart + dbStart, bounce);
+	/* read 0th block from the @disk to the superblock,
+	return -1 if errors */
+	if (sbRead(&superblock))
+		goto err_disk;
+
+	/* now that the first block is in the superblock,
+	check if the signature is correct (it is not NULL-terminated) */
+	if (memcmp("ECS150FS", superblock.sig, sizeof(superblock.sig))) {
+		//fprintf(stderr, "Signature not accepted");
+		goto err_disk;
 	}
 
-	int i = 0;
-	size_t reset = 0;
-	int nFat;
-	
-	while (i < count) {
-		
-			
-		nFat = emptyFat();
-		fat.flatArray[db] = nFat;
-		fat.flatArray[nFat] = 0xFFFF;
-	
-				while (reset <  BLOCK_SIZE) {
-				
-					memcpy(&bounce[bounceOffset], &buf[i], 1);
-					
-					fdir[fd].offset++;
-					bounceOffset++;
-					i++;
-					reset++;
-					
-					rd[rIn].fileSize++;
-					if (i >= count)
-					
-						break;
-					
-				}
-		
-		
-		//printf("EMPTY FAT %d\n NEXT FAT %d\n", db, fat.flatArray[db]);
-		 if (i >= count) {
-			fat.flatArray[db] = 0xFFFF;
-			fat.flatArray[nFat] = 0;
-		 }
-		 
-		db = nFat;
-		//printf("%d\n", tempDB);
-		
-		block_write((size_t)tempDB + dbStart, bounce);
-
-		reset = 0;
-		bounceOffset = 0;
-		//tempDB++;
-		
-		 tempDB = db + superblock.dataBlockStart;
-		
-		 
+	/* switch to the real block size and read the whole superblock */
+	geom.blockShift = log2Size(BLOCK_SIZE);
+	if (superblock.version != 0 && superblock.blockShift)
+		geom.blockShift = superblock.blockShift;
+	if (geom.blockShift > 16)
+		goto err_disk;
+	geom.blockSize = 1u << geom.blockShift;
+	geom.blockMask = geom.blockSize - 1;
+	if (block_disk_set_size(geom.blockSize) || sbRead(&superblock))
+		goto err_disk;
+
+	/* original images have a single root directory block */
+	if (superblock.version == 0) {
+		superblock.features = 0;
+		superblock.rootBlocks = 1;
+		superblock.blockShift = 0;
+	}
+	if ((superblock.features & ~FEAT_KNOWN) ||
+	    ((superblock.features & FEAT_CHECKSUM) &&
+	     sbChecksum(&superblock) != superblock.sbCsum))
+		goto err_disk;
+	geom.clusterShift = 0;
+	if (superblock.features & FEAT_COMPRESS)
+		geom.clusterShift = superblock.clusterShift;
+	if (geom.clusterShift > ZCLUSTER_MAX_SHIFT)
+		goto err_disk;
+	geom.clusterBytesShift = geom.clusterShift + geom.blockShift;
+
+	fat.wide = (superblock.features & FEAT_FAT32) != 0;
+	if (fat.wide) {
+		geom.totalBlocks = superblock.totalBlocks32;
+		geom.fatBlocks = superblock.fatBlocks32;
+		geom.rootBlockIndex = superblock.rootBlockIndex32;
+		geom.dataBlockStart = superblock.dataBlockStart32;
+		geom.dataBlockCt = superblock.dataBlockCt32;
+	} else {
+		geom.totalBlocks = superblock.totalBlocks;
+		geom.fatBlocks = superblock.fatBlocks;
+		geom.rootBlockIndex = superblock.rootBlockIndex;
+		geom.dataBlockStart = superblock.dataBlockStart;
+		geom.dataBlockCt = superblock.dataBlockCt;
+	}
+	geom.rootBlocks = superblock.rootBlocks;
+	geom.csumBlockIndex = 0;
+	geom.csumBlocks = 0;
+	if (superblock.features & FEAT_CHECKSUM) {
+		geom.csumBlockIndex = superblock.csumBlockIndex;
+		geom.csumBlocks = superblock.csumBlocks;
 	}
-	
 
-	
-if(rd[rIn].fileSize > 0) 
-			rd[rIn].firstBlockIn = fBlock;
+	if ((uint32_t)block_disk_count() != geom.totalBlocks) {
+		goto err_disk;
+	}
 
-	// for(i; i<superblock.dataBlockCt; i++) {
-	// 	if(fat.flatArray[i] == 0)
-	// 	fat.flatArray[i] = 0xFFFF;
-	// } // delete
+	if (geom.rootBlocks == 0 ||
+	    (uint64_t)geom.rootBlockIndex + geom.rootBlocks > geom.totalBlocks ||
+	    (uint64_t)geom.dataBlockStart + geom.dataBlockCt > geom.totalBlocks ||
+	    fatBlocksFor(geom.dataBlockCt, fat.wide ? 4 : 2, geom.blockSize) >
+	    geom.fatBlocks)
+		goto err_disk;
+	if (geom.csumBlocks &&
+	    ((uint64_t)geom.csumBlockIndex + geom.csumBlocks > geom.totalBlocks ||
+	     fatBlocksFor(geom.totalBlocks, sizeof(uint32_t), geom.blockSize) >
+	     geom.csumBlocks))
+		goto err_disk;
+
+	/* all block buffers are aligned for disks opened with O_DIRECT */
+	fat.flatArray = block_alloc((size_t)geom.blockSize * geom.fatBlocks);
+	fat.dirty = calloc(geom.fatBlocks, 1);
+	rdCount = (size_t)geom.rootBlocks * RD_PER_BLOCK(geom.blockSize);
+	rd = block_alloc((size_t)geom.rootBlocks * geom.blockSize);
+	rdOpen = calloc(rdCount, sizeof(*rdOpen));
+	rdSorted = malloc(rdCount * sizeof(*rdSorted));
+	if (!fat.flatArray || !fat.dirty || !rd || !rdOpen || !rdSorted)
+		goto err_free;
+
+	/* the checksum table is needed to verify all the other reads */
+	if (geom.csumBlocks) {
+		csum.table = block_alloc((size_t)geom.blockSize *
+					 geom.csumBlocks);
+		csum.dirty = calloc(geom.csumBlocks, 1);
+		if (!csum.table || !csum.dirty ||
+		    block_read_multi(geom.csumBlockIndex, geom.csumBlocks,
+				     csum.table))
+			goto err_free;
+	}
 
+	/* start at 1 since signature is 0th index */
+	if (devReadMulti(1, geom.fatBlocks, fat.flatArray))
+		goto err_free;
+	if (fatGet(0) != FAT_EOC) {
+		goto err_free;
+	}
 
+	if (devReadMulti(geom.rootBlockIndex, geom.rootBlocks, rd))
+		goto err_free;
 
+	FILE_COUNT = 0;
+	int tombstones = 0;
+	for (size_t i = 0; i < rdCount; i++) {
+		if (rd[i].filename[0] != '\0')
+			FILE_COUNT++;
+		else if (rd[i].flags & RD_TOMBSTONE)
+			tombstones++;
+	}
+	/* images without a summary get one at their first unmount */
+	if (sumLoad()) {
+		fat.freeCt = fatCountFree();
+		fat.hint = 1;
+	}
+	if (rdHashed() && tombstones && rdRehash())
+		goto err_free;
+	rdSortedBuild();
+	if ((superblock.features & FEAT_DEDUP) && dedupBuild())
+		goto err_free;
+
+	reclaim.count = 0;
+	defragNext = 0;
+	zPending = 0;
+	MOUNTED = 0;
+	return 0;
 
-	// for (int w = 1; w <= 5; w++) {
-	// 	printf("fat[%d] = %d", w, fat.flatArray[w]);
-	// }
-    return i;
+err_free:
+	free(fat.flatArray);
+	free(fat.dirty);
+	free(rd);
+	free(rdOpen);
+	free(rdSorted);
+	free(csum.table);
+	free(csum.dirty);
+	dedupFree();
+	fat.flatArray = NULL;
+	fat.dirty = NULL;
+	rd = NULL;
+	rdOpen = NULL;
+	rdSorted = NULL;
+	csum.table = NULL;
+	csum.dirty = NULL;
+err_disk:
+	block_disk_close();
+	return -1;
 }
 
+static int doUmount(void)
+{
+	/* write from superblock to disk. 
+	here, we simulate saving the changes to our disk
+	 */
+	if (MOUNTED == -1 || fdirOpen)
+		return -1;
 
-int fs_read(int fd, void *buf, size_t count)
-{	
-		/* 
-	first, we need to read our data block into a bounced buffer. 
+	fatReclaim(reclaim.count);
+	uint64_t rootHash = rdHashAll();
+	if (sumClear(rootHash))
+		return -1;
 
-	assuming a file's offset is at value X, we need to also adjust the bounced
-	buffer's offset so that we copy our bounce to buf with the correct offset.
-	the offset would be = fileOffset % BLOCK_SIZE
+	/* FAT blocks are only written back if modified since the mount */
+	for(uint32_t i = 1; i <= geom.fatBlocks; i++) {
+		if (!fat.dirty[i-1])
+			continue;
+		if(devWrite(i, (uint8_t*)fat.flatArray + (size_t)(i-1) * geom.blockSize))
+			return -1;
+		fat.dirty[i-1] = 0;
+	}
 
-	assuming that we read over the data block size, we need to continue reading from
-	the next data block until we complete our count.
- 
- 	memcpy(void *restrict dst, const void *restrict src, size_t n);
-     The memcpy() function copies n bytes from memory area src to memory area dst.  If dst and src overlap, behavior is undefined.
-     Applications in which dst and src might overlap should use memmove(3) instead.
-	 
+	for (uint32_t i = 0; i < geom.rootBlocks; i++) {
+		if (devWrite(geom.rootBlockIndex + i,
+			     (uint8_t*)rd + (size_t)i * geom.blockSize))
+			return -1;
+	}
 
-	*/
+	/* last, as the writes above update it */
+	for (uint32_t i = 0; i < geom.csumBlocks; i++) {
+		if (!csum.dirty[i])
+			continue;
+		if (block_write(geom.csumBlockIndex + i, (uint8_t*)csum.table +
+				(size_t)i * geom.blockSize))
+			return -1;
+		csum.dirty[i] = 0;
+	}
 
-	/*
-	block size 16 bytes
-	read 20 bytes
-	file offset is at 50
+	/* the summary is only valid once all the writes above are done */
+	sumSave(rootHash);
+	if (sbWrite(&superblock) || block_disk_close())
+		return -1;
 
-	[16] [16] [16] [16]
-	50 % 16
+	free(fat.flatArray);
+	free(fat.dirty);
+	free(rd);
+	free(rdOpen);
+	free(rdSorted);
+	free(csum.table);
+	free(csum.dirty);
+	free(zScratch);
+	dedupFree();
+	bounceFree();
+	fat.flatArray = NULL;
+	fat.dirty = NULL;
+	rd = NULL;
+	rdOpen = NULL;
+	rdSorted = NULL;
+	csum.table = NULL;
+	csum.dirty = NULL;
+	zScratch = NULL;
+	/* all descriptors are closed, the next mount starts a new table */
+	free(fdir);
+	fdir = NULL;
+	fdirLen = 0;
+	fdirFree = -1;
+	MOUNTED = -1;
+	return 0;
+}
 
 
+static int doInfo(void)
+{
+	/* TODO: Phase 1 */
+
+	if (MOUNTED == -1)
+		return -1;
+
+	/* report the blocks of deleted files as free */
+	fatReclaim(reclaim.count);
+
+	/* "An empty entry is defined by the first character of the entry’s
+	filename being equal to the NULL character." FILE_COUNT counts the
+	others */
+	size_t rdFree = rdCount - FILE_COUNT;
+
+	/* On format specifiers for (un)signed integers:
+	https://utat-ss.readthedocs.io/en/master/c-programming/print-formatting.html */
+	printf("FS Info:\n");
+	printf("total_blk_count=%u\n",geom.totalBlocks);
+	printf("fat_blk_count=%u\n",geom.fatBlocks);
+	printf("rdir_blk=%u\n",geom.rootBlockIndex);
+	printf("data_blk=%u\n",geom.dataBlockStart);
+	printf("data_blk_count=%u\n",geom.dataBlockCt);
+	printf("fat_free_ratio=%u/%u\n", fat.freeCt, geom.dataBlockCt);
+	printf("rdir_free_ratio=%zu/%zu\n", rdFree, rdCount);
+	if (rdHashed())
+		printf("rdir_blk_count=%u\n", geom.rootBlocks);
+	if (fat.wide)
+		printf("fat_entry_bits=32\n");
+	if (geom.blockSize != BLOCK_SIZE)
+		printf("blk_size=%u\n", geom.blockSize);
+	if (geom.csumBlocks)
+		printf("csum_blk_count=%u\n", geom.csumBlocks);
+	if (superblock.features & FEAT_COMPRESS)
+		printf("cluster_blk_count=%u\n", 1u << geom.clusterShift);
+	if (superblock.features & FEAT_DEDUP)
+		printf("dedup_ratio=%llu/%u\n",
+		       (unsigned long long)dedup.refTotal, dedup.used);
+	return 0;
+
+}
+
+static int doCreate(const char *filename)
+{
+	/* TODO: Phase 2 */
+   	if(filename == NULL || MOUNTED == -1 || filename[0] == '\0' || strlen(filename) >= FS_FILENAME_LEN || FILE_COUNT >= rdCount) {
+        return -1;
+    }
+
+    // check if the file already exists. if exist return -1
+    if (rdFind(filename) >= 0)
+        return -1;
+
+    // check for empty entry in root directory.
+    // https://www.tutorialandexample.com/null-character-in-c null characters
+    int i = rdFreeSlot(filename);
+    if (i < 0)
+        return -1;
+    rdSetFirst(i, FAT_EOC);
+    // the length was checked above, this also pads the entry with zeros
+    strncpy((char*)rd[i].filename, filename, FS_FILENAME_LEN - 1);
+    rd[i].filename[FS_FILENAME_LEN - 1] = '\0';
+    rd[i].fileSize = 0;
+    rd[i].flags = superblock.features & FEAT_COMPRESS ? RD_COMPRESSED :
+	    superblock.features & FEAT_DEDUP ? RD_DEDUP : 0;
+    rdSortedAdd(i);
+    FILE_COUNT++;
+    return 0;
+}
+
+static int doDelete(const char *filename)
+{
+	/* TODO: Phase 2 */
+
+    uint32_t starting_data_index = FAT_EOC;
+
+    if(filename == NULL || MOUNTED == -1) {
+        return -1;
+    }
+
+    int rIn = rdFind(filename);
+    if (rIn < 0 || rdOpen[rIn]) {
+        return -1;
+    }
+    // shared data blocks are only freed with their last reference
+    if ((rd[rIn].flags & RD_DEDUP) && dRelease(rIn))
+        return -1;
+
+    // file’s entry must be emptied
+    starting_data_index = rdFirst(rIn);
+    rdSortedRemove(rIn);
+    FILE_COUNT--;
+    // later entries of the hash probe run take the place of the deleted one
+    if (rdHashed())
+        rIn = rdShiftBack(rIn);
+    memset(rd[rIn].filename, 0, FS_FILENAME_LEN);
+    rd[rIn].flags = 0;
+    rd[rIn].fileSize = 0;
+    rdSetFirst(rIn, FAT_EOC);
+    // the data blocks are freed later, in bulk, by fatReclaim()
+    if (starting_data_index != FAT_EOC)
+        reclaimPush(starting_data_index);
+    return 0;
+}
+
+static int doLs(void)
+{
+    /* TODO: Phase 2 */
+    if(MOUNTED == -1) {
+        return -1;
+    }
+
+	printf("FS Ls:\n");
+	/* the used entries are often all at the start of the directory */
+	for(size_t i=0, left = FILE_COUNT; i < rdCount && left; i++) {
+        	if(rd[i].filename[0] != '\0') {
+            		/* legacy images print the on-disk 16-bit entry */
+            		printf("file: %s, size: %d, data_blk: %d\n", rd[i].filename, rd[i].fileSize,
+            		       fat.wide ? (int)rdFirst(i) : rd[i].firstBlockIn);
+            		left--;
+        	}
+    }
+	return 0;
+}
+
+	
 	
-	*/
-	if (MOUNTED == -1 || fd >= FS_OPEN_MAX_COUNT || fd < 0 || fdir[fd].filename[0] == '\0' || buf == NULL) {
+/* add FS_OPEN_MAX_COUNT or more free file descriptors to the table */
+static int fdirGrow(void)
+{
+	int len = fdirLen ? fdirLen * 2 : FS_OPEN_MAX_COUNT;
+	struct openFileContent *table;
+
+	if (len > FS_OPEN_MAX_COUNT_EXT)
+		len = FS_OPEN_MAX_COUNT_EXT;
+	if (len == fdirLen)
 		return -1;
+	table = realloc(fdir, len * sizeof(*table));
+	if (!table)
+		return -1;
+
+	/* the lowest new descriptor is handed out first */
+	for (int i = len - 1; i >= fdirLen; i--) {
+		table[i].file = NULL;
+		table[i].nextFree = fdirFree;
+		fdirFree = i;
 	}
-	
-int rootIn;
-	//int bytes = 0;
-	for(int i=0; i < FS_FILE_MAX_COUNT; i++) {
-        if(strcmp((char*)fdir[fd].filename, (char*)rd[i].filename) == 0){
-            rootIn = rd[i].firstBlockIn;
+	fdir = table;
+	fdirLen = len;
+	return 0;
+}
+
+static int doOpen(const char *filename, int flags)
+{
+	struct openFile *file;
+	int fd;
+
+	// VALIDATION
+	if (MOUNTED == -1 || filename == NULL || strlen(filename) >= FS_FILENAME_LEN ||
+	    (flags & ~(FS_O_RDONLY | FS_O_APPEND | FS_O_DIRECT)))
+		return -1;
+
+	// check if file exists in root directory
+	int rIn = rdFind(filename);
+	if (rIn < 0)
+		return -1;
+	/* compressed or shared data cannot move straight to and from the
+	 * disk */
+	if ((flags & FS_O_DIRECT) &&
+	    (rd[rIn].flags & (RD_COMPRESSED | RD_DEDUP)))
+		return -1;
+
+	if (fdirFree < 0 && fdirGrow())
+		return -1;
+
+	// all the descriptors of a file share its open state
+	file = rdOpen[rIn];
+	if (!file) {
+		file = malloc(sizeof(*file));
+		if (!file)
+			return -1;
+		file->rIn = rIn;
+		file->refs = 0;
+		file->z = NULL;
+		file->d = NULL;
+		if (((rd[rIn].flags & RD_COMPRESSED) &&
+		     !(file->z = zOpen(rIn))) ||
+		    ((rd[rIn].flags & RD_DEDUP) && !(file->d = dOpen(rIn)))) {
+			free(file);
+			return -1;
+		}
+		rdOpen[rIn] = file;
+	}
+	file->refs++;
+
+	fd = fdirFree;
+	fdirFree = fdir[fd].nextFree;
+	fdir[fd].offset = 0;
+	fdir[fd].file = file;
+	fdir[fd].flags = flags;
+	fdirOpen++;
+	return fd;
+}
+
+/* root directory entry of open file @fd, -1 if @fd is not valid */
+static int fdEntry(int fd)
+{
+	if (MOUNTED == -1 || fd >= fdirLen || fd < 0 || fdir[fd].file == NULL)
+		return -1;
+	return fdir[fd].file->rIn;
+}
+
+/* same as fdEntry(), but also -1 if @fd was opened read-only */
+static int fdWriteEntry(int fd)
+{
+	int rIn = fdEntry(fd);
+
+	if (rIn >= 0 && (fdir[fd].flags & FS_O_RDONLY))
+		return -1;
+	return rIn;
+}
+
+static int doClose(int fd)
+{
+	struct openFile *file;
+	int ret = 0;
+
+	if (fdEntry(fd) < 0)
+		return -1;
+
+	file = fdir[fd].file;
+	if (--file->refs == 0) {
+		/* the descriptor is released even if the data is lost */
+		if (file->z && file->z->dirty)
+			ret = zFlush(file->rIn, file->z);
+		if (file->d)
+			ret = dFlush(file->d);
+		zFree(file->z);
+		dFree(file->d);
+		rdOpen[file->rIn] = NULL;
+		free(file);
+	}
+	fdir[fd].file = NULL;
+	fdir[fd].nextFree = fdirFree;
+	fdirFree = fd;
+	fdirOpen--;
+	return ret;
+}
+
+static int doStat(int fd)
+{
+	/* TODO: Phase 3 */
+    // Return -1 if no FS is currently mounted, or fd is out of bound, or it is not currently open
+    int i = fdEntry(fd);
+    if (i < 0) {
+        return -1;
+    }
+
+    //return the size of the open file
+    return rd[i].fileSize;
+}
+
+static int doLseek(int fd, size_t offset)
+{
+	// to do: check if fd is valid
+    if (fdEntry(fd) < 0) {
+        return -1;
+    }
+
+    // set the offset
+	fdir[fd].offset = offset;
+	return 0;
+}
+
+/* first free block, -1 if the disk is full. Nothing below the hint is free,
+ * so repeated allocations do not rescan the allocated head of the FAT */
+int emptyFat() {
+	for (uint32_t i = fat.hint; i < geom.dataBlockCt; i++) {
+		if (fatGet(i) == 0) {
+			fat.hint = i;
+			return i;
+		}
+	}
+	fat.hint = geom.dataBlockCt;
+	return -1;
+}
+
+/* number of blocks holding @bytes bytes */
+static inline uint32_t blkCount(size_t bytes)
+{
+	return ((uint64_t)bytes + geom.blockMask) >> geom.blockShift;
+}
+
+/* length of the run of free blocks starting at @blk, at most @max */
+static uint32_t fatRunAt(uint32_t blk, uint32_t max)
+{
+	uint32_t n = 0;
+
+	while (n < max && blk + n < geom.dataBlockCt && fatGet(blk + n) == 0)
+		n++;
+	return n;
+}
+
+/* first run of @want free blocks, or the longest run if there is none. Returns
+ * its length and stores its first block in @start, 0 if the disk is full */
+static uint32_t fatFindRun(uint32_t want, uint32_t *start)
+{
+	uint32_t best = 0, n;
+	int first = emptyFat();
+
+	if (first < 0)
+		return 0;
+	for (uint32_t i = first; i < geom.dataBlockCt; i += n + 1) {
+		n = fatRunAt(i, want);
+		if (n == want) {
+			*start = i;
+			return n;
+		}
+		if (n > best) {
+			best = n;
+			*start = i;
+		}
+	}
+	return best;
+}
+
+/* free the @count chains starting at @heads in one pass, the free count and
+ * the hint are only updated once at the end */
+static void fatReleaseChains(const uint32_t *heads, size_t count)
+{
+	uint32_t n = 0, low = fat.hint;
+
+	for (size_t c = 0; c < count; c++) {
+		uint32_t blk = heads[c];
+
+		while (blk != FAT_EOC && blk != 0 && blk < geom.dataBlockCt) {
+			uint32_t next = fatGet(blk);
+
+			fatSet(blk, 0);
+			if (blk < low)
+				low = blk;
+			blk = next;
+			n++;
+		}
+	}
+	fat.freeCt += n;
+	fat.hint = low;
+}
+
+/* free the chains of up to @max deleted files, the most recent ones first */
+static void fatReclaim(size_t max)
+{
+	if (max > reclaim.count)
+		max = reclaim.count;
+	reclaim.count -= max;
+	fatReleaseChains(reclaim.heads + reclaim.count, max);
+}
+
+/* queue the chain starting at @blk for reclamation, freeing it right away if
+ * the queue cannot grow */
+static void reclaimPush(uint32_t blk)
+{
+	if (reclaim.count == reclaim.alloc) {
+		size_t alloc = reclaim.alloc ? reclaim.alloc * 2 : 64;
+		uint32_t *heads = realloc(reclaim.heads, alloc * sizeof(*heads));
+
+		if (!heads) {
+			fatReleaseChains(&blk, 1);
+			return;
+		}
+		reclaim.heads = heads;
+		reclaim.alloc = alloc;
+	}
+	reclaim.heads[reclaim.count++] = blk;
+	if (reclaimRunning > 0)
+		pthread_cond_signal(&reclaimCond);
+}
+
+/* free FAT entries, reclaiming the chains of deleted files first if fewer than
+ * @want are free */
+static uint32_t fatFreeCount(uint32_t want)
+{
+	if (want > fat.freeCt)
+		fatReclaim(reclaim.count);
+	return fat.freeCt;
+}
+
+/* allocate the @n free blocks starting at @start as one chain */
+static void fatLinkRun(uint32_t start, uint32_t n)
+{
+	for (uint32_t i = start; i < start + n - 1; i++)
+		fatSet(i, i + 1);
+	fatSet(start + n - 1, FAT_EOC);
+	fat.freeCt -= n;
+	if (start == fat.hint)
+		fat.hint = start + n;
+}
+
+/* number of blocks in the chain of root directory entry @rIn, its last block
+ * is stored in @last (FAT_EOC for an empty chain) */
+static uint32_t fileChain(int rIn, uint32_t *last)
+{
+	uint32_t n = 0, blk = rdFirst(rIn);
+
+	*last = FAT_EOC;
+	while (blk != FAT_EOC) {
+		*last = blk;
+		blk = fatGet(blk);
+		n++;
+	}
+	return n;
+}
+
+/*
+ * fileReserve - link @want free blocks after @last, the last block of root
+ * directory entry @rIn (FAT_EOC if its chain is empty)
+ *
+ * Blocks are taken in runs: first the free blocks right after @last so that
+ * the file stays contiguous, then the first run large enough for the rest, or
+ * the longest runs when free space is fragmented. Each run is linked with one
+ * pass over its FAT entries. Returns the number of blocks linked, smaller than
+ * @want only when the disk is full.
+ */
+static uint32_t fileReserve(int rIn, uint32_t last, uint32_t want)
+{
+	uint32_t got = 0, start, n;
+
+	if (want > fatFreeCount(want))
+		want = fat.freeCt;
+	while (got < want) {
+		start = last + 1;
+		n = last == FAT_EOC ? 0 : fatRunAt(start, want - got);
+		if (n == 0 && (n = fatFindRun(want - got, &start)) == 0)
 			break;
+
+		if (last == FAT_EOC)
+			rdSetFirst(rIn, start);
+		else
+			fatSet(last, start);
+		fatLinkRun(start, n);
+		last = start + n - 1;
+		got += n;
+	}
+	return got;
+}
+
+/* copy @len bytes between @block and the iovec cursor (@vi, @vp), advancing
+ * the cursor; @toIov selects the direction */
+static void iovCopy(const struct iovec *iov, int *vi, size_t *vp,
+		    uint8_t *block, size_t len, int toIov)
+{
+	while (len) {
+		size_t n = iov[*vi].iov_len - *vp;
+		uint8_t *base = (uint8_t*)iov[*vi].iov_base + *vp;
+
+		if (n > len)
+			n = len;
+		if (toIov)
+			memcpy(base, block, n);
+		else
+			memcpy(block, base, n);
+		block += n;
+		len -= n;
+		*vp += n;
+		if (*vp == iov[*vi].iov_len) {
+			(*vi)++;
+			*vp = 0;
 		}
-	 }
-	 //int cBlock = rootIn;
-	//  printf("CBLOCK %d %d \n", cBlock, fat.flatArray[cBlock]);
-	// 	for (int w = 0; w <= 5; w++) {
-	// 	printf("fat[%d] = %d", w, fat.flatArray[w]);
-	// }
-	//start by reading first datablock
-	void *bounce = (void*)malloc(BLOCK_SIZE);
-	size_t db = fdir[fd].offset / BLOCK_SIZE;
-	if (rootIn == superblock.dataBlockStart)
-		block_read(rootIn + db, bounce);
-	block_read(rootIn + superblock.dataBlockStart + db, bounce);
-	// if (block_read(db + 1 + superblock.dataBlockStart, bounce))
-	// 	return -1;
-	
-	int tempDB = rootIn;
-	//int tempDB = fdir[fd].offset/BLOCK_SIZE + 1 + superblock.dataBlockStart;
-	int bounceOffset = fdir[fd].offset % BLOCK_SIZE;
-	int i = 0;
-	int bytes = 0;
-	while (i < count) {
-	if (i + BLOCK_SIZE-bounceOffset > fs_stat(fd)) {
-		for (int j = i; i<count; j++) {
-			memcpy(&buf[j], &bounce[bounceOffset], 1);
-			bounceOffset++;
-			bytes++;
-			i++;
-		}
-		
-		return bytes;
-	}
-
-	memcpy(&buf[i], &bounce[bounceOffset], BLOCK_SIZE-bounceOffset); // |          |           |           |
-	//fdir[fd].offset += BLOCK_SIZE-bounceOffset;
-	
-	
-	// db  = fat.flatArray[db];
-	
-	// tempDB = db + superblock.dataBlockStart;
-	tempDB = fat.flatArray[tempDB];
-	block_read((size_t)(tempDB) + superblock.dataBlockStart, bounce);
-	
-	//printf("next db %d\n", tempDB);
-	//cBlock = fat.flatArray[tempDB];
-	bounceOffset = 0;
-	
-	i+= BLOCK_SIZE-bounceOffset;
-	bytes+= BLOCK_SIZE-bounceOffset;
 	}
+}
 
-	
-	return bytes;
+/* skip empty segments so that the cursor points at data to transfer */
+static void iovSkipEmpty(const struct iovec *iov, int iovcnt, int *vi,
+			 size_t *vp)
+{
+	while (*vi < iovcnt && *vp == iov[*vi].iov_len) {
+		(*vi)++;
+		*vp = 0;
+	}
+}
+
+/* thread exit: the buffer goes back to the mount it came from, if mounted */
+static void bounceRelease(void *arg)
+{
+	struct bounceBuf *b = arg;
+
+	pthread_mutex_lock(&bounce.lock);
+	if (b->buf && b->gen == bounce.gen)
+		bounce.idle[bounce.idleCount++] = b->buf;
+	b->buf = NULL;
+	pthread_mutex_unlock(&bounce.lock);
+}
+
+static void bounceKeyCreate(void)
+{
+	pthread_key_create(&bounceKey, bounceRelease);
+}
+
+/* the bounce buffer of the calling thread, only allocated on its first call
+ * since the mount */
+static uint8_t *bounceGet(void)
+{
+	uint8_t *buf = NULL;
+
+	/* the generation only changes at umount, which no I/O overlaps */
+	if (bounceBuf.buf && bounceBuf.gen == bounce.gen)
+		return bounceBuf.buf;
+
+	pthread_once(&bounceOnce, bounceKeyCreate);
+	pthread_mutex_lock(&bounce.lock);
+	if (bounce.idleCount) {
+		buf = bounce.idle[--bounce.idleCount];
+	} else {
+		if (bounce.count == bounce.alloc) {
+			size_t alloc = bounce.alloc ? 2 * bounce.alloc : 8;
+			uint8_t **bufs = realloc(bounce.bufs,
+						 alloc * sizeof(*bufs));
+			uint8_t **idle;
+
+			if (!bufs)
+				goto out;
+			bounce.bufs = bufs;
+			if (!(idle = realloc(bounce.idle, alloc * sizeof(*idle))))
+				goto out;
+			bounce.idle = idle;
+			bounce.alloc = alloc;
+		}
+		if ((buf = block_alloc(geom.blockSize)))
+			bounce.bufs[bounce.count++] = buf;
+	}
+out:
+	pthread_mutex_unlock(&bounce.lock);
+	if (!buf)
+		return NULL;
+	bounceBuf.buf = buf;
+	bounceBuf.gen = bounce.gen;
+	pthread_setspecific(bounceKey, &bounceBuf);
+	return buf;
+}
+
+/* umount: free all the buffers, those still held by threads become stale */
+static void bounceFree(void)
+{
+	pthread_mutex_lock(&bounce.lock);
+	for (size_t i = 0; i < bounce.count; i++)
+		free(bounce.bufs[i]);
+	free(bounce.bufs);
+	free(bounce.idle);
+	bounce.bufs = NULL;
+	bounce.idle = NULL;
+	bounce.count = 0;
+	bounce.idleCount = 0;
+	bounce.alloc = 0;
+	bounce.gen++;
+	pthread_mutex_unlock(&bounce.lock);
+}
+
+/* block @n links after @blk in its chain, FAT_EOC if the chain is shorter */
+static uint32_t chainSkip(uint32_t blk, uint32_t n)
+{
+	while (n-- && blk != FAT_EOC)
+		blk = fatGet(blk);
+	return blk;
+}
+
+/* transfer the @n blocks of the chain starting at @blk, with one transfer per
+ * run of consecutive blocks */
+static int chainIO(uint32_t blk, uint32_t n, uint8_t *buf, int write)
+{
+	uint32_t start, k;
+
+	while (n) {
+		if (blk == FAT_EOC)
+			return -1;
+		for (start = blk, k = 1; k < n && fatGet(blk) == blk + 1; k++)
+			blk++;
+		if (write ? devWriteMulti(geom.dataBlockStart + start, k, buf) :
+		    devReadMulti(geom.dataBlockStart + start, k, buf))
+			return -1;
+		buf += (size_t)k << geom.blockShift;
+		n -= k;
+		blk = fatGet(blk);
+	}
+	return 0;
+}
+
+/* allocate a chain of @n blocks, which must be free. Returns its first block
+ * and stores its last one in @last */
+static uint32_t fatAllocChain(uint32_t n, uint32_t *last)
+{
+	uint32_t first = FAT_EOC, start, k;
+
+	*last = FAT_EOC;
+	while (n && (k = fatFindRun(n, &start))) {
+		if (*last == FAT_EOC)
+			first = start;
+		else
+			fatSet(*last, start);
+		fatLinkRun(start, k);
+		*last = start + k - 1;
+		n -= k;
+	}
+	return first;
+}
+
+/* number of map blocks of a compressed file of @clusters clusters */
+static inline uint32_t zMapBlocks(uint32_t clusters)
+{
+	return blkCount(clusters);
+}
+
+/* bytes of cluster @ci held by file @rIn */
+static uint32_t zClusterLen(int rIn, uint32_t ci)
+{
+	size_t start = (size_t)ci << geom.clusterBytesShift;
+	size_t size = rd[rIn].fileSize;
+
+	if (size <= start)
+		return 0;
+	size -= start;
+	return size < (1u << geom.clusterBytesShift) ? size :
+		1u << geom.clusterBytesShift;
+}
+
+/* free blocks to keep for a dirty cluster: the cluster and a new map block */
+static inline uint32_t zReserve(void)
+{
+	return (1u << geom.clusterShift) + 1;
+}
+
+static void zFree(struct zFile *z)
+{
+	if (!z)
+		return;
+	free(z->map);
+	free(z->mapBlk);
+	free(z->clusterBlk);
+	free(z->buf);
+	free(z);
+}
+
+/* load the cluster map of compressed file @rIn and locate its clusters */
+static struct zFile *zOpen(int rIn)
+{
+	struct zFile *z = calloc(1, sizeof(*z));
+	uint32_t n = ((uint64_t)rd[rIn].fileSize +
+		      (1u << geom.clusterBytesShift) - 1) >>
+		geom.clusterBytesShift;
+	uint32_t blk = rdFirst(rIn), cnt;
+
+	if (!z)
+		return NULL;
+	z->cached = ZNONE;
+	z->buf = block_alloc((size_t)1 << geom.clusterBytesShift);
+	if (!z->buf)
+		goto err;
+	if (n == 0)
+		return z;
+
+	z->mapBlocks = zMapBlocks(n);
+	z->map = block_alloc((size_t)z->mapBlocks << geom.blockShift);
+	z->mapBlk = malloc(z->mapBlocks * sizeof(uint32_t));
+	z->clusterBlk = malloc(n * sizeof(uint32_t));
+	if (!z->map || !z->mapBlk || !z->clusterBlk)
+		goto err;
+	z->alloc = n;
+	for (uint32_t i = 0; i < z->mapBlocks; i++, blk = fatGet(blk)) {
+		if (blk == FAT_EOC ||
+		    devRead(geom.dataBlockStart + blk,
+			    z->map + ((size_t)i << geom.blockShift)))
+			goto err;
+		z->mapBlk[i] = blk;
+	}
+	for (uint32_t i = 0; i < n; i++) {
+		cnt = ZMAP_BLOCKS(z->map[i]);
+		if (blk == FAT_EOC || cnt == 0 ||
+		    cnt > (1u << geom.clusterShift))
+			goto err;
+		z->clusterBlk[i] = blk;
+		blk = chainSkip(blk, cnt);
+	}
+	z->clusters = n;
+	return z;
+
+err:
+	zFree(z);
+	return NULL;
 }
 
+/* add a block to the cluster map of compressed file @rIn */
+static int zMapGrow(int rIn, struct zFile *z)
+{
+	size_t bs = geom.blockSize, len = (size_t)z->mapBlocks * bs;
+	uint8_t *map = block_alloc(len + bs);
+	uint32_t *mapBlk = realloc(z->mapBlk,
+				   (z->mapBlocks + 1) * sizeof(uint32_t));
+	uint32_t blk, last;
+
+	if (mapBlk)
+		z->mapBlk = mapBlk;
+	if (!map || !mapBlk || fatFreeCount(1) < 1) {
+		free(map);
+		return -1;
+	}
+	if (len)
+		memcpy(map, z->map, len);
+	memset(map + len, 0, bs);
+	free(z->map);
+	z->map = map;
+
+	/* the map blocks come first in the chain */
+	blk = fatAllocChain(1, &last);
+	if (z->mapBlocks == 0) {
+		rdSetFirst(rIn, blk);
+	} else {
+		fatSet(blk, fatGet(z->mapBlk[z->mapBlocks - 1]));
+		fatSet(z->mapBlk[z->mapBlocks - 1], blk);
+	}
+	z->mapBlk[z->mapBlocks++] = blk;
+	return 0;
+}
+
+/*
+ * zFlush - write back the cached cluster of compressed file @rIn
+ *
+ * The cluster goes to newly allocated blocks, which replace its old ones in
+ * the chain, and its map entry is updated. The blocks were reserved when the
+ * cluster was first modified (see zIO()).
+ */
+static int zFlush(int rIn, struct zFile *z)
+{
+	uint32_t ci = z->cached, len = zClusterLen(rIn, ci);
+	uint32_t raw = blkCount(len), cnt, first, last, prev, next = FAT_EOC;
+	size_t n = 0;
+	uint8_t entry, *src = z->buf;
+
+	zPending -= zReserve();
+	z->dirty = 0;
+	if (len == 0)
+		return 0;
+	if (ci > z->clusters)
+		return -1;
+	if (!zScratch &&
+	    !(zScratch = block_alloc((size_t)1 << geom.clusterBytesShift)))
+		return -1;
+
+	memset(z->buf + len, 0, ((size_t)raw << geom.blockShift) - len);
+	if (raw > 1)
+		n = lz_compress(z->buf, len, zScratch + sizeof(uint32_t),
+				((size_t)(raw - 1) << geom.blockShift) -
+				sizeof(uint32_t));
+	if (n) {
+		uint32_t zlen = n;
+
+		cnt = blkCount(n + sizeof(zlen));
+		memcpy(zScratch, &zlen, sizeof(zlen));
+		memset(zScratch + sizeof(zlen) + n, 0,
+		       ((size_t)cnt << geom.blockShift) - sizeof(zlen) - n);
+		src = zScratch;
+		entry = ZMAP_COMPRESSED | cnt;
+	} else {
+		cnt = raw;
+		entry = cnt;
+	}
+
+	if (zMapBlocks(ci + 1) > z->mapBlocks && zMapGrow(rIn, z))
+		return -1;
+	if (ci == z->alloc) {
+		uint32_t alloc = z->alloc ? z->alloc * 2 : 16;
+		uint32_t *blks = realloc(z->clusterBlk, alloc * sizeof(*blks));
+
+		if (!blks)
+			return -1;
+		z->clusterBlk = blks;
+		z->alloc = alloc;
+	}
+	if (fatFreeCount(cnt) < cnt)
+		return -1;
+	first = fatAllocChain(cnt, &last);
+	if (chainIO(first, cnt, src, 1)) {
+		fatReleaseChains(&first, 1);
+		return -1;
+	}
+
+	/* splice the new blocks in place of the old ones */
+	prev = ci ? chainSkip(z->clusterBlk[ci - 1],
+			      ZMAP_BLOCKS(z->map[ci - 1]) - 1) :
+		z->mapBlk[z->mapBlocks - 1];
+	if (ci < z->clusters) {
+		uint32_t old = z->clusterBlk[ci];
+		uint32_t oldLast = chainSkip(old, ZMAP_BLOCKS(z->map[ci]) - 1);
+
+		next = fatGet(oldLast);
+		fatSet(oldLast, FAT_EOC);
+		fatReleaseChains(&old, 1);
+	} else {
+		z->clusters++;
+	}
+	fatSet(prev, first);
+	fatSet(last, next);
+	z->clusterBlk[ci] = first;
+	z->map[ci] = entry;
+
+	ci >>= geom.blockShift;
+	return devWrite(geom.dataBlockStart + z->mapBlk[ci],
+			z->map + ((size_t)ci << geom.blockShift));
+}
+
+/* make cluster @ci of compressed file @rIn the cached one */
+static int zLoad(int rIn, struct zFile *z, uint32_t ci)
+{
+	uint32_t len, zlen, entry, cnt;
+	int n;
+
+	if (z->cached == ci)
+		return 0;
+	if (z->dirty && zFlush(rIn, z))
+		return -1;
+	z->cached = ZNONE;
+
+	len = zClusterLen(rIn, ci);
+	if (ci >= z->clusters) {
+		/* new cluster at the end of the file */
+		memset(z->buf, 0, (size_t)1 << geom.clusterBytesShift);
+		z->cached = ci;
+		return 0;
+	}
+
+	entry = z->map[ci];
+	cnt = ZMAP_BLOCKS(entry);
+	if (!(entry & ZMAP_COMPRESSED)) {
+		if (chainIO(z->clusterBlk[ci], cnt, z->buf, 0))
+			return -1;
+		z->cached = ci;
+		return 0;
+	}
+
+	if (!zScratch &&
+	    !(zScratch = block_alloc((size_t)1 << geom.clusterBytesShift)))
+		return -1;
+	if (chainIO(z->clusterBlk[ci], cnt, zScratch, 0))
+		return -1;
+	memcpy(&zlen, zScratch, sizeof(zlen));
+	if (zlen > ((size_t)cnt << geom.blockShift) - sizeof(zlen))
+		return -1;
+	/* clusters cut by fs_truncate() keep their old length */
+	n = lz_decompress(zScratch + sizeof(zlen), zlen, z->buf,
+			  (size_t)1 << geom.clusterBytesShift);
+	if (n < 0 || (uint32_t)n < len)
+		return -1;
+	z->cached = ci;
+	return 0;
+}
+
+/*
+ * zIO - fileIO() of a compressed file, through its cached cluster
+ *
+ * The first write to a cached cluster reserves the blocks it can take once
+ * written back, so a write stops early when the disk is full rather than its
+ * data being lost later, when the cluster is written back.
+ */
+static int zIO(int rIn, size_t offset, size_t total, const struct iovec *iov,
+	       int iovcnt, int write)
+{
+	struct zFile *z = rdOpen[rIn]->z;
+	size_t done = 0, mask = ((size_t)1 << geom.clusterBytesShift) - 1;
+	int vi = 0;
+	size_t vp = 0;
+
+	while (done < total) {
+		size_t pos = offset + done, coff = pos & mask;
+		size_t chunk = mask + 1 - coff;
+
+		if (chunk > total - done)
+			chunk = total - done;
+		if (zLoad(rIn, z, pos >> geom.clusterBytesShift))
+			break;
+		if (write && !z->dirty) {
+			if (fatFreeCount(zPending + zReserve()) <
+			    zPending + zReserve())
+				break;
+			zPending += zReserve();
+			z->dirty = 1;
+		}
+		iovCopy(iov, &vi, &vp, z->buf + coff, chunk, !write);
+		done += chunk;
+		if (write && pos + chunk > rd[rIn].fileSize)
+			rd[rIn].fileSize = pos + chunk;
+	}
+
+	if (!write && done == 0)
+		return -1;
+	return done;
+}
+
+/* shrink compressed file @rIn to @length bytes, freeing the clusters and the
+ * map blocks past the new end */
+static int zTruncate(int rIn, struct zFile *z, size_t length)
+{
+	uint32_t keep = ((uint64_t)length + (1u << geom.clusterBytesShift) -
+			 1) >> geom.clusterBytesShift;
+	uint32_t blk, last, maps = zMapBlocks(keep);
+
+	if (z->dirty && zFlush(rIn, z))
+		return -1;
+	z->cached = ZNONE;
+
+	if (keep == 0) {
+		blk = rdFirst(rIn);
+		rdSetFirst(rIn, FAT_EOC);
+		fatReleaseChains(&blk, 1);
+		z->mapBlocks = 0;
+		z->clusters = 0;
+	} else {
+		if (keep < z->clusters) {
+			last = chainSkip(z->clusterBlk[keep - 1],
+					 ZMAP_BLOCKS(z->map[keep - 1]) - 1);
+			blk = fatGet(last);
+			fatSet(last, FAT_EOC);
+			fatReleaseChains(&blk, 1);
+			z->clusters = keep;
+		}
+		if (maps < z->mapBlocks) {
+			last = z->mapBlk[z->mapBlocks - 1];
+			blk = z->mapBlk[maps];
+			fatSet(z->mapBlk[maps - 1], fatGet(last));
+			fatSet(last, FAT_EOC);
+			fatReleaseChains(&blk, 1);
+			z->mapBlocks = maps;
+		}
+	}
+	rd[rIn].fileSize = length;
+	return 0;
+}
+
+/* index block @i of deduplicated file @d */
+static inline uint8_t *dIndexBlock(struct dFile *d, uint32_t i)
+{
+	return (uint8_t*)d->index + ((size_t)i << geom.blockShift);
+}
+
+/* index entries per block */
+static inline uint32_t dPerBlock(void)
+{
+	return geom.blockSize / sizeof(uint32_t);
+}
+
+/* insert data block @blk, whose hash is set, into the content index */
+static void dedupInsert(uint32_t blk)
+{
+	uint32_t b = dedup.hash[blk] & dedup.mask;
+
+	dedup.next[blk] = dedup.buckets[b];
+	dedup.buckets[b] = blk;
+}
+
+static void dedupRemove(uint32_t blk)
+{
+	uint32_t *p = &dedup.buckets[dedup.hash[blk] & dedup.mask];
+
+	while (*p && *p != blk)
+		p = &dedup.next[*p];
+	if (*p)
+		*p = dedup.next[blk];
+}
+
+/* data block holding the same @bs bytes as @data, 0 if there is none. Blocks
+ * of equal hash are read back and compared */
+static uint32_t dedupFind(uint64_t h, const uint8_t *data)
+{
+	for (uint32_t blk = dedup.buckets[h & dedup.mask]; blk;
+	     blk = dedup.next[blk]) {
+		if (dedup.hash[blk] == h && dedup.refs[blk] < UINT32_MAX &&
+		    !devRead(geom.dataBlockStart + blk, dedup.scratch) &&
+		    !memcmp(dedup.scratch, data, geom.blockSize))
+			return blk;
+	}
+	return 0;
+}
+
+/* drop a reference to data block @blk, freeing it with the last one */
+static void dedupUnref(uint32_t blk)
+{
+	if (blk == DZERO) {
+		dedup.zeros--;
+		return;
+	}
+	dedup.refTotal--;
+	if (--dedup.refs[blk])
+		return;
+	dedup.used--;
+	dedupRemove(blk);
+	fatReleaseChains(&blk, 1);
+}
+
+static void dedupFree(void)
+{
+	free(dedup.refs);
+	free(dedup.hash);
+	free(dedup.next);
+	free(dedup.buckets);
+	free(dedup.scratch);
+	memset(&dedup, 0, sizeof(dedup));
+}
+
+/*
+ * dedupBuild - build the content index of a deduplicated image at mount
+ *
+ * The references to each data block, and the all-zero blocks, are counted from
+ * the indexes of the deduplicated files. Then all the referenced blocks are
+ * read, in runs of consecutive blocks, and hashed.
+ */
+static int dedupBuild(void)
+{
+	uint32_t n = geom.dataBlockCt, buckets = 1, per = dPerBlock();
+	uint32_t batch = DEFRAG_BATCH_BYTES >> geom.blockShift;
+	uint8_t *buf;
+
+	while (buckets < n)
+		buckets <<= 1;
+	dedup.refs = calloc(n, sizeof(uint32_t));
+	dedup.hash = malloc(n * sizeof(uint64_t));
+	dedup.next = calloc(n, sizeof(uint32_t));
+	dedup.buckets = calloc(buckets, sizeof(uint32_t));
+	dedup.scratch = block_alloc(geom.blockSize);
+	dedup.mask = buckets - 1;
+	if (batch == 0)
+		batch = 1;
+	buf = block_alloc((size_t)batch << geom.blockShift);
+	if (!dedup.refs || !dedup.hash || !dedup.next || !dedup.buckets ||
+	    !dedup.scratch || !buf)
+		goto err;
+
+	for (size_t i = 0; i < rdCount; i++) {
+		uint32_t left = blkCount(rd[i].fileSize), blk = rdFirst(i);
+		uint32_t *entries = (uint32_t*)dedup.scratch;
+
+		if (rd[i].filename[0] == '\0' || !(rd[i].flags & RD_DEDUP))
+			continue;
+		for (; left; blk = fatGet(blk)) {
+			uint32_t k = left < per ? left : per;
+
+			if (blk == FAT_EOC ||
+			    devRead(geom.dataBlockStart + blk, dedup.scratch))
+				goto err;
+			for (uint32_t e = 0; e < k; e++) {
+				if (entries[e] == DZERO) {
+					dedup.zeros++;
+					continue;
+				}
+				if (entries[e] >= n || fatGet(entries[e]) != FAT_EOC)
+					goto err;
+				if (dedup.refs[entries[e]]++ == 0)
+					dedup.used++;
+				dedup.refTotal++;
+			}
+			left -= k;
+		}
+	}
+
+	for (uint32_t blk = 1, k; blk < n; blk += k) {
+		for (k = 0; k < batch && blk + k < n && dedup.refs[blk + k]; k++)
+			;
+		if (k == 0) {
+			k = 1;
+			continue;
+		}
+		if (devReadMulti(geom.dataBlockStart + blk, k, buf))
+			goto err;
+		for (uint32_t i = 0; i < k; i++) {
+			dedup.hash[blk + i] = hash64(buf + ((size_t)i <<
+						     geom.blockShift),
+						     geom.blockSize);
+			dedupInsert(blk + i);
+		}
+	}
+	free(buf);
+	return 0;
+
+err:
+	free(buf);
+	dedupFree();
+	return -1;
+}
+
+static void dFree(struct dFile *d)
+{
+	if (!d)
+		return;
+	free(d->index);
+	free(d->idxBlk);
+	free(d->dirty);
+	free(d);
+}
+
+/* load the index of deduplicated file @rIn */
+static struct dFile *dOpen(int rIn)
+{
+	struct dFile *d = calloc(1, sizeof(*d));
+	uint32_t blk = rdFirst(rIn);
+
+	if (!d)
+		return NULL;
+	d->idxBlocks = blkCount((size_t)blkCount(rd[rIn].fileSize) *
+				sizeof(uint32_t));
+	/* the arrays have room for one more index block, see dIndexGrow() */
+	d->index = block_alloc(((size_t)d->idxBlocks + 1) << geom.blockShift);
+	d->idxBlk = malloc((d->idxBlocks + 1) * sizeof(uint32_t));
+	d->dirty = calloc(d->idxBlocks + 1, 1);
+	if (!d->index || !d->idxBlk || !d->dirty)
+		goto err;
+	for (uint32_t i = 0; i < d->idxBlocks; i++, blk = fatGet(blk)) {
+		if (blk == FAT_EOC ||
+		    devRead(geom.dataBlockStart + blk, dIndexBlock(d, i)))
+			goto err;
+		d->idxBlk[i] = blk;
+	}
+	return d;
+
+err:
+	dFree(d);
+	return NULL;
+}
+
+/* write back the modified index blocks of deduplicated file @d */
+static int dFlush(struct dFile *d)
+{
+	int ret = 0;
+
+	for (uint32_t i = 0; i < d->idxBlocks; i++) {
+		if (!d->dirty[i])
+			continue;
+		if (devWrite(geom.dataBlockStart + d->idxBlk[i],
+			     dIndexBlock(d, i)))
+			ret = -1;
+		d->dirty[i] = 0;
+	}
+	return ret;
+}
+
+/* append a block to the index of deduplicated file @rIn */
+static int dIndexGrow(int rIn, struct dFile *d)
+{
+	size_t len = ((size_t)d->idxBlocks + 1) << geom.blockShift;
+	uint32_t *index = block_alloc(len + geom.blockSize);
+	uint32_t *idxBlk = realloc(d->idxBlk,
+				   (d->idxBlocks + 2) * sizeof(uint32_t));
+	uint8_t *dirty = realloc(d->dirty, d->idxBlocks + 2);
+	uint32_t blk, last;
+
+	if (idxBlk)
+		d->idxBlk = idxBlk;
+	if (dirty)
+		d->dirty = dirty;
+	if (!index || !idxBlk || !dirty || fatFreeCount(1) < 1) {
+		free(index);
+		return -1;
+	}
+	memcpy(index, d->index, len);
+	free(d->index);
+	d->index = index;
+
+	blk = fatAllocChain(1, &last);
+	if (d->idxBlocks == 0)
+		rdSetFirst(rIn, blk);
+	else
+		fatSet(d->idxBlk[d->idxBlocks - 1], blk);
+	d->dirty[d->idxBlocks] = 1;
+	d->idxBlk[d->idxBlocks++] = blk;
+	return 0;
+}
+
+/*
+ * dWriteBlock - store the @bs bytes of @data as block @b of deduplicated file
+ * @rIn
+ *
+ * All-zero data is only recorded in the index. Other data is looked up in the
+ * content index first and, if found, the block is shared. Otherwise it
+ * replaces the old content of the block in place when no other file uses it,
+ * or goes to a newly allocated block.
+ */
+static int dWriteBlock(int rIn, struct dFile *d, uint32_t b,
+		       const uint8_t *data)
+{
+	int had = b < blkCount(rd[rIn].fileSize);
+	int zero = block_is_zero(data, geom.blockSize);
+	uint32_t old = had ? d->index[b] : DZERO, blk, last;
+	uint64_t h = zero ? 0 : hash64(data, geom.blockSize);
+
+	if (!had && b >= d->idxBlocks * dPerBlock() && dIndexGrow(rIn, d))
+		return -1;
+
+	if (zero) {
+		blk = DZERO;
+		dedup.zeros++;
+	} else if ((blk = dedupFind(h, data))) {
+		dedup.refs[blk]++;
+		dedup.refTotal++;
+	} else if (old != DZERO && dedup.refs[old] == 1) {
+		/* not shared, overwrite it */
+		dedupRemove(old);
+		if (devWrite(geom.dataBlockStart + old, data)) {
+			dedupInsert(old);
+			return -1;
+		}
+		dedup.hash[old] = h;
+		dedupInsert(old);
+		return 0;
+	} else {
+		if (fatFreeCount(1) < 1)
+			return -1;
+		blk = fatAllocChain(1, &last);
+		if (devWrite(geom.dataBlockStart + blk, data)) {
+			fatReleaseChains(&blk, 1);
+			return -1;
+		}
+		dedup.refs[blk] = 1;
+		dedup.refTotal++;
+		dedup.used++;
+		dedup.hash[blk] = h;
+		dedupInsert(blk);
+	}
+
+	d->index[b] = blk;
+	d->dirty[b / dPerBlock()] = 1;
+	if (had)
+		dedupUnref(old);
+	return 0;
+}
+
+/* read block @b of deduplicated file @d into @data */
+static int dReadBlock(struct dFile *d, uint32_t b, uint8_t *data)
+{
+	if (d->index[b] == DZERO) {
+		memset(data, 0, geom.blockSize);
+		return 0;
+	}
+	return devRead(geom.dataBlockStart + d->index[b], data);
+}
+
+/*
+ * dIO - fileIO() of a deduplicated file, one block at a time
+ *
+ * Whole blocks move straight between the disk and the user buffers, partial
+ * blocks and blocks spanning two buffers go through a bounce buffer. All-zero
+ * blocks are not read from the disk.
+ */
+static int dIO(int rIn, size_t offset, size_t total, const struct iovec *iov,
+	       int iovcnt, int write)
+{
+	struct dFile *d = rdOpen[rIn]->d;
+	size_t done = 0, vp = 0;
+	uint8_t *bounce = NULL;
+	int vi = 0;
+
+	while (done < total) {
+		size_t pos = offset + done, boff = blkOffset(pos), chunk;
+		uint32_t b = blkIndex(pos);
+		uint8_t *data;
+
+		iovSkipEmpty(iov, iovcnt, &vi, &vp);
+		if (boff == 0 && total - done >= geom.blockSize &&
+		    iov[vi].iov_len - vp >= geom.blockSize) {
+			data = (uint8_t*)iov[vi].iov_base + vp;
+			chunk = geom.blockSize;
+			if (write ? dWriteBlock(rIn, d, b, data) :
+			    dReadBlock(d, b, data))
+				break;
+			vp += chunk;
+		} else {
+			chunk = geom.blockSize - boff;
+			if (chunk > total - done)
+				chunk = total - done;
+			if (!bounce && !(bounce = bounceGet()))
+				break;
+			if (b < blkCount(rd[rIn].fileSize)) {
+				if (dReadBlock(d, b, bounce))
+					break;
+			} else {
+				memset(bounce, 0, geom.blockSize);
+			}
+			iovCopy(iov, &vi, &vp, bounce + boff, chunk, !write);
+			if (write && dWriteBlock(rIn, d, b, bounce))
+				break;
+		}
+		done += chunk;
+		if (write && pos + chunk > rd[rIn].fileSize)
+			rd[rIn].fileSize = pos + chunk;
+	}
+
+	if (!write && done == 0)
+		return -1;
+	return done;
+}
+
+/* shrink deduplicated file @rIn to @length bytes, dropping the references to
+ * the blocks past the new end and freeing the index blocks left empty */
+static int dTruncate(int rIn, struct dFile *d, size_t length)
+{
+	uint32_t keep = blkCount(length), n = blkCount(rd[rIn].fileSize);
+	uint32_t idx = blkCount((size_t)keep * sizeof(uint32_t)), blk;
+
+	for (uint32_t b = keep; b < n; b++)
+		dedupUnref(d->index[b]);
+	if (idx < d->idxBlocks) {
+		blk = d->idxBlk[idx];
+		if (idx == 0)
+			rdSetFirst(rIn, FAT_EOC);
+		else
+			fatSet(d->idxBlk[idx - 1], FAT_EOC);
+		fatReleaseChains(&blk, 1);
+		d->idxBlocks = idx;
+	}
+	rd[rIn].fileSize = length;
+	return 0;
+}
+
+/* drop the references of closed deduplicated file @rIn to its data blocks */
+static int dRelease(int rIn)
+{
+	struct dFile *d = dOpen(rIn);
+	uint32_t n = blkCount(rd[rIn].fileSize);
+
+	if (!d)
+		return -1;
+	for (uint32_t b = 0; b < n; b++)
+		dedupUnref(d->index[b]);
+	dFree(d);
+	return 0;
+}
+
+/*
+ * fileIO - transfer between file @rIn at @offset and the buffers of @iov
+ *
+ * The FAT chain is walked once, from the first block of the file to the block
+ * holding @offset, and then followed along the transfer. Whole blocks that
+ * are physically consecutive on disk and land in one user buffer are moved
+ * with a single block_read_multi()/block_write_multi() straight from/to that
+ * buffer; partial blocks and blocks straddling two buffers go through a
+ * bounce buffer. Writes past the end of the chain reserve all the blocks they
+ * still need at once (see fileReserve()) and stop early when the disk is full.
+ * Reads stop early at an I/O or checksum error.
+ * Returns the number of bytes transferred, or -1.
+ */
+static int fileIO(int rIn, size_t offset, const struct iovec *iov, int iovcnt,
+		  int write)
+{
+	size_t size = rd[rIn].fileSize, total = 0, done = 0, vp = 0;
+	uint32_t blk, prev = FAT_EOC;
+	uint8_t *bounce = NULL;
+	int vi = 0;
+
+	if (iovcnt < 0 || (iovcnt && iov == NULL))
+		return -1;
+	for (int i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_base == NULL && iov[i].iov_len)
+			return -1;
+		total += iov[i].iov_len;
+	}
+	if (total > INT_MAX)
+		total = INT_MAX;
+
+	if (write) {
+		/* files have no holes */
+		if (offset > size)
+			return -1;
+		if (total > UINT32_MAX - offset)
+			total = UINT32_MAX - offset;
+	} else {
+		if (offset >= size)
+			return 0;
+		if (total > size - offset)
+			total = size - offset;
+	}
+	if (total == 0)
+		return 0;
+	if (rd[rIn].flags & RD_COMPRESSED)
+		return zIO(rIn, offset, total, iov, iovcnt, write);
+	if (rd[rIn].flags & RD_DEDUP)
+		return dIO(rIn, offset, total, iov, iovcnt, write);
+
+	/* resolve the block holding @offset */
+	blk = rdFirst(rIn);
+	for (size_t n = blkIndex(offset); n && blk != FAT_EOC; n--) {
+		prev = blk;
+		blk = fatGet(blk);
+	}
+
+	while (done < total) {
+		size_t pos = offset + done, boff = blkOffset(pos), chunk;
+
+		if (blk == FAT_EOC) {
+			if (!write ||
+			    !fileReserve(rIn, prev, blkCount(boff + total - done)))
+				break;
+			blk = prev == FAT_EOC ? rdFirst(rIn) : fatGet(prev);
+		}
+
+		iovSkipEmpty(iov, iovcnt, &vi, &vp);
+		size_t seg = iov[vi].iov_len - vp;
+		if (seg > total - done)
+			seg = total - done;
+
+		if (boff == 0 && seg >= geom.blockSize) {
+			/* direct transfer of a run of consecutive blocks */
+			size_t n = 1, max = blkIndex(seg);
+			uint32_t last = blk, next;
+			uint8_t *base = (uint8_t*)iov[vi].iov_base + vp;
+
+			while (n < max) {
+				next = fatGet(last);
+				if (next == FAT_EOC && write) {
+					fileReserve(rIn, last, blkCount(total -
+						done - (n << geom.blockShift)));
+					next = fatGet(last);
+				}
+				if (next != last + 1)
+					break;
+				last = next;
+				n++;
+			}
+			if (write ?
+			    devWriteMulti(geom.dataBlockStart + blk, n, base) :
+			    devReadMulti(geom.dataBlockStart + blk, n, base))
+				break;
+			chunk = n << geom.blockShift;
+			vp += chunk;
+			prev = last;
+			blk = fatGet(last);
+		} else {
+			/* partial block, or block spanning two user buffers */
+			chunk = geom.blockSize - boff;
+			if (chunk > total - done)
+				chunk = total - done;
+			if (!bounce && !(bounce = bounceGet()))
+				break;
+			/* a write only needs the old content if some of it is
+			 * kept, before or after the written range. Otherwise
+			 * the block tail past the end of file is zeroed, not
+			 * left over from an earlier transfer of the buffer */
+			if (!write || boff || pos + chunk < size) {
+				if (devRead(geom.dataBlockStart + blk, bounce))
+					break;
+			} else {
+				memset(bounce + chunk, 0,
+				       geom.blockSize - chunk);
+			}
+			iovCopy(iov, &vi, &vp, bounce + boff, chunk, !write);
+			if (write &&
+			    devWrite(geom.dataBlockStart + blk, bounce))
+				break;
+			if (boff + chunk == geom.blockSize) {
+				prev = blk;
+				blk = fatGet(blk);
+			}
+		}
+		done += chunk;
+	}
+
+	if (write && offset + done > size)
+		rd[rIn].fileSize = offset + done;
+	/* a short read is only ever due to an error */
+	if (!write && done == 0)
+		return -1;
+	return done;
+}
+
+static int doTruncate(int fd, size_t length)
+{
+	int rIn = fdWriteEntry(fd);
+	uint32_t blk, prev = FAT_EOC, last;
+	size_t size;
+
+	if (rIn < 0 || length > UINT32_MAX)
+		return -1;
+	size = rd[rIn].fileSize;
+	if (length <= size && rdOpen[rIn]->z)
+		return zTruncate(rIn, rdOpen[rIn]->z, length);
+	if (length <= size && rdOpen[rIn]->d)
+		return dTruncate(rIn, rdOpen[rIn]->d, length);
+
+	if (length > size) {
+		/* files have no holes, the new bytes are written as zeros. Check
+		 * the free space first so that the file is not half extended */
+		size_t chunk = length - size < (1 << 20) ? length - size : 1 << 20;
+		uint32_t have = fileChain(rIn, &last), want;
+		struct iovec iov;
+		int ret;
+
+		want = blkCount(length) > have ? blkCount(length) - have : 0;
+		/* compressed and deduplicated files allocate space as they
+		 * are written */
+		if (!rdOpen[rIn]->z && !rdOpen[rIn]->d &&
+		    want > fatFreeCount(want))
+			return -1;
+		iov.iov_base = block_alloc(chunk);
+		if (!iov.iov_base)
+			return -1;
+		memset(iov.iov_base, 0, chunk);
+		while (size < length) {
+			iov.iov_len = length - size < chunk ? length - size : chunk;
+			if ((ret = fileIO(rIn, size, &iov, 1, 1)) <= 0)
+				break;
+			size += ret;
+		}
+		free(iov.iov_base);
+		return size == length ? 0 : -1;
+	}
+
+	/* keep the blocks holding @length bytes, free the rest of the chain */
+	blk = rdFirst(rIn);
+	for (uint32_t n = blkCount(length); n && blk != FAT_EOC; n--) {
+		prev = blk;
+		blk = fatGet(blk);
+	}
+	if (prev == FAT_EOC)
+		rdSetFirst(rIn, FAT_EOC);
+	else
+		fatSet(prev, FAT_EOC);
+	fatReleaseChains(&blk, 1);
+	rd[rIn].fileSize = length;
+	return 0;
+}
+
+static int doFallocate(int fd, size_t length)
+{
+	int rIn = fdWriteEntry(fd);
+	uint32_t have, want, last;
+
+	/* the size of compressed or shared data is not known in advance */
+	if (rIn < 0 || length > UINT32_MAX || rdOpen[rIn]->z || rdOpen[rIn]->d)
+		return -1;
+
+	have = fileChain(rIn, &last);
+	want = blkCount(length);
+	if (want <= have)
+		return 0;
+	if (want - have > fatFreeCount(want - have))
+		return -1;
+	fileReserve(rIn, last, want - have);
+	return 0;
+}
+
+/* number of extents (runs of physically consecutive blocks) of the chain
+ * starting at @blk */
+static uint32_t chainExtents(uint32_t blk)
+{
+	uint32_t extents = 0, next;
+
+	for (; blk != FAT_EOC; blk = next) {
+		next = fatGet(blk);
+		if (next != blk + 1)
+			extents++;
+	}
+	return extents;
+}
+
+/*
+ * fileRelocate - move the @n blocks of the chain of root directory entry @rIn
+ * to the free run starting at @dst
+ *
+ * The data blocks are gathered from the source extents into @buf, which holds
+ * @batch blocks, and written to the destination run with one block write per
+ * batch. Only once all the data is copied is the file switched over to its new
+ * chain and the old one freed, so a failed copy leaves the file untouched.
+ */
+static int fileRelocate(int rIn, uint32_t n, uint32_t dst, uint8_t *buf,
+			uint32_t batch)
+{
+	uint32_t blk = rdFirst(rIn), old = blk, done = 0, fill, start, k;
+	uint32_t data = blkCount(rd[rIn].fileSize);
+
+	/* all the blocks of compressed files hold data, and all the ones of
+	 * deduplicated files their index */
+	if (rd[rIn].flags & (RD_COMPRESSED | RD_DEDUP))
+		data = n;
+	/* reserved blocks past the end of the file have no data to move */
+	if (data > n)
+		return -1;
+	while (done < data) {
+		for (fill = 0; fill < batch && done + fill < data; fill += k) {
+			if (blk == FAT_EOC)
+				return -1;
+			for (start = blk, k = 1; fill + k < batch &&
+			     done + fill + k < data && fatGet(blk) == blk + 1; k++)
+				blk++;
+			if (devReadMulti(geom.dataBlockStart + start, k,
+					     buf + ((size_t)fill << geom.blockShift)))
+				return -1;
+			blk = fatGet(blk);
+		}
+		if (devWriteMulti(geom.dataBlockStart + dst + done, fill, buf))
+			return -1;
+		done += fill;
+	}
+
+	fatLinkRun(dst, n);
+	rdSetFirst(rIn, dst);
+	fatReleaseChains(&old, 1);
+	return 0;
+}
+
+static int doDefrag(size_t maxBlocks)
+{
+	uint32_t batch = DEFRAG_BATCH_BYTES >> geom.blockShift, n, dst, last;
+	size_t moved = 0;
+	uint8_t *buf;
+
+	if (MOUNTED == -1)
+		return -1;
+	if (batch == 0)
+		batch = 1;
+	buf = block_alloc((size_t)batch << geom.blockShift);
+	if (!buf)
+		return -1;
+	/* freed space of deleted files can hold relocated files */
+	fatReclaim(reclaim.count);
+
+	for (; defragNext < rdCount; defragNext++) {
+		/* open compressed and deduplicated files have block numbers
+		 * cached */
+		if (rd[defragNext].filename[0] == '\0' ||
+		    (rdOpen[defragNext] && (rdOpen[defragNext]->z ||
+					    rdOpen[defragNext]->d)) ||
+		    chainExtents(rdFirst(defragNext)) <= 1)
+			continue;
+		n = fileChain(defragNext, &last);
+		/* always make progress, even if a file exceeds the budget */
+		if (maxBlocks && moved && moved + n > maxBlocks)
+			break;
+		/* files that no free run can hold are left as they are */
+		if (fatFindRun(n, &dst) < n)
+			continue;
+		if (fileRelocate(defragNext, n, dst, buf, batch)) {
+			free(buf);
+			return -1;
+		}
+		moved += n;
+	}
+	/* a call that reaches the end of the root directory completes a pass,
+	 * the next one starts over */
+	if (defragNext == rdCount)
+		defragNext = 0;
+	free(buf);
+	return moved;
+}
+
+/* histogram bucket of @n > 0, floor(log2(@n)) */
+static int histBucket(uint32_t n)
+{
+	int b = 0;
+
+	while (n >>= 1)
+		b++;
+	return b;
+}
+
+static int doInfoGet(struct fs_info_stats *st)
+{
+	uint32_t run = 0;
+
+	if (MOUNTED == -1 || st == NULL)
+		return -1;
+	fatReclaim(reclaim.count);
+
+	memset(st, 0, sizeof(*st));
+	st->total_blk_count = geom.totalBlocks;
+	st->fat_blk_count = geom.fatBlocks;
+	st->rdir_blk = geom.rootBlockIndex;
+	st->rdir_blk_count = geom.rootBlocks;
+	st->data_blk = geom.dataBlockStart;
+	st->data_blk_count = geom.dataBlockCt;
+	st->blk_size = geom.blockSize;
+	st->fat_entry_bits = fat.wide ? 32 : 16;
+	st->csum_blk_count = geom.csumBlocks;
+	st->fat_free = fat.freeCt;
+	st->rdir_count = rdCount;
+	st->dedup_ref_count = dedup.refTotal;
+	st->dedup_blk_count = dedup.used;
+	st->zero_blk_count = dedup.zeros;
+	pthread_mutex_lock(&bounce.lock);
+	st->bounce_blk_count = bounce.count;
+	pthread_mutex_unlock(&bounce.lock);
+	st->used_blk_count = st->dedup_blk_count;
+
+	/* free space, in one pass over the FAT in block order */
+	for (uint32_t i = 1; i <= geom.dataBlockCt; i++) {
+		if (i < geom.dataBlockCt && fatGet(i) == 0) {
+			run++;
+			continue;
+		}
+		if (run) {
+			st->free_extent_count++;
+			st->free_extent_hist[histBucket(run)]++;
+			if (run > st->largest_free_extent)
+				st->largest_free_extent = run;
+		}
+		run = 0;
+	}
+
+	/* files, following each chain once; inside an extent, the FAT entries
+	 * are read in order too */
+	for (size_t i = 0; i < rdCount; i++) {
+		uint32_t blk, next, len = 0, extents = 0, data;
+
+		if (rd[i].filename[0] == '\0') {
+			st->rdir_free++;
+			continue;
+		}
+		st->file_count++;
+		for (blk = rdFirst(i); blk != FAT_EOC; blk = next) {
+			next = fatGet(blk);
+			if (next != blk + 1)
+				extents++;
+			len++;
+		}
+		data = blkCount(rd[i].fileSize);
+		if (rd[i].flags & RD_COMPRESSED) {
+			st->compressed_count++;
+			st->compressed_bytes += rd[i].fileSize;
+			st->compressed_blk_count += len;
+			data = len;
+		} else {
+			st->slack_bytes += ((size_t)data << geom.blockShift) -
+				rd[i].fileSize;
+		}
+		/* the chain of a deduplicated file is its index */
+		if (rd[i].flags & RD_DEDUP) {
+			st->dedup_count++;
+			data = len;
+		}
+		if (len == 0)
+			continue;
+		st->used_blk_count += len;
+		if (len > data)
+			st->reserved_blk_count += len - data;
+		st->extent_count += extents;
+		if (extents > st->max_file_extents)
+			st->max_file_extents = extents;
+		if (extents > 1)
+			st->fragmented_count++;
+		st->extent_hist[histBucket(extents)]++;
+		st->chain_hist[histBucket(len)]++;
+	}
+	return 0;
+}
+
+static int doStatfs(struct fs_statfs *st)
+{
+	if (MOUNTED == -1 || st == NULL)
+		return -1;
+	/* report the blocks of deleted files as free */
+	fatReclaim(reclaim.count);
+
+	st->blk_size = geom.blockSize;
+	st->data_blk_count = geom.dataBlockCt;
+	st->free_blk_count = fat.freeCt;
+	st->file_count = FILE_COUNT;
+	st->file_max = rdCount;
+	return 0;
+}
+
+static int doFragReport(struct fs_frag_report *report)
+{
+	struct fs_info_stats st;
+
+	if (report == NULL || doInfoGet(&st))
+		return -1;
+
+	/* only the files holding data blocks have extents */
+	report->file_count = 0;
+	for (int i = 0; i < FS_INFO_HIST_BUCKETS; i++)
+		report->file_count += st.chain_hist[i];
+	report->extent_count = st.extent_count;
+	report->fragmented_count = st.fragmented_count;
+	report->free_blk_count = st.fat_free;
+	report->free_run_count = st.free_extent_count;
+	report->largest_free_run = st.largest_free_extent;
+	return 0;
+}
+
+/*
+ * Calls that only read the file system run concurrently, without taking
+ * fsLock. Each reader counts itself in a slot of its own cache line, so that
+ * readers on different CPUs never write the same memory. A writer takes fsLock
+ * and raises writerActive, which sends new readers to wait on fsLock; then it
+ * waits for the slots to drain, a grace period after which no reader is left
+ * to see what it modifies. Readers cannot become writers: a reader needing to
+ * modify something leaves and starts over as a writer.
+ */
+
+/* with fsLock held, wait for the readers to leave and keep new ones out */
+static void readersBlock(void)
+{
+	uint32_t used;
+
+	/* slots are counted after the flag is up: a thread taking its first
+	 * slot later sees the flag when it checks it, see fsLockShared() */
+	__atomic_store_n(&writerActive, 1, __ATOMIC_SEQ_CST);
+	used = __atomic_load_n(&readerSlotsUsed, __ATOMIC_SEQ_CST);
+	for (uint32_t i = 0; i < used && i < READER_SLOTS; i++) {
+		while (__atomic_load_n(&readerSlots[i].count, __ATOMIC_SEQ_CST))
+			sched_yield();
+	}
+}
+
+static void readersAllow(void)
+{
+	__atomic_store_n(&writerActive, 0, __ATOMIC_RELEASE);
+}
+
+static void fsLockExclusive(void)
+{
+	pthread_mutex_lock(&fsLock);
+	readersBlock();
+}
+
+static void fsUnlockExclusive(void)
+{
+	readersAllow();
+	pthread_mutex_unlock(&fsLock);
+}
+
+static void fsLockShared(void)
+{
+	struct readerSlot *slot;
+
+	if (readerSlot < 0)
+		readerSlot = __atomic_fetch_add(&readerSlotsUsed, 1,
+						__ATOMIC_SEQ_CST) % READER_SLOTS;
+	slot = &readerSlots[readerSlot];
+	__atomic_fetch_add(&slot->count, 1, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&writerActive, __ATOMIC_SEQ_CST))
+		return;
+
+	/* no writer is active while fsLock is held */
+	__atomic_fetch_sub(&slot->count, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&fsLock);
+	__atomic_fetch_add(&slot->count, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&fsLock);
+}
+
+static void fsUnlockShared(void)
+{
+	__atomic_fetch_sub(&readerSlots[readerSlot].count, 1, __ATOMIC_RELEASE);
+}
+
+/* take the file system lock, and the call start time if tracing is on */
+static inline uint64_t fsEnter(void)
+{
+	fsLockExclusive();
+	return trace_enabled ? trace_now() : 0;
+}
+
+/* record the call in the trace and release the file system lock */
+static inline int fsLeave(enum trace_op op, uint64_t start, int fd, int ret,
+			  size_t offset, const char *name)
+{
+	if (trace_enabled)
+		trace_record(op, start, fd, ret, offset, 0, 0, name);
+	fsUnlockExclusive();
+	return ret;
+}
+
+/* same as fsEnter() and fsLeave(), for the calls that only read */
+static inline uint64_t fsEnterShared(void)
+{
+	fsLockShared();
+	return trace_enabled ? trace_now() : 0;
+}
+
+static inline int fsLeaveShared(enum trace_op op, uint64_t start, int fd,
+				int ret, size_t offset, const char *name)
+{
+	if (trace_enabled)
+		trace_record(op, start, fd, ret, offset, 0, 0, name);
+	fsUnlockShared();
+	return ret;
+}
+
+/* whether a transfer at @offset (or at the offset of @fd if not @positional)
+ * only covers whole blocks */
+static int blkAligned(size_t offset, int positional, int fd,
+		      const struct iovec *iov, int iovcnt)
+{
+	if (!positional)
+		offset = (fdir[fd].flags & FS_O_APPEND) ?
+			rd[fdir[fd].file->rIn].fileSize : fdir[fd].offset;
+	if (blkOffset(offset))
+		return 0;
+	for (int i = 0; iov && i < iovcnt; i++) {
+		if (blkOffset(iov[i].iov_len))
+			return 0;
+	}
+	return 1;
+}
+
+/* common path of all read and write calls, @op tells which one */
+static int fdIO(enum trace_op op, int fd, const struct iovec *iov, int iovcnt,
+		size_t offset)
+{
+	int positional = op == TRACE_PWRITE || op == TRACE_PREAD;
+	int write = op == TRACE_WRITE || op == TRACE_PWRITE ||
+		op == TRACE_WRITEV;
+	int shared = !write;
+	uint64_t start = shared ? fsEnterShared() : fsEnter();
+	int rIn = write ? fdWriteEntry(fd) : fdEntry(fd), ret = -1;
+	pthread_mutex_t *fdLock = NULL;
+
+	/* reads of compressed files go through the cluster cache of the file */
+	if (shared && rIn >= 0 && rdOpen[rIn]->z) {
+		fsUnlockShared();
+		fsLockExclusive();
+		shared = 0;
+		rIn = fdEntry(fd);
+	}
+	if (shared && !positional && rIn >= 0) {
+		fdLock = &fdLocks[fd % FD_LOCKS].lock;
+		pthread_mutex_lock(fdLock);
+	}
+
+	/* FS_O_DIRECT transfers cover whole blocks, which move straight between
+	 * the disk and the user buffers */
+	if (rIn >= 0 && (fdir[fd].flags & FS_O_DIRECT) &&
+	    !blkAligned(offset, positional, fd, iov, iovcnt))
+		rIn = -1;
+	if (rIn >= 0) {
+		if (write && !positional && (fdir[fd].flags & FS_O_APPEND))
+			fdir[fd].offset = rd[rIn].fileSize;
+		if (!positional)
+			offset = fdir[fd].offset;
+		ret = fileIO(rIn, offset, iov, iovcnt, write);
+		if (ret > 0 && !positional)
+			fdir[fd].offset += ret;
+	}
+
+	if (trace_enabled) {
+		size_t size = 0;
+
+		for (int i = 0; iov && i < iovcnt; i++)
+			size += iov[i].iov_len;
+		trace_record(op, start, fd, ret, offset, size, iovcnt, NULL);
+	}
+	if (fdLock)
+		pthread_mutex_unlock(fdLock);
+	if (shared)
+		fsUnlockShared();
+	else
+		fsUnlockExclusive();
+	return ret;
+}
+
+/*
+ * Public entry points. Each one runs under the file system lock, shared by the
+ * calls that only read, and records itself in the trace when tracing is on
+ * (see fs_trace_start()). A NULL @buf is handed to fileIO() as a NULL
+ * iovec array, which it rejects.
+ */
+
+int fs_mount(const char *diskname)
+{
+	return fs_mount_flags(diskname, 0);
+}
+
+int fs_mount_flags(const char *diskname, int flags)
+{
+	/* FS_TRACE=<trace file> records an application without changing it */
+	if (!trace_enabled && getenv("FS_TRACE"))
+		fs_trace_start(getenv("FS_TRACE"));
+
+	uint64_t start = fsEnter();
+	return fsLeave(TRACE_MOUNT, start, -1, doMount(diskname, flags), flags,
+		       NULL);
+}
+
+int fs_umount(void)
+{
+	uint64_t start = fsEnter();
+	int ret = fsLeave(TRACE_UMOUNT, start, -1, doUmount(), 0, NULL);
+
+	pthread_mutex_lock(&fsLock);
+	trace_flush();
+	pthread_mutex_unlock(&fsLock);
+	return ret;
+}
+
+int fs_info(void)
+{
+	uint64_t start = fsEnter();
+	return fsLeave(TRACE_INFO, start, -1, doInfo(), 0, NULL);
+}
+
+int fs_create(const char *filename)
+{
+	uint64_t start = fsEnter();
+	return fsLeave(TRACE_CREATE, start, -1, doCreate(filename), 0, filename);
+}
+
+int fs_delete(const char *filename)
+{
+	uint64_t start = fsEnter();
+	return fsLeave(TRACE_DELETE, start, -1, doDelete(filename), 0, filename);
+}
+
+int fs_ls(void)
+{
+	uint64_t start = fsEnterShared();
+	return fsLeaveShared(TRACE_LS, start, -1, doLs(), 0, NULL);
+}
+
+int fs_open(const char *filename)
+{
+	uint64_t start = fsEnter();
+	return fsLeave(TRACE_OPEN, start, -1, doOpen(filename, 0), 0, filename);
+}
+
+int fs_open_flags(const char *filename, int flags)
+{
+	uint64_t start = fsEnter();
+	return fsLeave(TRACE_OPEN, start, -1, doOpen(filename, flags), flags,
+		       filename);
+}
+
+int fs_close(int fd)
+{
+	uint64_t start = fsEnter();
+	return fsLeave(TRACE_CLOSE, start, fd, doClose(fd), 0, NULL);
+}
+
+int fs_stat(int fd)
+{
+	uint64_t start = fsEnterShared();
+	return fsLeaveShared(TRACE_STAT, start, fd, doStat(fd), 0, NULL);
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	uint64_t start = fsEnterShared();
+	pthread_mutex_t *fdLock = &fdLocks[(unsigned)fd % FD_LOCKS].lock;
+	int ret;
+
+	pthread_mutex_lock(fdLock);
+	ret = doLseek(fd, offset);
+	pthread_mutex_unlock(fdLock);
+	return fsLeaveShared(TRACE_LSEEK, start, fd, ret, offset, NULL);
+}
+
+int fs_truncate(int fd, size_t length)
+{
+	uint64_t start = fsEnter();
+	return fsLeave(TRACE_TRUNCATE, start, fd, doTruncate(fd, length), length,
+		      NULL);
+}
+
+int fs_fallocate(int fd, size_t length)
+{
+	uint64_t start = fsEnter();
+	return fsLeave(TRACE_FALLOCATE, start, fd, doFallocate(fd, length),
+		      length, NULL);
+}
+
+int fs_pwrite(int fd, void *buf, size_t count, size_t offset)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+
+	return fdIO(TRACE_PWRITE, fd, buf ? &iov : NULL, 1, offset);
+}
+
+int fs_pread(int fd, void *buf, size_t count, size_t offset)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+
+	return fdIO(TRACE_PREAD, fd, buf ? &iov : NULL, 1, offset);
+}
+
+int fs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	return fdIO(TRACE_WRITEV, fd, iov, iovcnt, 0);
+}
+
+int fs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	return fdIO(TRACE_READV, fd, iov, iovcnt, 0);
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+
+	return fdIO(TRACE_WRITE, fd, buf ? &iov : NULL, 1, 0);
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	struct iovec iov = { .iov_base = buf, .iov_len = count };
+
+	return fdIO(TRACE_READ, fd, buf ? &iov : NULL, 1, 0);
+}
+
+/* double-buffered chunked reader: a thread prefetches the next chunk with
+ * fs_pread() while the caller holds the current one */
+struct fs_iter {
+	int fd;
+	size_t chunk;
+	size_t offset;      /* file offset past the last delivered chunk */
+	size_t fillOffset;  /* file offset of the next prefetched chunk */
+	uint8_t *buf[2];
+	int len[2];         /* bytes in each buffer, <= 0 at the end */
+	int ready[2];
+	int fill;           /* buffer prefetched next */
+	int use;            /* buffer delivered next */
+	int held;           /* buffer the caller holds, or -1 */
+	int stop;
+	int threaded;       /* files of a single chunk are read synchronously */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void *iterMain(void *arg)
+{
+	struct fs_iter *it = arg;
+	int n;
+
+	pthread_mutex_lock(&it->lock);
+	for (;;) {
+		while (it->ready[it->fill] && !it->stop)
+			pthread_cond_wait(&it->cond, &it->lock);
+		if (it->stop)
+			break;
+		/* only this thread changes fill and fillOffset */
+		pthread_mutex_unlock(&it->lock);
+		n = fs_pread(it->fd, it->buf[it->fill], it->chunk,
+			     it->fillOffset);
+		pthread_mutex_lock(&it->lock);
+		it->len[it->fill] = n;
+		it->ready[it->fill] = 1;
+		pthread_cond_broadcast(&it->cond);
+		/* the end of the file, or an error, is delivered forever */
+		if (n <= 0)
+			break;
+		it->fillOffset += n;
+		it->fill ^= 1;
+	}
+	pthread_mutex_unlock(&it->lock);
+	return NULL;
+}
+
+struct fs_iter *fs_iter_open(int fd, size_t chunk)
+{
+	struct fs_iter *it;
+	size_t offset = 0, size = 0, bs = 0;
+	int rIn;
+
+	fsLockShared();
+	rIn = fdEntry(fd);
+	if (rIn >= 0) {
+		offset = fdir[fd].offset;
+		size = rd[rIn].fileSize;
+		bs = geom.blockSize;
+	}
+	fsUnlockShared();
+	if (rIn < 0)
+		return NULL;
+
+	if (chunk == 0)
+		chunk = FS_ITER_CHUNK;
+	chunk = (chunk + bs - 1) & ~(bs - 1);
+	if (chunk > INT_MAX)
+		return NULL;
+
+	it = calloc(1, sizeof(*it));
+	if (!it)
+		return NULL;
+	it->fd = fd;
+	it->chunk = chunk;
+	it->offset = it->fillOffset = offset;
+	it->held = -1;
+	it->buf[0] = block_alloc(chunk);
+	if (!it->buf[0]) {
+		free(it);
+		return NULL;
+	}
+
+	if (size > offset + chunk) {
+		it->buf[1] = block_alloc(chunk);
+		if (it->buf[1]) {
+			pthread_mutex_init(&it->lock, NULL);
+			pthread_cond_init(&it->cond, NULL);
+			it->threaded = !pthread_create(&it->thread, NULL,
+						       iterMain, it);
+			if (!it->threaded) {
+				pthread_cond_destroy(&it->cond);
+				pthread_mutex_destroy(&it->lock);
+			}
+		}
+	}
+	return it;
+}
+
+int fs_iter_next(struct fs_iter *it, const void **buf)
+{
+	int n;
+
+	if (!it || !buf)
+		return -1;
+
+	if (!it->threaded) {
+		n = fs_pread(it->fd, it->buf[0], it->chunk, it->offset);
+		if (n > 0)
+			*buf = it->buf[0];
+	} else {
+		pthread_mutex_lock(&it->lock);
+		/* hand the previous chunk back to the prefetching thread */
+		if (it->held >= 0) {
+			it->ready[it->held] = 0;
+			it->held = -1;
+			pthread_cond_broadcast(&it->cond);
+		}
+		while (!it->ready[it->use])
+			pthread_cond_wait(&it->cond, &it->lock);
+		n = it->len[it->use];
+		if (n > 0) {
+			*buf = it->buf[it->use];
+			it->held = it->use;
+			it->use ^= 1;
+		}
+		pthread_mutex_unlock(&it->lock);
+	}
+
+	if (n > 0) {
+		it->offset += n;
+		fs_lseek(it->fd, it->offset);
+	}
+	return n;
+}
+
+void fs_iter_close(struct fs_iter *it)
+{
+	if (!it)
+		return;
+
+	if (it->threaded) {
+		pthread_mutex_lock(&it->lock);
+		it->stop = 1;
+		pthread_cond_broadcast(&it->cond);
+		pthread_mutex_unlock(&it->lock);
+		pthread_join(it->thread, NULL);
+		pthread_cond_destroy(&it->cond);
+		pthread_mutex_destroy(&it->lock);
+	}
+	free(it->buf[0]);
+	free(it->buf[1]);
+	free(it);
+}
+
+/* filename pattern of fs_list() and fs_opendir() */
+struct dirPattern {
+	const char *glob;
+	size_t prefixLen;  /* characters before the first wildcard */
+	int prefixOnly;    /* the only wildcard is a final '*' */
+};
+
+static void dirPatternInit(struct dirPattern *p, const char *glob)
+{
+	p->glob = glob ? glob : "*";
+	p->prefixLen = strcspn(p->glob, "*?[\\");
+	p->prefixOnly = !strcmp(p->glob + p->prefixLen, "*");
+}
+
+/* 1 if the file at position @k of rdSorted matches @p, 0 if not, -1 if no
+ * file from @k on can match */
+static int dirMatch(const struct dirPattern *p, size_t k)
+{
+	const char *name = (char*)rd[rdSorted[k]].filename;
+
+	if (strncmp(name, p->glob, p->prefixLen))
+		return -1;
+	return p->prefixOnly || !fnmatch(p->glob, name, 0);
+}
+
+static void dirFill(struct fs_dirent *ent, uint32_t rIn)
+{
+	memcpy(ent->name, rd[rIn].filename, FS_FILENAME_LEN);
+	ent->name[FS_FILENAME_LEN - 1] = '\0';
+	ent->size = rd[rIn].fileSize;
+	ent->data_blk = rdFirst(rIn) == FAT_EOC ? FS_DIRENT_NO_BLK :
+		rdFirst(rIn);
+}
+
+static int doList(const char *pattern, struct fs_dirent *ents, size_t count)
+{
+	struct dirPattern p;
+	size_t n = 0;
+	int m;
+
+	if (MOUNTED == -1 || (ents == NULL && count))
+		return -1;
+	dirPatternInit(&p, pattern);
+	for (size_t k = rdSortedFind(p.glob, p.prefixLen, 0);
+	     k < (size_t)FILE_COUNT && (m = dirMatch(&p, k)) >= 0; k++) {
+		if (m && n++ < count)
+			dirFill(&ents[n - 1], rdSorted[k]);
+	}
+	return n;
+}
+
+int fs_list(const char *pattern, struct fs_dirent *ents, size_t count)
+{
+	uint64_t start = fsEnterShared();
+	return fsLeaveShared(TRACE_LIST, start, -1,
+			     doList(pattern, ents, count), count, pattern);
+}
+
+struct fs_dir {
+	struct dirPattern pattern;
+	char *glob;
+	char last[FS_FILENAME_LEN];  /* filename last returned */
+	int started;
+};
+
+struct fs_dir *fs_opendir(const char *pattern)
+{
+	struct fs_dir *dir = calloc(1, sizeof(*dir));
+
+	if (!dir)
+		return NULL;
+	if (pattern && !(dir->glob = strdup(pattern))) {
+		free(dir);
+		return NULL;
+	}
+	dirPatternInit(&dir->pattern, dir->glob);
+	return dir;
+}
+
+/* files are returned in filename order, each call resumes after the filename
+ * returned last, so files created or deleted in between are seen or not but
+ * never make the others returned twice or skipped */
+int fs_readdir(struct fs_dir *dir, struct fs_dirent *ent)
+{
+	int ret = -1, m;
+
+	if (!dir || !ent)
+		return -1;
+
+	fsLockShared();
+	if (MOUNTED != -1) {
+		size_t k = rdSortedFind(dir->pattern.glob,
+					dir->pattern.prefixLen, 0);
+
+		if (dir->started) {
+			size_t next = rdSortedFind(dir->last, FS_FILENAME_LEN, 1);
+
+			if (next > k)
+				k = next;
+		}
+		ret = 0;
+		for (; k < (size_t)FILE_COUNT &&
+		     (m = dirMatch(&dir->pattern, k)) >= 0; k++) {
+			if (!m)
+				continue;
+			dirFill(ent, rdSorted[k]);
+			memcpy(dir->last, ent->name, FS_FILENAME_LEN);
+			dir->started = 1;
+			ret = 1;
+			break;
+		}
+	}
+	fsUnlockShared();
+	return ret;
+}
+
+void fs_closedir(struct fs_dir *dir)
+{
+	if (!dir)
+		return;
+	free(dir->glob);
+	free(dir);
+}
+
+static int doReclaim(void)
+{
+	uint32_t freeCt = fat.freeCt;
+
+	if (MOUNTED == -1)
+		return -1;
+	fatReclaim(reclaim.count);
+	return fat.freeCt - freeCt;
+}
+
+int fs_defrag(size_t max_blocks)
+{
+	uint64_t start = fsEnter();
+	return fsLeave(TRACE_DEFRAG, start, -1, doDefrag(max_blocks), max_blocks,
+		       NULL);
+}
+
+int fs_info_get(struct fs_info_stats *stats)
+{
+	uint64_t start = fsEnter();
+	return fsLeave(TRACE_INFO_GET, start, -1, doInfoGet(stats), 0, NULL);
+}
+
+int fs_statfs(struct fs_statfs *st)
+{
+	uint64_t start = fsEnter();
+	return fsLeave(TRACE_STATFS, start, -1, doStatfs(st), 0, NULL);
+}
+
+int fs_frag_report(struct fs_frag_report *report)
+{
+	uint64_t start = fsEnter();
+	return fsLeave(TRACE_FRAG_REPORT, start, -1, doFragReport(report), 0,
+		       NULL);
+}
+
+int fs_reclaim(void)
+{
+	uint64_t start = fsEnter();
+	return fsLeave(TRACE_RECLAIM, start, -1, doReclaim(), 0, NULL);
+}
+
+/* background reclamation, frees a batch of chains per hold of the lock so
+ * that callers are never held up for long */
+static void *reclaimMain(void *arg)
+{
+	(void)arg;
+	fsLockExclusive();
+	while (reclaimRunning > 0) {
+		if (MOUNTED == -1 || reclaim.count == 0) {
+			readersAllow();
+			pthread_cond_wait(&reclaimCond, &fsLock);
+			readersBlock();
+			continue;
+		}
+		fatReclaim(RECLAIM_BATCH);
+		fsUnlockExclusive();
+		sched_yield();
+		fsLockExclusive();
+	}
+	fsUnlockExclusive();
+	return NULL;
+}
+
+int fs_reclaim_background(int enable)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&fsLock);
+	if (enable && reclaimRunning == 0) {
+		reclaimRunning = 1;
+		if (pthread_create(&reclaimThread, NULL, reclaimMain, NULL)) {
+			reclaimRunning = 0;
+			ret = -1;
+		}
+	} else if (!enable && reclaimRunning > 0) {
+		reclaimRunning = 0;
+		pthread_cond_signal(&reclaimCond);
+		pthread_mutex_unlock(&fsLock);
+		pthread_join(reclaimThread, NULL);
+		return 0;
+	}
+	pthread_mutex_unlock(&fsLock);
+	return ret;
+}
@@ -2,16 +2,100 @@
 #define _FS_H
 
 #include <stddef.h> /* for size_t definition */
+#include <sys/uio.h> /* for struct iovec definition */
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
 
-/** Maximum number of files in the root directory */
+/** Maximum number of files in a single-block root directory */
 #define FS_FILE_MAX_COUNT 128
 
-/** Maximum number of open files */
+/** Maximum number of files in a multi-block (hashed) root directory */
+#define FS_FILE_MAX_COUNT_EXT 65536
+
+/** Number of file descriptors available before the open-file table grows */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Maximum number of open file descriptors */
+#define FS_OPEN_MAX_COUNT_EXT 65536
+
+/** fs_mount_flags() flags */
+#define FS_MOUNT_DIRECT 0x1 /* bypass the host page cache, see disk.h */
+
+/** Default chunk size of fs_iter_open() */
+#define FS_ITER_CHUNK (64 * 1024)
+
+/** fs_open_flags() flags */
+#define FS_O_RDONLY 0x1 /* writes, fs_truncate() and fs_fallocate() fail */
+#define FS_O_APPEND 0x2 /* fs_write() and fs_writev() append to the file */
+#define FS_O_DIRECT 0x4 /* transfers must cover whole blocks, no bounce buffer */
+
+/**
+ * struct fs_format_opts - File system creation options
+ * @data_blk_count: Number of data blocks
+ * @file_count: Number of root directory entries. Up to %FS_FILE_MAX_COUNT, a
+ *              single-block root directory is created, which older versions of
+ *              this library can mount. Beyond that, the root directory spans
+ *              several blocks and is indexed by filename hash.
+ * @fat32: Use 32-bit FAT entries and block indices. This is selected
+ *         automatically when @data_blk_count is too large for a 16-bit FAT.
+ * @block_size: Block size in bytes, a power of two between %BLOCK_SIZE_MIN
+ *              and %BLOCK_SIZE_MAX (see disk.h), or 0 for %BLOCK_SIZE.
+ * @checksum: Keep a CRC32C checksum of every metadata and data block, in a
+ *            table placed after the root directory. Blocks are verified when
+ *            read and their checksum updated when written.
+ * @compress: Store the data of all the files compressed, in clusters of up to
+ *            64 KiB (see fs_open()).
+ * @dedup: Store each distinct data block once, shared by all the files and
+ *         file blocks with the same content. All-zero blocks are not stored.
+ *         Cannot be combined with @compress.
+ */
+struct fs_format_opts {
+	size_t data_blk_count;
+	size_t file_count;
+	int fat32;
+	size_t block_size;
+	int checksum;
+	int compress;
+	int dedup;
+};
+
+/**
+ * struct fs_frag_report - Fragmentation of a file system
+ * @file_count: Number of files holding at least one data block
+ * @extent_count: Number of extents (runs of physically consecutive data blocks)
+ *                of all these files. @extent_count / @file_count is the
+ *                average number of extents per file, 1 when there is no
+ *                fragmentation.
+ * @fragmented_count: Number of files made of more than one extent
+ * @free_blk_count: Number of free data blocks
+ * @free_run_count: Number of runs of consecutive free data blocks
+ * @largest_free_run: Length of the largest run of free data blocks, the largest
+ *                    file that can be stored contiguously
+ */
+struct fs_frag_report {
+	size_t file_count;
+	size_t extent_count;
+	size_t fragmented_count;
+	size_t free_blk_count;
+	size_t free_run_count;
+	size_t largest_free_run;
+};
+
+/**
+ * fs_format - Create a file system
+ * @diskname: Name of the virtual disk file
+ * @opts: Creation options
+ *
+ * Create virtual disk file @diskname (overwriting it if it exists) and write
+ * an empty file system on it, laid out according to @opts.
+ *
+ * Return: -1 if a file system is currently mounted, if @opts is invalid or
+ * does not fit on a virtual disk, or if the virtual disk file cannot be
+ * created. 0 otherwise.
+ */
+int fs_format(const char *diskname, const struct fs_format_opts *opts);
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -21,10 +105,29 @@
  * with fs_read() or written to it with fs_write().
  *
  * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
- * file system can be located. 0 otherwise.
+ * file system can be located, or if its superblock, FAT or root directory
+ * does not match its checksum. 0 otherwise.
  */
 int fs_mount(const char *diskname);
 
+/**
+ * fs_mount_flags - Mount a file system with flags
+ * @diskname: Name of the virtual disk file
+ * @flags: %FS_MOUNT_DIRECT, or 0
+ *
+ * Same as fs_mount(). With %FS_MOUNT_DIRECT, the virtual disk file is opened
+ * with O_DIRECT (see block_disk_open_flags()): block transfers bypass the page
+ * cache of the host, which large streaming transfers would otherwise fill.
+ * Reads and writes of whole blocks into buffers aligned on %BLOCK_DIRECT_ALIGN
+ * bytes (see block_alloc()) then go straight between the disk and the user
+ * buffers, without any copy. Other transfers still work, through an aligned
+ * intermediate buffer.
+ *
+ * Return: -1 if @flags is invalid, or if the virtual disk cannot be opened
+ * with these flags, otherwise same as fs_mount().
+ */
+int fs_mount_flags(const char *diskname, int flags);
+
 /**
  * fs_umount - Unmount file system
  *
@@ -45,6 +148,138 @@ int fs_umount(void);
  */
 int fs_info(void);
 
+/** Number of buckets of the histograms of struct fs_info_stats */
+#define FS_INFO_HIST_BUCKETS 32
+
+/**
+ * struct fs_info_stats - Space usage of a file system
+ * @total_blk_count: Total number of blocks of the virtual disk
+ * @fat_blk_count: Number of FAT blocks
+ * @rdir_blk: Index of the first root directory block
+ * @rdir_blk_count: Number of root directory blocks
+ * @data_blk: Index of the first data block
+ * @data_blk_count: Number of data blocks
+ * @blk_size: Block size in bytes
+ * @fat_entry_bits: Width of the FAT entries, 16 or 32
+ * @csum_blk_count: Number of checksum table blocks, 0 without checksums
+ * @fat_free: Number of free data blocks
+ * @rdir_count: Number of root directory entries
+ * @rdir_free: Number of free root directory entries
+ * @file_count: Number of files, empty ones included
+ * @used_blk_count: Number of data blocks held by files
+ * @reserved_blk_count: Number of those blocks past the end of their file, see
+ *                      fs_fallocate()
+ * @slack_bytes: Internal fragmentation, the unused bytes of the last data block
+ *               of each file
+ * @extent_count: Number of extents (runs of physically consecutive data
+ *                blocks) of all the files
+ * @max_file_extents: Largest number of extents of a single file
+ * @fragmented_count: Number of files made of more than one extent
+ * @free_extent_count: Number of runs of consecutive free data blocks
+ * @largest_free_extent: Length of the largest run of free data blocks
+ * @extent_hist: Number of non-empty files by extent count, bucket i counts
+ *               the files with [2^i, 2^(i+1)) extents
+ * @chain_hist: Number of non-empty files by FAT chain length, bucket i counts
+ *              the files of [2^i, 2^(i+1)) blocks
+ * @free_extent_hist: Number of runs of free data blocks by length, bucket i
+ *                    counts the runs of [2^i, 2^(i+1)) blocks
+ * @compressed_count: Number of compressed files, see &fs_format_opts.compress
+ * @compressed_bytes: Total size of these files
+ * @compressed_blk_count: Number of data blocks held by these files, included in
+ *                        @used_blk_count. Their slack is not counted in
+ *                        @slack_bytes.
+ * @dedup_count: Number of deduplicated files, see &fs_format_opts.dedup. Their
+ *               FAT chains hold the index of their data blocks.
+ * @dedup_blk_count: Number of distinct data blocks held by these files,
+ *                   included in @used_blk_count
+ * @dedup_ref_count: Number of file blocks referencing them.
+ *                   @dedup_ref_count / @dedup_blk_count is the deduplication
+ *                   ratio.
+ * @zero_blk_count: Number of all-zero blocks of these files, which are not
+ *                  stored and read without disk access
+ * @bounce_blk_count: Number of block buffers allocated by reads and writes
+ *                    since the mount, one per thread that did partial block
+ *                    I/O. It does not grow once each of them has one.
+ */
+struct fs_info_stats {
+	size_t total_blk_count;
+	size_t fat_blk_count;
+	size_t rdir_blk;
+	size_t rdir_blk_count;
+	size_t data_blk;
+	size_t data_blk_count;
+	size_t blk_size;
+	size_t fat_entry_bits;
+	size_t csum_blk_count;
+	size_t fat_free;
+	size_t rdir_count;
+	size_t rdir_free;
+	size_t file_count;
+	size_t used_blk_count;
+	size_t reserved_blk_count;
+	size_t slack_bytes;
+	size_t extent_count;
+	size_t max_file_extents;
+	size_t fragmented_count;
+	size_t free_extent_count;
+	size_t largest_free_extent;
+	size_t extent_hist[FS_INFO_HIST_BUCKETS];
+	size_t chain_hist[FS_INFO_HIST_BUCKETS];
+	size_t free_extent_hist[FS_INFO_HIST_BUCKETS];
+	size_t compressed_count;
+	size_t compressed_bytes;
+	size_t compressed_blk_count;
+	size_t dedup_count;
+	size_t dedup_blk_count;
+	size_t dedup_ref_count;
+	size_t zero_blk_count;
+	size_t bounce_blk_count;
+};
+
+/**
+ * fs_info_get - Get space usage information about file system
+ * @stats: Statistics to fill in
+ *
+ * Fill @stats with the geometry of the currently mounted file system, as
+ * displayed by fs_info(), and with an analysis of how its space is used: per
+ * file extent counts and chain lengths, internal fragmentation, and the
+ * fragmentation of the free space. The FAT is scanned once, in order, and each
+ * file chain is followed once.
+ *
+ * Return: -1 if no FS is currently mounted, or if @stats is NULL. 0 otherwise.
+ */
+int fs_info_get(struct fs_info_stats *stats);
+
+/**
+ * struct fs_statfs - Free space and file counts of a file system
+ * @blk_size: Block size in bytes
+ * @data_blk_count: Number of data blocks
+ * @free_blk_count: Number of free data blocks
+ * @file_count: Number of files
+ * @file_max: Number of root directory entries, the most files it can hold
+ */
+struct fs_statfs {
+	size_t blk_size;
+	size_t data_blk_count;
+	size_t free_blk_count;
+	size_t file_count;
+	size_t file_max;
+};
+
+/**
+ * fs_statfs - Get the free space of file system
+ * @st: Counts to fill in
+ *
+ * Fill @st with the free space and the number of files of the currently
+ * mounted file system. Unlike fs_info_get(), nothing is scanned: the counts are
+ * kept up to date by every operation, and saved in the superblock at unmount so
+ * that the next mount does not have to count them either. The blocks of
+ * deleted files are counted as free.
+ *
+ * Return: -1 if no FS is currently mounted, or if @st is NULL. 0 otherwise.
+ */
+int fs_statfs(struct fs_statfs *st);
+
 /**
  * fs_create - Create a new file
  * @filename: File name
@@ -56,7 +291,7 @@ int fs_info(void);
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if a
  * file named @filename already exists, or if string @filename is too long, or
- * if the root directory already contains %FS_FILE_MAX_COUNT files. 0 otherwise.
+ * if the root directory is full. 0 otherwise.
  */
 int fs_create(const char *filename);
 
@@ -65,7 +300,10 @@ int fs_create(const char *filename);
  * @filename: File name
  *
  * Delete the file named @filename from the root directory of the mounted file
- * system.
+ * system. Only the root directory entry is removed right away: the data blocks
+ * of the file are returned to the free pool later, in bulk, when space runs
+ * out, by fs_info(), fs_reclaim() or fs_umount(), or by the background
+ * reclamation thread (see fs_reclaim_background()).
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
  * Return: -1 if @filename is invalid, if there is no file named @filename to
@@ -82,6 +320,79 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/** &struct fs_dirent data_blk of an empty file */
+#define FS_DIRENT_NO_BLK ((size_t)-1)
+
+/**
+ * struct fs_dirent - File of the root directory, see fs_list()
+ * @name: Filename, NULL-terminated
+ * @size: File size in bytes
+ * @data_blk: First data block of the file, or %FS_DIRENT_NO_BLK
+ */
+struct fs_dirent {
+	char name[FS_FILENAME_LEN];
+	size_t size;
+	size_t data_blk;
+};
+
+/**
+ * fs_list - Get the files on file system
+ * @pattern: Shell wildcard pattern the filenames must match (see fnmatch(3)),
+ *           or NULL for all the files
+ * @ents: Array of @count entries to fill, can be NULL if @count is 0
+ * @count: Number of entries of @ents
+ *
+ * Fill @ents with the files whose name matches @pattern, in filename order.
+ * Filenames are kept sorted as files are created and deleted, so only the
+ * files sharing the characters of @pattern before its first wildcard are
+ * looked at: listing the files of a given prefix ("log_*") costs as much as
+ * looking up a single file, plus the files returned.
+ *
+ * Return: -1 if no FS is currently mounted, or if @ents is NULL while @count
+ * is not 0. Otherwise the number of files matching @pattern, of which the
+ * first @count are returned if there are more.
+ */
+int fs_list(const char *pattern, struct fs_dirent *ents, size_t count);
+
+/**
+ * struct fs_dir - Root directory iterator, see fs_opendir()
+ */
+struct fs_dir;
+
+/**
+ * fs_opendir - Start iterating over the files on file system
+ * @pattern: Shell wildcard pattern the filenames must match, or NULL for all
+ *           the files, as with fs_list()
+ *
+ * Create an iterator returning the files whose name matches @pattern, one at a
+ * time and in filename order (see fs_readdir()). The iterator can outlive the
+ * mount it was created under.
+ *
+ * Return: NULL if memory runs out. Otherwise the iterator.
+ */
+struct fs_dir *fs_opendir(const char *pattern);
+
+/**
+ * fs_readdir - Get the next file of an iterator
+ * @dir: Iterator
+ * @ent: Entry to fill
+ *
+ * Fill @ent with the first matching file whose name comes after the name
+ * returned by the previous call on @dir. Files created or deleted between
+ * calls are returned or not, depending on their names, but they never cause
+ * other files to be returned twice or skipped.
+ *
+ * Return: -1 if no FS is currently mounted, or if @dir or @ent is NULL. 0 when
+ * there are no more files. 1 otherwise.
+ */
+int fs_readdir(struct fs_dir *dir, struct fs_dirent *ent);
+
+/**
+ * fs_closedir - Release an iterator
+ * @dir: Iterator, or NULL
+ */
+void fs_closedir(struct fs_dir *dir);
+
 /**
  * fs_open - Open a file
  * @filename: File name
@@ -91,16 +402,43 @@ int fs_ls(void);
  * that is used subsequently to access the contents of the file. The file offset
  * of the file descriptor is set to 0 initially (beginning of the file). If the
  * same file is opened multiple files, fs_open() must return distinct file
- * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
+ * descriptors. A maximum of %FS_OPEN_MAX_COUNT_EXT files can be open
  * simultaneously.
  *
+ * On file systems formatted with compression, the file descriptors of a file
+ * share a cache of the cluster last accessed, which is written back when
+ * another cluster is accessed or when the file is last closed.
+ *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
  * there is no file named @filename to open, or if there are already
- * %FS_OPEN_MAX_COUNT files currently open. Otherwise, return the file
+ * %FS_OPEN_MAX_COUNT_EXT files currently open. Otherwise, return the file
  * descriptor.
  */
 int fs_open(const char *filename);
 
+/**
+ * fs_open_flags - Open a file with flags
+ * @filename: File name
+ * @flags: Bitwise OR of %FS_O_RDONLY, %FS_O_APPEND and %FS_O_DIRECT, or 0
+ *
+ * Same as fs_open(), with the following flags:
+ *
+ * %FS_O_RDONLY opens the file for reading only: fs_write(), fs_pwrite(),
+ * fs_writev(), fs_truncate() and fs_fallocate() fail on the file descriptor.
+ *
+ * %FS_O_APPEND moves the file offset to the end of the file before each
+ * fs_write() and fs_writev(). fs_pwrite() still writes at its own offset.
+ *
+ * %FS_O_DIRECT requires every read and write to start at a multiple of the
+ * block size and to use buffers whose sizes are multiples of it, so that the
+ * data moves between the disk and the user buffers without intermediate copy.
+ * Other transfers fail. Compressed and deduplicated files cannot be opened with
+ * %FS_O_DIRECT.
+ *
+ * Return: -1 if @flags holds an unknown flag, otherwise same as fs_open().
+ */
+int fs_open_flags(const char *filename, int flags);
+
 /**
  * fs_close - Close a file
  * @fd: File descriptor
@@ -108,7 +446,9 @@ int fs_open(const char *filename);
  * Close file descriptor @fd.
  *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (out of bounds or not currently open). 0 otherwise.
+ * invalid (out of bounds or not currently open), or if the cached cluster of a
+ * compressed file or the block index of a deduplicated file cannot be written
+ * back (@fd is closed nonetheless). 0 otherwise.
  */
 int fs_close(int fd);
 
@@ -176,10 +516,246 @@ int fs_write(int fd, void *buf, size_t count);
  * is at the end of the file). The file offset of the file descriptor is
  * implicitly incremented by the number of bytes that were actually read.
  *
+ * On file systems formatted with checksums, reading stops before the first
+ * block that does not match its checksum.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if
+ * the first block to read cannot be read or is corrupted. Otherwise return the
+ * number of bytes actually read.
+ */
+int fs_read(int fd, void *buf, size_t count);
+
+/**
+ * fs_pwrite - Write to a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset to write at
+ *
+ * Same as fs_write(), but write at @offset instead of the file offset of the
+ * file descriptor @fd, which is left unchanged.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if
+ * @offset is larger than the current file size. Otherwise return the number
+ * of bytes actually written.
+ */
+int fs_pwrite(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset to read from
+ *
+ * Same as fs_read(), but read from @offset instead of the file offset of the
+ * file descriptor @fd, which is left unchanged. Several readers can therefore
+ * share one file descriptor.
+ *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
  * return the number of bytes actually read.
  */
-int fs_read(int fd, void *buf, size_t count);
+int fs_pread(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_writev - Write to a file from several buffers
+ * @fd: File descriptor
+ * @iov: Array of buffers to write in the file, in order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Same as fs_write(), but gather the data from the @iovcnt buffers described
+ * by @iov as if they were a single contiguous buffer.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @iov or one of its
+ * buffers is NULL. Otherwise return the number of bytes actually written.
+ */
+int fs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_readv - Read from a file into several buffers
+ * @fd: File descriptor
+ * @iov: Array of buffers to be filled with data, in order
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Same as fs_read(), but scatter the data into the @iovcnt buffers described
+ * by @iov, filling each one before moving to the next.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @iov or one of its
+ * buffers is NULL. Otherwise return the number of bytes actually read.
+ */
+int fs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * struct fs_iter - Chunked reader of a file, see fs_iter_open()
+ */
+struct fs_iter;
+
+/**
+ * fs_iter_open - Start streaming a file in chunks
+ * @fd: File descriptor
+ * @chunk: Chunk size in bytes, rounded up to a multiple of the block size, or
+ *         0 for %FS_ITER_CHUNK
+ *
+ * Create an iterator delivering the content of the file referenced by file
+ * descriptor @fd, from its file offset to the end of the file, in chunks of
+ * @chunk bytes (see fs_iter_next()). The memory used is two chunks, whatever
+ * the size of the file: while the caller consumes one chunk, the next one is
+ * read from the disk in the background.
+ *
+ * @fd must stay open until fs_iter_close(). Data written to the file while
+ * iterating may or may not be seen, as with successive calls to fs_read().
+ *
+ * Return: NULL if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if memory runs out.
+ * Otherwise the iterator.
+ */
+struct fs_iter *fs_iter_open(int fd, size_t chunk);
+
+/**
+ * fs_iter_next - Get the next chunk of a file
+ * @it: Iterator
+ * @buf: Filled with the address of the chunk
+ *
+ * Point @buf to the next chunk of the file, which stays valid until the next
+ * call on @it. The file offset of the file descriptor is incremented by the
+ * size of the chunk, as if the chunk had been read with fs_read().
+ *
+ * Return: -1 if @it or @buf is NULL, or if the chunk cannot be read. 0 at the
+ * end of the file. Otherwise the size of the chunk, which is the chunk size of
+ * @it except for the last chunk of the file.
+ */
+int fs_iter_next(struct fs_iter *it, const void **buf);
+
+/**
+ * fs_iter_close - Release an iterator
+ * @it: Iterator, or NULL
+ *
+ * Stop the background reads of @it and release its memory.
+ */
+void fs_iter_close(struct fs_iter *it);
+
+/**
+ * fs_truncate - Set the size of a file
+ * @fd: File descriptor
+ * @length: New file size, in bytes
+ *
+ * Set the size of the file referenced by file descriptor @fd to @length bytes.
+ * A file that grows is filled with zeros. A file that shrinks (or keeps its
+ * size) has all the data blocks past @length freed, including the ones that
+ * were reserved with fs_fallocate(). The file offsets of the file descriptors
+ * are left unchanged.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if there is not enough
+ * space on disk to grow the file to @length bytes. 0 otherwise.
+ */
+int fs_truncate(int fd, size_t length);
+
+/**
+ * fs_fallocate - Reserve space for a file
+ * @fd: File descriptor
+ * @length: Number of bytes to reserve, from the start of the file
+ *
+ * Allocate the data blocks needed to hold the first @length bytes of the file
+ * referenced by file descriptor @fd, preferably as one contiguous run. The file
+ * size is not changed: later writes up to @length bytes use the reserved
+ * blocks and do not need to allocate any. Reserved blocks past the end of the
+ * file are released by fs_truncate() and fs_delete().
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if the file is compressed
+ * or deduplicated, or if there is not enough free space on disk, in which case
+ * nothing is allocated. 0 otherwise.
+ */
+int fs_fallocate(int fd, size_t length);
+
+/**
+ * fs_frag_report - Measure fragmentation
+ * @report: Report to fill in
+ *
+ * Fill @report with the fragmentation of the files and of the free space of
+ * the currently mounted file system.
+ *
+ * Return: -1 if no FS is currently mounted, or if @report is NULL. 0
+ * otherwise.
+ */
+int fs_frag_report(struct fs_frag_report *report);
+
+/**
+ * fs_defrag - Defragment files
+ * @max_blocks: Maximum number of blocks to move, 0 for no limit
+ *
+ * Move the files made of several extents, one at a time, to a run of free
+ * blocks large enough to hold them contiguously. A file is switched over to
+ * its new blocks only once they all hold its data. Files that no free run can
+ * hold are left as they are.
+ *
+ * With a non-zero @max_blocks, the work is done incrementally: the call stops
+ * before the file that would bring the number of moved blocks over
+ * @max_blocks (but always moves at least one file if it can), and the next
+ * call resumes from there. Calling fs_defrag() until it returns 0 moves every
+ * file that can be made contiguous.
+ *
+ * Return: -1 if no FS is currently mounted, or in case of I/O error. Otherwise
+ * return the number of blocks moved.
+ */
+int fs_defrag(size_t max_blocks);
+
+/**
+ * fs_reclaim - Free the data blocks of deleted files
+ *
+ * Return the data blocks of all the files deleted with fs_delete() and not
+ * reclaimed yet to the free pool.
+ *
+ * Return: -1 if no FS is currently mounted. Otherwise return the number of
+ * blocks freed.
+ */
+int fs_reclaim(void);
+
+/**
+ * fs_reclaim_background - Free the blocks of deleted files in the background
+ * @enable: Start (non-zero) or stop (zero) the reclamation thread
+ *
+ * Start or stop a thread which frees the data blocks of deleted files soon
+ * after fs_delete() returns, in small batches, instead of waiting for them to
+ * be needed. The file system API is serialized by a lock, so the thread only
+ * runs between calls. The setting survives fs_umount().
+ *
+ * Return: -1 if the thread cannot be started. 0 otherwise.
+ */
+int fs_reclaim_background(int enable);
+
+/**
+ * fs_trace_start - Start recording a trace of file system calls
+ * @tracefile: Name of the trace file
+ *
+ * Create (or truncate) trace file @tracefile and record every subsequent call
+ * to the file system API (except fs_format()) in it: operation, file
+ * descriptor, offset, size, return value, start time and duration. The trace
+ * can be replayed against a virtual disk with fs_replay.x.
+ *
+ * Tracing can also be turned on without modifying an application, by setting
+ * the environment variable FS_TRACE to the trace filename: the trace then
+ * starts with the first fs_mount().
+ *
+ * Return: -1 if @tracefile is invalid or cannot be created, or if a trace is
+ * already being recorded. 0 otherwise.
+ */
+int fs_trace_start(const char *tracefile);
+
+/**
+ * fs_trace_stop - Stop recording a trace
+ *
+ * Stop recording and close the current trace file.
+ *
+ * Return: -1 if no trace is being recorded, or if the trace file cannot be
+ * written. 0 otherwise.
+ */
+int fs_trace_stop(void);
 
 #endif /* _FS_H */
@@ -0,0 +1,86 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "hash64.h"
+
+#define P1 11400714785074694791ULL
+#define P2 14029467366897019727ULL
+#define P3 1609587929392839161ULL
+#define P4 9650029242287828579ULL
+#define P5 2870177450012600261ULL
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input)
+{
+	acc += input * P2;
+	return rotl(acc, 31) * P1;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t val)
+{
+	acc ^= round64(0, val);
+	return acc * P1 + P4;
+}
+
+uint64_t hash64(const void *buf, size_t len)
+{
+	const uint8_t *p = buf, *end = p + len;
+	uint64_t h;
+
+	if (len >= 32) {
+		/* four independent lanes of 8 bytes */
+		uint64_t v1 = P1 + P2, v2 = P2, v3 = 0, v4 = -P1;
+
+		do {
+			v1 = round64(v1, read64(p));
+			v2 = round64(v2, read64(p + 8));
+			v3 = round64(v3, read64(p + 16));
+			v4 = round64(v4, read64(p + 24));
+			p += 32;
+		} while (end - p >= 32);
+		h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+		h = merge64(h, v1);
+		h = merge64(h, v2);
+		h = merge64(h, v3);
+		h = merge64(h, v4);
+	} else {
+		h = P5;
+	}
+	h += len;
+
+	for (; end - p >= 8; p += 8) {
+		h ^= round64(0, read64(p));
+		h = rotl(h, 27) * P1 + P4;
+	}
+	if (end - p >= 4) {
+		uint32_t v;
+
+		memcpy(&v, p, sizeof(v));
+		h ^= v * P1;
+		h = rotl(h, 23) * P2 + P3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= *p * P5;
+		h = rotl(h, 11) * P1;
+	}
+
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	h *= P3;
+	h ^= h >> 32;
+	return h;
+}
@@ -0,0 +1,14 @@
+#ifndef _HASH64_H
+#define _HASH64_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * 64-bit non-cryptographic hash of the @len bytes of @buf (XXH64 with seed 0),
+ * about one CPU cycle per byte. Used to look up blocks by content; equal hashes
+ * still need their data compared.
+ */
+uint64_t hash64(const void *buf, size_t len);
+
+#endif /* _HASH64_H */
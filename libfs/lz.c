@@ -0,0 +1,172 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+/* the last match starts at least 12 bytes before the end of the input and the
+ * last 5 bytes are always literals, as the LZ4 format requires */
+#define LZ_MF_LIMIT 12
+#define LZ_LAST_LITERALS 5
+
+/* hash table of the compressor, one entry per 4-byte sequence hash */
+#define LZ_HASH_BITS 12
+
+static inline uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t hash4(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* bytes needed by a length of @len past the 15 of its token nibble */
+static inline size_t len_bytes(size_t len)
+{
+	return len >= 15 ? (len - 15) / 255 + 1 : 0;
+}
+
+static uint8_t *put_len(uint8_t *op, size_t len)
+{
+	if (len < 15)
+		return op;
+	for (len -= 15; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+/* token and literals of one sequence, NULL if they do not fit before @oend */
+static uint8_t *put_literals(uint8_t *op, uint8_t *oend, const uint8_t *lit,
+			     size_t len, size_t match)
+{
+	size_t need = 1 + len_bytes(len) + len;
+
+	if (match)
+		need += 2 + len_bytes(match - LZ_MIN_MATCH);
+	if (need > (size_t)(oend - op))
+		return NULL;
+	*op++ = (len < 15 ? len : 15) << 4;
+	op = put_len(op, len);
+	memcpy(op, lit, len);
+	return op + len;
+}
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap)
+{
+	const uint8_t *base = src, *ip = base, *anchor = base, *end = base + len;
+	uint8_t *op = dst, *oend = op + cap, *token;
+	uint32_t table[1 << LZ_HASH_BITS];
+
+	if (len > LZ_MF_LIMIT) {
+		const uint8_t *mflimit = end - LZ_MF_LIMIT;
+		const uint8_t *mlimit = end - LZ_LAST_LITERALS;
+
+		memset(table, 0, sizeof(table));
+		for (ip++; ip < mflimit;) {
+			uint32_t h = hash4(read32(ip));
+			const uint8_t *ref = base + table[h];
+			size_t mlen = LZ_MIN_MATCH;
+
+			table[h] = ip - base;
+			if (ref >= ip || ip - ref > LZ_MAX_OFFSET ||
+			    read32(ref) != read32(ip)) {
+				ip++;
+				continue;
+			}
+
+			while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+				mlen++;
+			}
+			while (ip + mlen < mlimit && ip[mlen] == ref[mlen])
+				mlen++;
+
+			token = op;
+			op = put_literals(op, oend, anchor, ip - anchor, mlen);
+			if (!op)
+				return 0;
+			*op++ = (ip - ref) & 0xFF;
+			*op++ = (ip - ref) >> 8;
+			mlen -= LZ_MIN_MATCH;
+			*token |= mlen < 15 ? mlen : 15;
+			op = put_len(op, mlen);
+
+			ip += mlen + LZ_MIN_MATCH;
+			anchor = ip;
+			if (ip < mflimit)
+				table[hash4(read32(ip - 2))] = ip - 2 - base;
+		}
+	}
+
+	op = put_literals(op, oend, anchor, end - anchor, 0);
+	return op ? (size_t)(op - (uint8_t*)dst) : 0;
+}
+
+/* extension bytes of a token length, -1 past the end of the input */
+static int get_len(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+	uint8_t b;
+
+	if (*len != 15)
+		return 0;
+	do {
+		if (*ip >= iend)
+			return -1;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+	return 0;
+}
+
+int lz_decompress(const void *src, size_t len, void *dst, size_t cap)
+{
+	const uint8_t *ip = src, *iend = ip + len, *ref;
+	uint8_t *op = dst, *oend = op + cap;
+
+	if (cap > INT32_MAX)
+		return -1;
+	while (ip < iend) {
+		uint8_t token = *ip++;
+		size_t lit = token >> 4, mlen = token & 15, off;
+
+		if (get_len(&ip, iend, &lit) || lit > (size_t)(iend - ip) ||
+		    lit > (size_t)(oend - op))
+			return -1;
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		/* the last sequence has no match */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		off = ip[0] | (size_t)ip[1] << 8;
+		ip += 2;
+		if (get_len(&ip, iend, &mlen))
+			return -1;
+		mlen += LZ_MIN_MATCH;
+		if (off == 0 || off > (size_t)(op - (uint8_t*)dst) ||
+		    mlen > (size_t)(oend - op))
+			return -1;
+
+		/* matches can overlap their own output */
+		ref = op - off;
+		if (off >= mlen) {
+			memcpy(op, ref, mlen);
+			op += mlen;
+		} else {
+			while (mlen--)
+				*op++ = *ref++;
+		}
+	}
+	return op - (uint8_t*)dst;
+}
@@ -0,0 +1,26 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+#include <stddef.h>
+
+/*
+ * LZ77 compression in the LZ4 block format: a sequence of tokens, each one a
+ * run of literals followed by a match of at least 4 bytes, at most 64 KiB back
+ * in the output. Fast enough to sit on the block I/O path, and decompression
+ * checks every length and offset against the buffers so corrupted input
+ * cannot overflow them.
+ */
+
+/*
+ * Compress the @len bytes of @src into @dst, which holds @cap bytes. Return
+ * the compressed size, or 0 if it does not fit @cap.
+ */
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap);
+
+/*
+ * Decompress the @len bytes of @src into @dst, which holds @cap bytes. Return
+ * the decompressed size, or -1 if @src is corrupted or does not fit @cap.
+ */
+int lz_decompress(const void *src, size_t len, void *dst, size_t cap);
+
+#endif /* _LZ_H */
@@ -0,0 +1,137 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fs.h"
+#include "trace.h"
+
+#define trace_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Size of the stdio buffer in front of the trace file */
+#define TRACE_BUFFER_SIZE (64 * 1024)
+
+int trace_enabled;
+
+/* Currently open trace file, and clock value when it was started */
+static FILE *trace_file;
+static uint64_t trace_epoch;
+
+/* Calls that only read record themselves concurrently, see fsLockShared() */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t trace_now(void)
+{
+	return clock_ns() - trace_epoch;
+}
+
+int fs_trace_start(const char *tracefile)
+{
+	struct trace_header header = {
+		.record_size = sizeof(struct trace_record),
+	};
+
+	if (!tracefile) {
+		trace_error("invalid trace filename");
+		return -1;
+	}
+
+	if (trace_file) {
+		trace_error("trace already started");
+		return -1;
+	}
+
+	trace_file = fopen(tracefile, "wb");
+	if (!trace_file) {
+		perror("fopen");
+		return -1;
+	}
+	setvbuf(trace_file, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	if (fwrite(&header, sizeof(header), 1, trace_file) != 1) {
+		perror("fwrite");
+		fclose(trace_file);
+		trace_file = NULL;
+		return -1;
+	}
+
+	trace_epoch = clock_ns();
+	trace_enabled = 1;
+
+	return 0;
+}
+
+/* with trace_lock held */
+static int trace_close(void)
+{
+	int ret;
+
+	trace_enabled = 0;
+	ret = fclose(trace_file);
+	trace_file = NULL;
+
+	return ret ? -1 : 0;
+}
+
+int fs_trace_stop(void)
+{
+	int ret;
+
+	pthread_mutex_lock(&trace_lock);
+	if (!trace_file) {
+		pthread_mutex_unlock(&trace_lock);
+		trace_error("no trace started");
+		return -1;
+	}
+	ret = trace_close();
+	pthread_mutex_unlock(&trace_lock);
+
+	return ret;
+}
+
+void trace_record(enum trace_op op, uint64_t start, int fd, int ret,
+		  uint64_t offset, size_t size, int iovcnt, const char *name)
+{
+	struct trace_record rec;
+	uint64_t duration = trace_now() - start;
+	size_t name_len = name ? strnlen(name, FS_FILENAME_LEN - 1) : 0;
+
+	rec.start_ns = start;
+	rec.duration_ns = duration > UINT32_MAX ? UINT32_MAX : duration;
+	rec.op = op;
+	rec.name_len = name_len;
+	rec.iovcnt = iovcnt;
+	rec.fd = fd;
+	rec.ret = ret;
+	rec.offset = offset;
+	rec.size = size > UINT32_MAX ? UINT32_MAX : size;
+
+	/* A failed write only loses the trace, never the call itself */
+	pthread_mutex_lock(&trace_lock);
+	if (trace_file &&
+	    (fwrite(&rec, sizeof(rec), 1, trace_file) != 1 ||
+	     (name_len && fwrite(name, 1, name_len, trace_file) != name_len))) {
+		perror("fwrite");
+		trace_close();
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_flush(void)
+{
+	pthread_mutex_lock(&trace_lock);
+	if (trace_file)
+		fflush(trace_file);
+	pthread_mutex_unlock(&trace_lock);
+}
@@ -0,0 +1,76 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Binary trace of libfs calls, see fs_trace_start(). A trace file starts with
+ * a struct trace_header, followed by one struct trace_record per call. Name
+ * based calls (create, delete, open, list) are followed by the @name_len bytes
+ * of the filename or pattern, without NULL character and cut to
+ * FS_FILENAME_LEN - 1 bytes. Everything is in host byte order.
+ */
+
+#define TRACE_MAGIC "FSTRACE1"
+
+enum trace_op {
+	TRACE_MOUNT = 1,
+	TRACE_UMOUNT,
+	TRACE_INFO,
+	TRACE_CREATE,
+	TRACE_DELETE,
+	TRACE_LS,
+	TRACE_OPEN,
+	TRACE_CLOSE,
+	TRACE_STAT,
+	TRACE_LSEEK,
+	TRACE_WRITE,
+	TRACE_READ,
+	TRACE_PWRITE,
+	TRACE_PREAD,
+	TRACE_WRITEV,
+	TRACE_READV,
+	TRACE_TRUNCATE,
+	TRACE_FALLOCATE,
+	TRACE_RECLAIM,
+	TRACE_DEFRAG,
+	TRACE_FRAG_REPORT,
+	TRACE_INFO_GET,
+	TRACE_STATFS,
+	TRACE_LIST,
+	TRACE_OP_COUNT
+};
+
+struct __attribute__((packed)) trace_header {
+	char magic[8];
+	/* sizeof(struct trace_record) of the recorder */
+	uint32_t record_size;
+};
+
+struct __attribute__((packed)) trace_record {
+	/* call start, in nanoseconds since the trace was started */
+	uint64_t start_ns;
+	/* call duration in nanoseconds, saturated */
+	uint32_t duration_ns;
+	uint8_t op;
+	uint8_t name_len;
+	/* number of buffers of readv/writev calls */
+	uint16_t iovcnt;
+	int32_t fd;
+	int32_t ret;
+	/* file offset the call read or wrote at, lseek target, new length,
+	 * fs_defrag() budget, fs_list() entry count, or open and mount flags */
+	uint64_t offset;
+	/* requested byte count */
+	uint32_t size;
+};
+
+/* Internal recorder interface, used by fs.c */
+extern int trace_enabled;
+uint64_t trace_now(void);
+void trace_record(enum trace_op op, uint64_t start, int fd, int ret,
+		  uint64_t offset, size_t size, int iovcnt, const char *name);
+void trace_flush(void);
+
+#endif /* _TRACE_H */